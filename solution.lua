@@ -12,6 +12,18 @@ Projects =
     dir = "src/test",
     type = "console",
   },
+
+  -- test_math
+  {
+    dir = "src/test_math",
+    type = "console",
+  },
+
+  -- bench_text
+  {
+    dir = "src/bench_text",
+    type = "console",
+  },
   
   -- fontconv
   {
@@ -0,0 +1,106 @@
+#define GL3D_IMPLEMENTATION
+#include <gl3d/gl3d_win32.h>
+#include <chrono>
+#include <cstdio>
+#include <map>
+
+// Text layout throughput of the built-in font with the flat glyph and kerning tables, against the std::map lookups
+// they replaced (operator[] included, which inserted an entry for every missing glyph and pair). Needs no GL context.
+
+using namespace gl3d;
+
+// The previous lookups, built from the same font data
+struct map_font
+{
+  std::map<int, detail::font::char_info> char_infos;
+  std::map<uint64_t, int> kernings;
+
+  map_font(const detail::font &f)
+  {
+    for (auto &&chi : f.char_infos) char_infos[chi.id] = chi;
+    for (auto &&a : f.char_infos)
+      for (auto &&b : f.char_infos)
+      {
+        int k = f.kerning(a.id, b.id);
+        if (k) kernings[static_cast<uint64_t>(a.id) | (static_cast<uint64_t>(b.id) << 32)] = k;
+      }
+  }
+
+  size_t layout(float x, float y, const vec4 &color, const char *text, size_t length, detail::vertex2d *output)
+  {
+    auto *v = output;
+    uint64_t prevID = 0;
+
+    for (; length; ++text, --length)
+    {
+      auto &chi = char_infos[*text];
+      if (chi.id <= 0) { prevID = 0; continue; }
+
+      int ker = kernings[prevID | (static_cast<uint64_t>(chi.id) << 32ull)];
+      float ox = x + static_cast<float>(chi.offset.x + ker);
+      float oy = y + static_cast<float>(chi.offset.y);
+      v->pos = vec2(ox, oy); v->color = color; v->uv = chi.uv[0]; ++v;
+      v->pos = vec2(ox + chi.size.x, oy); v->color = color; v->uv = chi.uv[1]; ++v;
+      v->pos = vec2(ox + chi.size.x, oy + chi.size.y); v->color = color; v->uv = chi.uv[2]; ++v;
+      v->pos = vec2(ox, oy + chi.size.y); v->color = color; v->uv = chi.uv[3]; ++v;
+
+      x += static_cast<float>(chi.x_advance + ker);
+      prevID = chi.id;
+    }
+
+    return static_cast<size_t>(v - output);
+  }
+};
+
+template <typename F> static double glyphs_per_second(size_t glyphs, F &&fn)
+{
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return glyphs / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+  static const char *sample =
+    "The quick brown fox jumps over the lazy dog. AVA To Wa Yo 0123456789 (x + y) * z = {a, b}; "
+    "Frame 1234: 16.67 ms, 2048 draws, 1.5M triangles. Caf\xe9 na\xefve \xfc" "ber d\xe9j\xe0 vu! ";
+
+  detail::font f(default_font_base64);
+  map_font before(f);
+
+  std::string text;
+  while (text.size() < 64 * 1024) text += sample;
+
+  std::vector<detail::vertex2d> vertices(text.size() * 4);
+  const int rounds = 200;
+  size_t glyphs = text.size() * rounds;
+  float sink = 0;
+
+  for (int repeat = 0; repeat < 2; ++repeat)
+  {
+    // the first round warms up caches and clocks
+    double mapRate = glyphs_per_second(glyphs, [&]() {
+      for (int i = 0; i < rounds; ++i)
+        sink += vertices[before.layout(0, 0, vec4::one(), text.data(), text.size(), vertices.data()) - 1].pos.x;
+    });
+
+    double flatRate = glyphs_per_second(glyphs, [&]() {
+      for (int i = 0; i < rounds; ++i)
+      {
+        float x = 0, y = 0;
+        size_t written = detail::layout_substring(&f, x, y, vec4::one(), text.data(), text.size(), vertices.data());
+        sink += vertices[written - 1].pos.x;
+      }
+    });
+
+    if (repeat == 1)
+    {
+      printf("std::map lookups: %7.1f M glyphs/s (%zu glyphs, %zu kerning pairs after the run)\n",
+        mapRate / 1e6, before.char_infos.size(), before.kernings.size());
+      printf("flat tables:      %7.1f M glyphs/s (%zu glyphs)\n", flatRate / 1e6, f.char_infos.size());
+      printf("speedup:          %7.2fx (%g)\n", flatRate / mapRate, sink);
+    }
+  }
+
+  return 0;
+}
@@ -1,9 +1,21 @@
 #ifndef __GL3D_H__
 #define __GL3D_H__
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <new>
+#include <unordered_map>
 
 #if !defined(GL3D_APIENTRY)
 #if defined(WIN32)
@@ -15,10 +27,23 @@
 
 #if defined(WIN32)
 #include <windows.h>
+#include <gl/GL.h>
 #else
+#include <GL/gl.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
-#include <gl/GL.h>
+// Platform backends without WGL define this before including gl3d (e.g. eglGetProcAddress)
+#if !defined(GL3D_GET_PROC_ADDRESS)
+#if defined(WIN32)
+#define GL3D_GET_PROC_ADDRESS(name) wglGetProcAddress(name)
+#else
+#error "GL3D_GET_PROC_ADDRESS must be defined, or include a platform backend (gl3d_headless.h) first"
+#endif
+#endif
 
 #define GL3D_UNIFORM_PROJECTION_MATRIX "u_ProjectionMatrix"
 #define GL3D_UNIFORM_MODELVIEW_MATRIX "u_ModelviewMatrix"
@@ -38,9 +63,20 @@ namespace detail {
   gl_ ## name ## _ptr_t name = nullptr; \
   private: \
   __init __init ## name = __init(_initializers, reinterpret_cast<void **>(&name), [](void **ptr)->bool{ \
-    *ptr = wglGetProcAddress("gl" ## #name); return (*ptr) != nullptr; }); \
+    *ptr = reinterpret_cast<void *>(GL3D_GET_PROC_ADDRESS("gl" #name)); return (*ptr) != nullptr; }); \
+  public:
+
+// Same as GL3D_API_FUNC, but a missing function does not fail init(), check it for nullptr before use
+#define GL3D_API_FUNC_OPT(retValue, name, ...) \
+  public: typedef retValue(GL3D_APIENTRY *gl_ ## name ## _ptr_t)(__VA_ARGS__); \
+  gl_ ## name ## _ptr_t name = nullptr; \
+  private: \
+  __init __init ## name = __init(_initializers, reinterpret_cast<void **>(&name), [](void **ptr)->bool{ \
+    *ptr = reinterpret_cast<void *>(GL3D_GET_PROC_ADDRESS("gl" #name)); return true; }); \
   public:
 
+typedef struct __GLsync *GLsync;
+
 //---------------------------------------------------------------------------------------------------------------------
 class gl_api
 {
@@ -62,6 +98,7 @@ public:
   GL3D_API_FUNC(void, DeleteBuffers, GLsizei, const GLuint *)
   GL3D_API_FUNC(void, BindBuffer, GLenum, GLuint)
   GL3D_API_FUNC(void, BufferData, GLenum, ptrdiff_t, const GLvoid *, GLenum)
+  GL3D_API_FUNC(void, BufferSubData, GLenum, ptrdiff_t, ptrdiff_t, const GLvoid *)
   GL3D_API_FUNC(void, GenVertexArrays, GLsizei, GLuint *)
   GL3D_API_FUNC(void, BindVertexArray, GLuint)
   GL3D_API_FUNC(void, EnableVertexAttribArray, GLuint)
@@ -81,15 +118,113 @@ public:
   GL3D_API_FUNC(void, UseProgram, GLuint)
   GL3D_API_FUNC(void, GetProgramiv, GLuint, GLenum, GLint *)
   GL3D_API_FUNC(GLint, GetUniformLocation, GLuint, const char *)
+  GL3D_API_FUNC(void, GetActiveUniform, GLuint, GLuint, GLsizei, GLsizei *, GLint *, GLenum *, char *)
   GL3D_API_FUNC(void, Uniform1i, GLint, GLint)
+  GL3D_API_FUNC(void, Uniform1f, GLint, GLfloat)
   GL3D_API_FUNC(void, Uniform2fv, GLint, GLsizei, const GLfloat *)
+  GL3D_API_FUNC(void, Uniform3fv, GLint, GLsizei, const GLfloat *)
+  GL3D_API_FUNC(void, Uniform4fv, GLint, GLsizei, const GLfloat *)
   GL3D_API_FUNC(void, UniformMatrix4fv, GLint, GLsizei, GLboolean, const GLfloat *)
   GL3D_API_FUNC(void, ActiveTexture, GLenum)
+  GL3D_API_FUNC(void, DrawRangeElements, GLenum, GLuint, GLuint, GLsizei, GLenum, const GLvoid *)
+  GL3D_API_FUNC(void, DrawArraysInstanced, GLenum, GLint, GLsizei, GLsizei)
+  GL3D_API_FUNC(void, DrawElementsInstanced, GLenum, GLsizei, GLenum, const GLvoid *, GLsizei)
+  GL3D_API_FUNC(void, DrawElementsInstancedBaseVertex, GLenum, GLsizei, GLenum, const GLvoid *, GLsizei, GLint)
+  GL3D_API_FUNC(void, MultiDrawArrays, GLenum, const GLint *, const GLsizei *, GLsizei)
+  GL3D_API_FUNC(void, MultiDrawElementsBaseVertex, GLenum, const GLsizei *, GLenum, const GLvoid *const *, GLsizei,
+    const GLint *)
+  GL3D_API_FUNC(void *, MapBufferRange, GLenum, ptrdiff_t, ptrdiff_t, GLbitfield)
+  GL3D_API_FUNC(GLboolean, UnmapBuffer, GLenum)
+  GL3D_API_FUNC(void, CopyBufferSubData, GLenum, GLenum, ptrdiff_t, ptrdiff_t, ptrdiff_t)
+  GL3D_API_FUNC(GLsync, FenceSync, GLenum, GLbitfield)
+  GL3D_API_FUNC(GLenum, ClientWaitSync, GLsync, GLbitfield, uint64_t)
+  GL3D_API_FUNC(void, DeleteSync, GLsync)
+  GL3D_API_FUNC(void, GenFramebuffers, GLsizei, GLuint *)
+  GL3D_API_FUNC(void, DeleteFramebuffers, GLsizei, const GLuint *)
+  GL3D_API_FUNC(void, BindFramebuffer, GLenum, GLuint)
+  GL3D_API_FUNC(void, FramebufferTexture2D, GLenum, GLenum, GLenum, GLuint, GLint)
+  GL3D_API_FUNC(void, FramebufferRenderbuffer, GLenum, GLenum, GLenum, GLuint)
+  GL3D_API_FUNC(GLenum, CheckFramebufferStatus, GLenum)
+  GL3D_API_FUNC(void, GenRenderbuffers, GLsizei, GLuint *)
+  GL3D_API_FUNC(void, DeleteRenderbuffers, GLsizei, const GLuint *)
+  GL3D_API_FUNC(void, BindRenderbuffer, GLenum, GLuint)
+  GL3D_API_FUNC(void, RenderbufferStorageMultisample, GLenum, GLsizei, GLenum, GLsizei, GLsizei)
+  GL3D_API_FUNC(void, BlitFramebuffer, GLint, GLint, GLint, GLint, GLint, GLint, GLint, GLint, GLbitfield, GLenum)
+  GL3D_API_FUNC(void, DrawBuffers, GLsizei, const GLenum *)
+  GL3D_API_FUNC(void, CompressedTexImage2D, GLenum, GLint, GLenum, GLsizei, GLsizei, GLint, GLsizei, const GLvoid *)
+  GL3D_API_FUNC(void, CompressedTexSubImage2D, GLenum, GLint, GLint, GLint, GLsizei, GLsizei, GLenum, GLsizei,
+    const GLvoid *)
+  GL3D_API_FUNC(void, TexImage3D, GLenum, GLint, GLint, GLsizei, GLsizei, GLsizei, GLint, GLenum, GLenum,
+    const GLvoid *)
+  GL3D_API_FUNC(void, TexSubImage3D, GLenum, GLint, GLint, GLint, GLint, GLsizei, GLsizei, GLsizei, GLenum, GLenum,
+    const GLvoid *)
+  GL3D_API_FUNC(void, CompressedTexImage3D, GLenum, GLint, GLenum, GLsizei, GLsizei, GLsizei, GLint, GLsizei,
+    const GLvoid *)
+  GL3D_API_FUNC(void, CompressedTexSubImage3D, GLenum, GLint, GLint, GLint, GLint, GLsizei, GLsizei, GLsizei, GLenum,
+    GLsizei, const GLvoid *)
+  GL3D_API_FUNC_OPT(void, VertexAttribDivisor, GLuint, GLuint) // GL 3.3
+  GL3D_API_FUNC_OPT(void, BufferStorage, GLenum, ptrdiff_t, const GLvoid *, GLbitfield) // GL 4.4 / ARB_buffer_storage
+  GL3D_API_FUNC_OPT(void, ProgramParameteri, GLuint, GLenum, GLint) // GL 4.1 / ARB_get_program_binary
+  GL3D_API_FUNC_OPT(void, GetProgramBinary, GLuint, GLsizei, GLsizei *, GLenum *, void *)
+  GL3D_API_FUNC_OPT(void, ProgramBinary, GLuint, GLenum, const void *, GLsizei)
+  GL3D_API_FUNC_OPT(const GLubyte *, GetStringi, GLenum, GLuint) // GL 3.0
+  GL3D_API_FUNC_OPT(void, MaxShaderCompilerThreadsKHR, GLuint) // KHR_parallel_shader_compile
+  GL3D_API_FUNC_OPT(void, BindBufferBase, GLenum, GLuint, GLuint) // GL 3.0
+  GL3D_API_FUNC_OPT(void, BindBufferRange, GLenum, GLuint, GLuint, ptrdiff_t, ptrdiff_t)
+  GL3D_API_FUNC_OPT(void, GetBufferSubData, GLenum, ptrdiff_t, ptrdiff_t, GLvoid *)
+  GL3D_API_FUNC_OPT(void, BindImageTexture, GLuint, GLuint, GLint, GLboolean, GLint, GLenum, GLenum) // GL 4.2
+  GL3D_API_FUNC_OPT(void, MemoryBarrier, GLbitfield)
+  GL3D_API_FUNC_OPT(void, DispatchCompute, GLuint, GLuint, GLuint) // GL 4.3
+  GL3D_API_FUNC_OPT(void, DispatchComputeIndirect, ptrdiff_t)
+  GL3D_API_FUNC_OPT(void, MultiDrawArraysIndirect, GLenum, const GLvoid *, GLsizei, GLsizei)
+  GL3D_API_FUNC_OPT(void, MultiDrawElementsIndirect, GLenum, GLenum, const GLvoid *, GLsizei, GLsizei)
+  GL3D_API_FUNC_OPT(void, InvalidateFramebuffer, GLenum, GLsizei, const GLenum *) // GL 4.3
+  GL3D_API_FUNC_OPT(void, TexStorage2D, GLenum, GLsizei, GLenum, GLsizei, GLsizei) // GL 4.2 / ARB_texture_storage
+  GL3D_API_FUNC_OPT(void, TexStorage3D, GLenum, GLsizei, GLenum, GLsizei, GLsizei, GLsizei)
     
+  static const GLbitfield MAP_WRITE_BIT = 0x0002;
+  static const GLbitfield MAP_INVALIDATE_RANGE_BIT = 0x0004;
+  static const GLbitfield MAP_UNSYNCHRONIZED_BIT = 0x0020;
+  static const GLbitfield MAP_PERSISTENT_BIT = 0x0040;
+  static const GLbitfield MAP_COHERENT_BIT = 0x0080;
+  static const GLbitfield SYNC_FLUSH_COMMANDS_BIT = 0x0001;
+  static const GLbitfield VERTEX_ATTRIB_ARRAY_BARRIER_BIT = 0x0001;
+  static const GLbitfield ELEMENT_ARRAY_BARRIER_BIT = 0x0002;
+  static const GLbitfield UNIFORM_BARRIER_BIT = 0x0004;
+  static const GLbitfield TEXTURE_FETCH_BARRIER_BIT = 0x0008;
+  static const GLbitfield SHADER_IMAGE_ACCESS_BARRIER_BIT = 0x0020;
+  static const GLbitfield COMMAND_BARRIER_BIT = 0x0040;
+  static const GLbitfield PIXEL_BUFFER_BARRIER_BIT = 0x0080;
+  static const GLbitfield TEXTURE_UPDATE_BARRIER_BIT = 0x0100;
+  static const GLbitfield BUFFER_UPDATE_BARRIER_BIT = 0x0200;
+  static const GLbitfield FRAMEBUFFER_BARRIER_BIT = 0x0400;
+  static const GLbitfield SHADER_STORAGE_BARRIER_BIT = 0x2000;
+  static const GLbitfield ALL_BARRIER_BITS = 0xFFFFFFFF;
+  static const GLenum TEXTURE_3D = 0x806F;
+  static const GLenum TEXTURE_WRAP_R = 0x8072;
   static const GLenum CLAMP_TO_EDGE = 0x812F;
+  static const GLenum TEXTURE_BASE_LEVEL = 0x813C;
+  static const GLenum TEXTURE_MAX_LEVEL = 0x813D;
+  static const GLenum DEPTH_COMPONENT24 = 0x81A6;
+  static const GLenum DEPTH_COMPONENT32 = 0x81A7;
+  static const GLenum DEPTH_STENCIL_ATTACHMENT = 0x821A;
+  static const GLenum MAJOR_VERSION = 0x821B;
+  static const GLenum MINOR_VERSION = 0x821C;
+  static const GLenum NUM_EXTENSIONS = 0x821D;
+  static const GLenum PROGRAM_BINARY_RETRIEVABLE_HINT = 0x8257;
+  static const GLenum COMPUTE_WORK_GROUP_SIZE = 0x8267;
   static const GLenum TEXTURE0 = 0x84C0;
   static const GLenum TEXTURE_CUBE_MAP = 0x8513;
+  static const GLenum TEXTURE_CUBE_MAP_POSITIVE_X = 0x8515;
+  static const GLenum DEPTH_STENCIL = 0x84F9;
+  static const GLenum UNSIGNED_INT_24_8 = 0x84FA;
+  static const GLenum PROGRAM_BINARY_LENGTH = 0x8741;
+  static const GLenum NUM_PROGRAM_BINARY_FORMATS = 0x87FE;
+  static const GLenum READ_ONLY = 0x88B8;
+  static const GLenum WRITE_ONLY = 0x88B9;
+  static const GLenum READ_WRITE = 0x88BA;
   static const GLenum ARRAY_BUFFER = 0x8892;
+  static const GLenum DEPTH24_STENCIL8 = 0x88F0;
   static const GLenum ELEMENT_ARRAY_BUFFER = 0x8893;
   static const GLenum STREAM_DRAW = 0x88E0;
   static const GLenum STREAM_READ = 0x88E1;
@@ -106,21 +241,163 @@ public:
   static const GLenum VERTEX_SHADER = 0x8B31;
   static const GLenum COMPILE_STATUS = 0x8B81;
   static const GLenum LINK_STATUS = 0x8B82;
+  static const GLenum ACTIVE_UNIFORMS = 0x8B86;
+  static const GLenum ACTIVE_UNIFORM_MAX_LENGTH = 0x8B87;
+  static const GLenum COPY_READ_BUFFER = 0x8F36;
+  static const GLenum COPY_WRITE_BUFFER = 0x8F37;
+  static const GLenum DRAW_INDIRECT_BUFFER = 0x8F3F;
   static const GLenum TEXTURE_2D_ARRAY = 0x8C1A;
+  static const GLenum DEPTH_COMPONENT32F = 0x8CAC;
+  static const GLenum DEPTH32F_STENCIL8 = 0x8CAD;
+  static const GLenum READ_FRAMEBUFFER = 0x8CA8;
+  static const GLenum DRAW_FRAMEBUFFER = 0x8CA9;
+  static const GLenum FRAMEBUFFER_COMPLETE = 0x8CD5;
+  static const GLenum COLOR_ATTACHMENT0 = 0x8CE0;
+  static const GLenum DEPTH_ATTACHMENT = 0x8D00;
+  static const GLenum STENCIL_ATTACHMENT = 0x8D20;
+  static const GLenum FRAMEBUFFER = 0x8D40;
+  static const GLenum RENDERBUFFER = 0x8D41;
+  static const GLenum MAX_SAMPLES = 0x8D57;
   static const GLenum GEOMETRY_SHADER = 0x8DD9;
   static const GLenum TEXTURE_CUBE_MAP_ARRAY = 0x9009;
+  static const GLenum SYNC_GPU_COMMANDS_COMPLETE = 0x9117;
+  static const GLenum SHADER_STORAGE_BUFFER = 0x90D2;
+  static const GLenum DISPATCH_INDIRECT_BUFFER = 0x90EE;
+  static const GLenum TIMEOUT_EXPIRED = 0x911B;
+  static const GLenum COMPLETION_STATUS = 0x91B1;
   static const GLenum COMPUTE_SHADER = 0x91B9;
+  static const GLenum COMPRESSED_RGB_S3TC_DXT1 = 0x83F0;
+  static const GLenum COMPRESSED_RGBA_S3TC_DXT1 = 0x83F1;
+  static const GLenum COMPRESSED_RGBA_S3TC_DXT3 = 0x83F2;
+  static const GLenum COMPRESSED_RGBA_S3TC_DXT5 = 0x83F3;
+  static const GLenum COMPRESSED_SRGB_S3TC_DXT1 = 0x8C4C;
+  static const GLenum COMPRESSED_SRGB_ALPHA_S3TC_DXT1 = 0x8C4D;
+  static const GLenum COMPRESSED_SRGB_ALPHA_S3TC_DXT3 = 0x8C4E;
+  static const GLenum COMPRESSED_SRGB_ALPHA_S3TC_DXT5 = 0x8C4F;
+  static const GLenum COMPRESSED_RED_RGTC1 = 0x8DBB;
+  static const GLenum COMPRESSED_SIGNED_RED_RGTC1 = 0x8DBC;
+  static const GLenum COMPRESSED_RG_RGTC2 = 0x8DBD;
+  static const GLenum COMPRESSED_SIGNED_RG_RGTC2 = 0x8DBE;
+  static const GLenum COMPRESSED_RGBA_BPTC_UNORM = 0x8E8C;
+  static const GLenum COMPRESSED_SRGB_ALPHA_BPTC_UNORM = 0x8E8D;
+  static const GLenum COMPRESSED_RGB_BPTC_SIGNED_FLOAT = 0x8E8E;
+  static const GLenum COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT = 0x8E8F;
+  static const GLenum COMPRESSED_R11_EAC = 0x9270;
+  static const GLenum COMPRESSED_SIGNED_R11_EAC = 0x9271;
+  static const GLenum COMPRESSED_RG11_EAC = 0x9272;
+  static const GLenum COMPRESSED_SIGNED_RG11_EAC = 0x9273;
+  static const GLenum COMPRESSED_RGB8_ETC2 = 0x9274;
+  static const GLenum COMPRESSED_SRGB8_ETC2 = 0x9275;
+  static const GLenum COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2 = 0x9276;
+  static const GLenum COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2 = 0x9277;
+  static const GLenum COMPRESSED_RGBA8_ETC2_EAC = 0x9278;
+  static const GLenum COMPRESSED_SRGB8_ALPHA8_ETC2_EAC = 0x9279;
+  static const GLenum COMPRESSED_RGBA_ASTC_4x4 = 0x93B0;   // followed by 5x4, 5x5, 6x5, 6x6, 8x5, 8x6, 8x8, 10x5,
+  static const GLenum COMPRESSED_RGBA_ASTC_12x12 = 0x93BD; // 10x6, 10x8, 10x10, 12x10 and 12x12
+  static const GLenum COMPRESSED_SRGB8_ALPHA8_ASTC_4x4 = 0x93D0;
+  static const GLenum COMPRESSED_SRGB8_ALPHA8_ASTC_12x12 = 0x93DD;
 
   bool init();
+  bool has_extension(const char *name) const;
+
+  // KHR/ARB_parallel_shader_compile, COMPLETION_STATUS can be polled without blocking
+  bool parallel_shader_compile = false;
+
+  // Block compressed texture formats besides RGTC, which every GL 3.0 context has
+  bool texture_compression_s3tc = false; // EXT_texture_compression_s3tc (BC1-BC3)
+  bool texture_compression_bptc = false; // GL 4.2 / ARB_texture_compression_bptc (BC6H, BC7)
+  bool texture_compression_etc2 = false; // GL 4.3 / ARB_ES3_compatibility (ETC2, EAC)
+  bool texture_compression_astc = false; // KHR_texture_compression_astc_ldr
 };
 
 #undef GL3D_API_FUNC
+#undef GL3D_API_FUNC_OPT
+
+//---------------------------------------------------------------------------------------------------------------------
+// Shadow copy of the binding and render state of the current context, filters out calls that would change nothing.
+// Needs invalidate() whenever another context becomes current or state gets changed without going through it.
+class gl_state_cache
+{
+public:
+  struct stats
+  {
+    size_t calls = 0;  // state changes passed to GL
+    size_t elided = 0; // redundant state changes filtered out
+  };
+
+  static const int max_texture_units = 32;
+
+  gl_state_cache() { invalidate(); }
+
+  void invalidate();
+
+  void use_program(GLuint id);
+  void bind_vertex_array(GLuint id);
+  void bind_buffer(GLenum target, GLuint id);
+  void bind_texture(int unit, GLenum target, GLuint id); // also makes the unit active
+  void bind_framebuffer(GLenum target, GLuint id);       // FRAMEBUFFER binds both draw and read
+  void active_texture(int unit);
+
+  void set_enabled(GLenum cap, bool enabled);
+  void set_blend_func(GLenum src, GLenum dst);
+  void set_viewport(int x, int y, int width, int height);
+  void set_scissor(int x, int y, int width, int height);
+
+  // Deleted objects are unbound by GL and their names can be reused
+  void forget_program(GLuint id) { if (_program == id) _program = 0; }
+  void forget_vertex_array(GLuint id) { if (_vao == id) _vao = 0; }
+  void forget_buffer(GLuint id) { for (size_t i = 0; i < _numBuffers; ++i) if (_buffers[i].id == id) _buffers[i].id = 0; }
+  void forget_texture(GLuint id) { for (auto &&t : _textures) if (t.id == id) t.id = 0; }
+  void forget_framebuffer(GLuint id)
+  {
+    if (_drawFramebuffer == id) _drawFramebuffer = 0;
+    if (_readFramebuffer == id) _readFramebuffer = 0;
+  }
+
+  // 0 (the window) while not known yet
+  GLuint draw_framebuffer() const { return (_drawFramebuffer != unknown) ? _drawFramebuffer : 0; }
+  GLuint read_framebuffer() const { return (_readFramebuffer != unknown) ? _readFramebuffer : 0; }
+
+  const stats &frame_stats() const { return _frame; }
+  const stats &last_frame_stats() const { return _lastFrame; }
+  void end_frame() { _lastFrame = _frame; _frame = stats(); ++_frameIndex; }
+  size_t frame_index() const { return _frameIndex; }
+
+private:
+  static const GLuint unknown = static_cast<GLuint>(-1);
+
+  template <typename T> bool update(T &cached, const T &value)
+  {
+    if (cached == value) { ++_frame.elided; return false; }
+    cached = value; ++_frame.calls;
+    return true;
+  }
+
+  struct target_binding { GLenum target; GLuint id; };
+  struct capability { GLenum cap; int enabled; };
+
+  GLuint _program;
+  GLuint _vao;
+  GLuint _drawFramebuffer, _readFramebuffer;
+  target_binding _buffers[16];
+  size_t _numBuffers;
+  GLuint _activeTexture;
+  target_binding _textures[max_texture_units];
+  capability _caps[8];
+  size_t _numCaps;
+  GLenum _blendSrc, _blendDst;
+  int _viewport[4];
+  int _scissor[4];
+  stats _frame, _lastFrame;
+  size_t _frameIndex = 0;
+};
 
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 extern detail::gl_api gl;
+extern detail::gl_state_cache gl_state;
 
 #pragma endregion
 
@@ -134,8 +411,8 @@ namespace detail
 ivec2 calculate_mip_size(int width, int height, size_t mipLevel)
 {
   return ivec2(
-    maximum(1.0f, floor(width / pow(2.0f, static_cast<float>(mipLevel)))),
-    maximum(1.0f, floor(height / pow(2.0f, static_cast<float>(mipLevel)))));
+    maximum(1.0f, std::floor(width / std::pow(2.0f, static_cast<float>(mipLevel)))),
+    maximum(1.0f, std::floor(height / std::pow(2.0f, static_cast<float>(mipLevel)))));
 }
 
 //---------------------------------------------------------------------------------------------------------------------
@@ -143,6 +420,7 @@ template <typename T> struct init_vao_arg { };
 
 #define GL3D_INIT_VAO_ARG(_Type, _NumElements, _ElementType) \
   template <> struct init_vao_arg<_Type> { \
+    static const GLuint locations = 1; \
     static void apply(GLuint index, size_t size, const void *offset) { \
       gl.VertexAttribPointer(index, _NumElements, _ElementType, GL_FALSE, static_cast<GLsizei>(size), offset); } };
 
@@ -157,20 +435,132 @@ GL3D_INIT_VAO_ARG(ivec4, 4, GL_INT)
 
 #undef GL3D_INIT_VAO_ARG
 
+// Matrices take one attribute location per column
+template <> struct init_vao_arg<mat4>
+{
+  static const GLuint locations = 4;
+  static void apply(GLuint index, size_t size, const void *offset)
+  {
+    for (GLuint i = 0; i < 4; ++i)
+      gl.VertexAttribPointer(index + i, 4, GL_FLOAT, GL_FALSE, static_cast<GLsizei>(size),
+        static_cast<const uint8_t *>(offset) + i * sizeof(vec4));
+  }
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+template <typename T> struct uniform_arg { };
+
+#define GL3D_UNIFORM_ARG(_Type, _Upload) \
+  template <> struct uniform_arg<_Type> { \
+    static void apply(GLint location, const _Type &value) { _Upload; } };
+
+GL3D_UNIFORM_ARG(int, gl.Uniform1i(location, value))
+GL3D_UNIFORM_ARG(float, gl.Uniform1f(location, value))
+GL3D_UNIFORM_ARG(vec2, gl.Uniform2fv(location, 1, value.data))
+GL3D_UNIFORM_ARG(vec3, gl.Uniform3fv(location, 1, value.data))
+GL3D_UNIFORM_ARG(vec4, gl.Uniform4fv(location, 1, value.data))
+GL3D_UNIFORM_ARG(mat4, gl.UniformMatrix4fv(location, 1, GL_FALSE, value.data))
+
+#undef GL3D_UNIFORM_ARG
+
+//---------------------------------------------------------------------------------------------------------------------
+inline bool is_sampler_type(GLenum type)
+{
+  return (type >= 0x8B5D && type <= 0x8B64)  // GL_SAMPLER_1D .. GL_SAMPLER_2D_RECT_SHADOW
+    || (type >= 0x8DC0 && type <= 0x8DD8 && (type < 0x8DC6 || type > 0x8DC8)) // array, buffer and integer samplers
+    || (type >= 0x900C && type <= 0x900F)    // cube map array samplers
+    || (type >= 0x9108 && type <= 0x910D);   // multisample samplers
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// 64-bit FNV-1a
+inline uint64_t hash_string(const char *str, uint64_t hash = 14695981039346656037ull)
+{
+  while (*str) { hash ^= static_cast<uint8_t>(*str++); hash *= 1099511628211ull; }
+  return hash;
+}
+
 //---------------------------------------------------------------------------------------------------------------------
+// Uncompressed formats are looked up by their pixel transfer format (GL_RGBA), block compressed ones by their internal
+// format (e.g. COMPRESSED_RGBA_S3TC_DXT5). Uncompressed pixels count as blocks of 1x1.
 struct gl_format_descriptor
 {
-  size_t pixel_size;
-  GLenum layout;
-  GLenum element_format;
+  size_t block_size;     // bytes per block
+  GLenum layout;         // internal format
+  GLenum element_format; // pixel transfer type, GL_NONE for compressed formats
+  int block_width;
+  int block_height;
+
+  bool compressed() const { return element_format == GL_NONE && layout != GL_NONE; }
+
+  // Partial blocks at the right and bottom edge take a whole block
+  size_t row_size(int width) const { return (width + block_width - 1) / block_width * block_size; }
+  size_t image_size(int width, int height) const
+  {
+    return row_size(width) * ((height + block_height - 1) / block_height);
+  }
 
   static gl_format_descriptor get(GLenum format)
   {
     switch (format)
     {
-      case GL_RGBA: return { 4, GL_RGBA, GL_UNSIGNED_BYTE };
-      default: return { 0, GL_NONE, GL_NONE };
+      case GL_RGBA: return { 4, GL_RGBA8, GL_UNSIGNED_BYTE, 1, 1 };
+      case GL_DEPTH_COMPONENT: return { 4, gl_api::DEPTH_COMPONENT24, GL_UNSIGNED_INT, 1, 1 };
+      case gl_api::DEPTH_STENCIL: return { 4, gl_api::DEPTH24_STENCIL8, gl_api::UNSIGNED_INT_24_8, 1, 1 };
+
+      // 8 byte 4x4 blocks
+      case gl_api::COMPRESSED_RGB_S3TC_DXT1:
+      case gl_api::COMPRESSED_RGBA_S3TC_DXT1:
+      case gl_api::COMPRESSED_SRGB_S3TC_DXT1:
+      case gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT1:
+      case gl_api::COMPRESSED_RED_RGTC1:
+      case gl_api::COMPRESSED_SIGNED_RED_RGTC1:
+      case gl_api::COMPRESSED_R11_EAC:
+      case gl_api::COMPRESSED_SIGNED_R11_EAC:
+      case gl_api::COMPRESSED_RGB8_ETC2:
+      case gl_api::COMPRESSED_SRGB8_ETC2:
+      case gl_api::COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+      case gl_api::COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+        return { 8, format, GL_NONE, 4, 4 };
+
+      // 16 byte 4x4 blocks
+      case gl_api::COMPRESSED_RGBA_S3TC_DXT3:
+      case gl_api::COMPRESSED_RGBA_S3TC_DXT5:
+      case gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT3:
+      case gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT5:
+      case gl_api::COMPRESSED_RG_RGTC2:
+      case gl_api::COMPRESSED_SIGNED_RG_RGTC2:
+      case gl_api::COMPRESSED_RGBA_BPTC_UNORM:
+      case gl_api::COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+      case gl_api::COMPRESSED_RGB_BPTC_SIGNED_FLOAT:
+      case gl_api::COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT:
+      case gl_api::COMPRESSED_RG11_EAC:
+      case gl_api::COMPRESSED_SIGNED_RG11_EAC:
+      case gl_api::COMPRESSED_RGBA8_ETC2_EAC:
+      case gl_api::COMPRESSED_SRGB8_ALPHA8_ETC2_EAC:
+        return { 16, format, GL_NONE, 4, 4 };
+
+      default: break;
+    }
+
+    // ASTC blocks are all 16 bytes, their footprint follows from the order of the format values
+    static const int astcBlocks[][2] = {
+      { 4, 4 }, { 5, 4 }, { 5, 5 }, { 6, 5 }, { 6, 6 }, { 8, 5 }, { 8, 6 }, { 8, 8 },
+      { 10, 5 }, { 10, 6 }, { 10, 8 }, { 10, 10 }, { 12, 10 }, { 12, 12 } };
+
+    if (format >= gl_api::COMPRESSED_RGBA_ASTC_4x4 && format <= gl_api::COMPRESSED_RGBA_ASTC_12x12)
+    {
+      auto &b = astcBlocks[format - gl_api::COMPRESSED_RGBA_ASTC_4x4];
+      return { 16, format, GL_NONE, b[0], b[1] };
+    }
+
+    if (format >= gl_api::COMPRESSED_SRGB8_ALPHA8_ASTC_4x4 && format <= gl_api::COMPRESSED_SRGB8_ALPHA8_ASTC_12x12)
+    {
+      auto &b = astcBlocks[format - gl_api::COMPRESSED_SRGB8_ALPHA8_ASTC_4x4];
+      return { 16, format, GL_NONE, b[0], b[1] };
     }
+
+    return { 0, GL_NONE, GL_NONE, 1, 1 };
   }
 };
 
@@ -188,18 +578,11 @@ struct gl_resource
 struct gl_resource_buffer : gl_resource { void destroy(); };
 struct gl_resource_vao : gl_resource { void destroy(); };
 struct gl_resource_texture : gl_resource { void destroy(); };
+struct gl_resource_framebuffer : gl_resource { void destroy(); };
+struct gl_resource_renderbuffer : gl_resource { void destroy(); };
 
-struct gl_resource_shader : gl_resource
-{
-  void destroy();
-  bool compile(GLenum shaderType, const std::string &source);
-};
-
-struct gl_resource_program : gl_resource
-{
-  void destroy();
-  bool link(const std::initializer_list<gl_resource_shader> &shaders);
-};
+struct gl_resource_shader : gl_resource { void destroy(); };
+struct gl_resource_program : gl_resource { void destroy(); };
 
 #pragma endregion
 
@@ -272,62 +655,239 @@ protected:
 };
 
 //---------------------------------------------------------------------------------------------------------------------
+// Every distinct macro set is a permutation with its own linked program. Switching the macros parks the current
+// program and swaps in the one of the new set if it is still resident, so toggling features between draws does not
+// recompile. The least recently used permutations are destroyed above max_permutations().
 class compiled_program : public compiled_object
 {
 public:
+  typedef std::map<std::string, std::string> macro_set;
+  typedef uint64_t permutation_id;
+
   GLuint id() const { return _program.id; }
 
   const std::string &last_error() const { return _lastError; }
 
-  void set_glsl_version(const std::string &verString) { _glslVersion = verString; set_dirty(); }
+  void set_glsl_version(const std::string &verString) { _glslVersion = verString; clear_permutations(); }
   const std::string &glsl_version() const { return _glslVersion; }
 
   void define(const std::string &name, const std::string &value)
   {
+    sync_macros();
     _macros[name] = value;
+    _permutation = _macrosPermutation = hash_macros(_macros);
     set_dirty();
   }
 
   bool undef(const std::string &name)
   {
+    sync_macros();
     auto iter = _macros.find(name);
     if (iter == _macros.end()) return false;
     _macros.erase(iter);
+    _permutation = _macrosPermutation = hash_macros(_macros);
     set_dirty();
     return true;
   }
 
-  void undef_all() { if (!_macros.empty()) { _macros.clear(); set_dirty(); } }
+  void undef_all()
+  {
+    sync_macros();
+    if (_macros.empty()) return;
+    _macros.clear();
+    _permutation = _macrosPermutation = hash_macros(_macros);
+    set_dirty();
+  }
+
+  const macro_set &macros() const
+  {
+    return (_macrosPermutation == _permutation) ? _macros : _permutations.find(_permutation)->second.macros;
+  }
 
   std::string get_macro_string() const
   {
     std::string macroString = "#version " + _glslVersion + "\n";
-    for (auto &&kvp : _macros) macroString += "#define " + kvp.first + " " + kvp.second + "\n";
+    for (auto &&kvp : macros()) macroString += "#define " + kvp.first + " " + kvp.second + "\n";
     return macroString;
   }
 
-  virtual bool bind() = 0;
-  virtual void unbind() { gl.UseProgram(0); }
+  // Stable hash of the sorted macro set, never 0
+  static permutation_id hash_macros(const macro_set &macros)
+  {
+    uint64_t hash = hash_string("");
+    for (auto &&kvp : macros)
+    {
+      hash = hash_string("=", hash_string(kvp.first.c_str(), hash));
+      hash = hash_string("\n", hash_string(kvp.second.c_str(), hash));
+    }
+
+    return hash ? hash : 1;
+  }
+
+  permutation_id permutation() const { return _permutation; }
+
+  // Registers a macro set so it can be selected by id, does not compile anything yet
+  permutation_id declare_permutation(const macro_set &macros);
+
+  // Selects a declared (or previously used) permutation with a single hash lookup, takes effect on next bind()
+  bool select_permutation(permutation_id id);
+
+  // Compiles all declared permutations that are not resident, the current selection stays unchanged
+  void precompile_permutations();
+
+  void set_max_permutations(size_t count) { _maxPermutations = maximum(count, size_t(1)); evict_permutations(); }
+  size_t max_permutations() const { return _maxPermutations; }
+  size_t num_resident_permutations() const;
+
+  // Destroys all parked programs, needed whenever the sources change
+  void clear_permutations();
+
+  struct uniform_info
+  {
+    std::string name;           // arrays without the "[0]" suffix, elements past the first as "name[n]"
+    GLint location = -1;
+    GLenum type = GL_NONE;
+    GLint size = 0;             // number of array elements from this one on
+    int texture_unit = -1;      // fixed texture unit of sampler uniforms
+    bool cached = false;        // value holds the last uploaded data
+    uint8_t value[sizeof(mat4)];
+  };
+
+  const std::vector<uniform_info> &uniforms() const { return _uniforms; }
+
+  // Incremented every time the program gets relinked and the uniform table rebuilt
+  size_t generation() const { return _generation; }
+
+  int find_uniform(const char *name) const
+  {
+    // the first element is the array itself
+    size_t length = strlen(name);
+    if (length > 3 && !strcmp(name + length - 3, "[0]")) return find_uniform(std::string(name, length - 3).c_str());
+
+    auto iter = _uniformIndices.find(hash_string(name));
+    if (iter != _uniformIndices.end() && _uniforms[iter->second].name == name) return iter->second;
+    if (iter == _uniformIndices.end()) return -1;
+
+    // hash collision, fall back to linear search
+    for (size_t i = 0; i < _uniforms.size(); ++i) if (_uniforms[i].name == name) return static_cast<int>(i);
+    return -1;
+  }
+
+  // Uploads the value unless it is the same as the last one set, the program has to be in use
+  template <typename T> bool set_uniform(int index, const T &value)
+  {
+    static_assert(sizeof(T) <= sizeof(uniform_info::value), "unsupported uniform type");
+    if (index < 0 || index >= static_cast<int>(_uniforms.size())) return false;
+
+    auto &u = _uniforms[index];
+    if (u.cached && !memcmp(u.value, &value, sizeof(T))) return true;
+    memcpy(u.value, &value, sizeof(T));
+    u.cached = true;
+    uniform_arg<T>::apply(u.location, value);
+    return true;
+  }
+
+  // With async compilation bind() only submits the program and returns false until the driver is done, polling
+  // COMPLETION_STATUS when parallel compilation is supported and otherwise checking in a later frame. The
+  // placeholder program (if set) is bound meanwhile.
+  void set_async(bool async) { _async = async; }
+  bool async() const { return _async; }
+
+  void set_placeholder(compiled_program *program) { _placeholder = (program != this) ? program : nullptr; }
+  compiled_program *placeholder() const { return _placeholder; }
+
+  bool ready() const { return !_dirty && _program.id != 0; }
+  bool pending() const;
+
+  // Program that receives uniforms and draws, the placeholder while not ready
+  compiled_program *active()
+  {
+    if (ready() || _placeholder.empty()) return this;
+    return _placeholder;
+  }
+
+  // Returns false while not ready, or when the program failed to link
+  virtual bool bind();
+  virtual void unbind() { gl_state.use_program(0); }
   
 protected:
+  struct stage
+  {
+    GLenum type;
+    const std::string *source;
+  };
+
+  struct permutation_entry
+  {
+    macro_set macros;
+    gl_resource_program program; // 0 while not resident or currently active
+    std::vector<uniform_info> uniforms;
+    std::unordered_map<uint64_t, int> uniform_indices;
+    uint64_t last_use = 0;
+    bool pending = false;        // submitted asynchronously, program not linked yet
+    bool failed = false;         // asynchronous link failed, not submitted again until the sources change
+    size_t submit_frame = 0;
+    uint64_t cache_key = 0;
+  };
+
   virtual ~compiled_program()
   {
-    _program.destroy();    
+    _program.destroy();
+    for (auto &&kvp : _permutations) kvp.second.program.destroy();
   }
 
-  std::map<std::string, std::string> _macros;
+  // Stages with their sources in a fixed order, empty sources are skipped
+  virtual void get_stages(std::vector<stage> &stages) const = 0;
+
+  // Compiles all stages and starts linking without querying any status
+  GLuint submit_program(GLuint program, const std::string &macroString, bool retrievable) const;
+  uint64_t make_cache_key(const std::string &macroString) const;
+  bool bind_placeholder();
+  void poll_permutations();
+
+  void reflect_uniforms();
+
+  // Called by bind() of a dirty program, returns true when a resident program of the selected permutation got
+  // swapped in and nothing needs to be compiled
+  bool activate_permutation();
+
+  // Called by bind() after the program got linked from source for the selected permutation
+  void finish_permutation();
+
+  void sync_macros();
+  void swap_program(permutation_entry &entry);
+  void evict_permutations();
+
+  macro_set _macros;
+  permutation_id _permutation = hash_macros(macro_set());
+  permutation_id _macrosPermutation = _permutation;  // permutation _macros holds, the rest live in the entries
+  permutation_id _programPermutation = 0;            // permutation _program was linked for, 0 if stale
+  std::unordered_map<permutation_id, permutation_entry> _permutations;
+  size_t _maxPermutations = 16;
+  uint64_t _permutationClock = 0;
+  size_t _numPending = 0;
+  bool _async = false;
+  ptr<compiled_program> _placeholder;
+  std::vector<uniform_info> _uniforms;
+  std::unordered_map<uint64_t, int> _uniformIndices;
+  size_t _generation = 0;
   detail::gl_resource_program _program;
   std::string _glslVersion = "330";
   std::string _lastError;
 };
 
 //---------------------------------------------------------------------------------------------------------------------
+// Once uploaded, the GL storage is only reallocated when the data outgrows it (with geometric growth), otherwise just
+// the invalidated byte ranges are uploaded with glBufferSubData.
 class buffer : public compiled_object
 {
 public:
+  static const size_t max_dirty_ranges = 16;
+
   buffer() { }
 
   GLuint id() const { return _buffer.id; }
+  size_t capacity() const { return _capacity; }
 
   void clear()
   {
@@ -337,12 +897,14 @@ public:
     _owner = false;
     _data = nullptr;
     _size = 0;
+    _fullUpload = true;
+    _dirtyRanges.clear();
     set_dirty();
   }
 
   void *alloc_data(const void *ptr, size_t size, bool keep = false)
   {
-    if (_owner && _size != size)
+    if (!_owner || _size != size)
       clear();
 
     if (size)
@@ -354,6 +916,8 @@ public:
 
     _owner = true;
     _keepData = keep;
+    _fullUpload = true;
+    set_dirty();
     return _data;
   }
 
@@ -364,13 +928,37 @@ public:
     _size = size;
   }
 
+  // Points the buffer at caller owned memory like set_data, but keeps the uploaded content, only the invalidated
+  // ranges and the part past the previous size are uploaded again
+  void reference_data(const void *ptr, size_t size)
+  {
+    if (_owner) clear();
+    if (size > _size) invalidate(_size, size - _size);
+
+    _data = const_cast<uint8_t *>(static_cast<const uint8_t *>(ptr));
+    _size = size;
+    set_dirty();
+  }
+
+  // Marks a byte range to be uploaded on the next bind, adjacent and overlapping ranges are merged
+  void invalidate(size_t offset, size_t size);
+
   const uint8_t *data() const { return _data; }
 
+  // False while the data points at caller memory passed to set_data() or reference_data()
+  bool owns_data() const { return _owner; }
+
   size_t size() const { return _size; }
 
   bool bind(GLenum type);
   void unbind(GLenum type);
 
+  // Binds to an indexed target (SHADER_STORAGE_BUFFER, UNIFORM_BUFFER...), the whole buffer when size is 0
+  bool bind_base(GLenum type, GLuint index, size_t offset = 0, size_t size = 0);
+
+  // Copies GPU content back, e.g. results written by a compute shader
+  bool read_data(void *ptr, size_t offset, size_t size);
+
 protected:
   virtual ~buffer()
   {
@@ -382,10 +970,60 @@ protected:
   bool _owner = false;
   uint8_t *_data = nullptr;
   size_t _size = 0;
+  size_t _capacity = 0;
+  bool _fullUpload = true;
+  std::vector<std::pair<size_t, size_t>> _dirtyRanges; // sorted [begin, end) byte ranges
+  gl_resource_buffer _buffer;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Ring of regions for data rewritten every frame, written directly into GPU visible memory. Uses a persistent coherent
+// mapping with ARB_buffer_storage, unsynchronized glMapBufferRange otherwise. Every region is guarded by a fence, so
+// the CPU only waits when it gets more than num_regions frames ahead of the GPU.
+class stream_buffer : public ref_counted
+{
+public:
+  static const size_t num_regions = 3;
+
+  stream_buffer(GLenum target, size_t regionSize = 256 * 1024): _target(target), _regionSize(align(regionSize)) { }
+
+  GLuint id() const { return _buffer.id; }
+  GLenum target() const { return _target; }
+  bool persistent() const { return _persistent; }
+
+  // Byte offset of the current region inside the buffer
+  size_t offset() const { return _region * _regionSize; }
+  size_t region_size() const { return _regionSize; }
+
+  // Returns the current region with room for at least size bytes, the first keep bytes survive when it has to grow
+  uint8_t *map(size_t size, size_t keep);
+  // Must be called before drawing from the buffer, does nothing for persistent mappings
+  void unmap();
+  // Fences the current region and moves to the next one, waits until the GPU is done reading it
+  void next_region();
+
+protected:
+  virtual ~stream_buffer() { destroy(); }
+
+  static size_t align(size_t size) { return (maximum(size, static_cast<size_t>(256)) + 255) & ~static_cast<size_t>(255); }
+
+  bool create();
+  void destroy();
+  void delete_fences();
+
+  GLenum _target;
+  size_t _regionSize;
+  size_t _region = 0;
+  bool _persistent = false;
+  uint8_t *_persistentData = nullptr; // whole buffer, mapped for its lifetime
+  uint8_t *_mapped = nullptr;         // current region while mapped without persistence
+  GLsync _fences[num_regions] = { };
   gl_resource_buffer _buffer;
 };
 
 //---------------------------------------------------------------------------------------------------------------------
+class base_geometry_pool;
+
 class base_geometry : public compiled_object
 {
 public:
@@ -395,10 +1033,18 @@ public:
   buffer *vertex_buffer() const { return _vertexBuffer; }
   void set_index_buffer(buffer *ib) { _indexBuffer = ib; set_dirty(); }
   buffer *index_buffer() const { return _indexBuffer; }
+  GLenum index_type() const { return _indexType; }
 
   virtual size_t size_vertices() const = 0;
   virtual size_t size_indices() const = 0;
 
+  // Geometries with a per-instance attribute stream are always drawn instanced
+  virtual bool instanced() const { return false; }
+  virtual size_t size_instances() const { return 0; }
+
+  // Geometry pools hold many meshes, drawn together by context3d::draw_batch
+  virtual base_geometry_pool *as_pool() { return nullptr; }
+
   virtual bool bind();
   virtual void unbind();
   
@@ -411,6 +1057,83 @@ protected:
   detail::gl_resource_vao _vao;
   ptr<buffer> _vertexBuffer = new buffer();
   ptr<buffer> _indexBuffer;
+  GLenum _indexType = GL_UNSIGNED_INT;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Command layouts read by glMultiDrawArraysIndirect and glMultiDrawElementsIndirect
+struct draw_arrays_indirect_command
+{
+  GLuint count;
+  GLuint instanceCount;
+  GLuint first;
+  GLuint baseInstance;
+};
+
+struct draw_elements_indirect_command
+{
+  GLuint count;
+  GLuint instanceCount;
+  GLuint firstIndex;
+  GLint baseVertex;
+  GLuint baseInstance;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Suballocates the vertices and 32-bit indices of many meshes sharing one vertex layout from a single vertex and index
+// buffer with a single VAO. Indices are relative to the first vertex of their mesh, freed ranges are reused first-fit.
+class base_geometry_pool : public base_geometry
+{
+public:
+  static const size_t invalid_mesh = static_cast<size_t>(-1);
+
+  struct mesh_range
+  {
+    size_t firstVertex = 0;
+    size_t numVertices = 0; // 0 for removed meshes
+    size_t firstIndex = 0;
+    size_t numIndices = 0;
+  };
+
+  bool indexed() const { return _indexBuffer != nullptr; }
+
+  // Mesh ids stay valid until the mesh is removed, they are reused afterwards
+  bool valid(size_t mesh) const { return mesh < _meshes.size() && _meshes[mesh].numVertices > 0; }
+  const mesh_range &mesh(size_t mesh) const { return _meshes[mesh]; }
+  size_t num_meshes() const { return _meshes.size() - _freeMeshes.size(); }
+  size_t max_mesh_id() const { return _meshes.size(); }
+
+  void remove_mesh(size_t mesh);
+  void clear();
+
+  // The used part of the shared buffers, including holes left by removed meshes
+  size_t size_vertices() const override { return _vertexEnd; }
+  size_t size_indices() const override { return _indexEnd; }
+
+  base_geometry_pool *as_pool() override { return this; }
+
+protected:
+  typedef std::vector<std::pair<size_t, size_t>> free_list; // sorted [begin, end) ranges below the end
+
+  explicit base_geometry_pool(bool indexed)
+  {
+    if (indexed) _indexBuffer = new buffer();
+  }
+
+  virtual ~base_geometry_pool() { }
+
+  // Reserves the ranges of a new mesh and copies its indices, the vertices are copied by the typed pool
+  size_t alloc_mesh(size_t numVertices, const uint32_t *indices, size_t numIndices);
+
+  static size_t alloc_range(free_list &freeRanges, size_t &end, size_t count);
+  static void free_range(free_list &freeRanges, size_t &end, size_t first, size_t count);
+
+  std::vector<mesh_range> _meshes;
+  std::vector<size_t> _freeMeshes;
+  std::vector<uint32_t> _indices;
+  free_list _freeVertices, _freeIndices;
+  size_t _vertexEnd = 0;
+  size_t _indexEnd = 0;
 };
 
 #pragma endregion
@@ -425,6 +1148,11 @@ layout(location = 1) in vec3 vert_Normal;
 layout(location = 2) in vec4 vert_Color;
 layout(location = 3) in vec2 vert_UV;
 
+#if defined(GL3D_INSTANCED)
+layout(location = 4) in mat4 inst_Transform;
+layout(location = 8) in vec4 inst_Color;
+#endif
+
 uniform mat4 u_ProjectionMatrix;
 uniform mat4 u_ModelviewMatrix;
 
@@ -434,9 +1162,15 @@ out vec2 UV;
 
 void main()
 {
+#if defined(GL3D_INSTANCED)
+  gl_Position = u_ProjectionMatrix * u_ModelviewMatrix * inst_Transform * vec4(vert_Position, 1);
+  Normal = mat3(inst_Transform) * vert_Normal;
+  Color = vert_Color * inst_Color;
+#else
   gl_Position = u_ProjectionMatrix * u_ModelviewMatrix * vec4(vert_Position, 1);
   Normal = vert_Normal;
   Color = vert_Color;
+#endif
   UV = vert_UV;
 }
 )GLSHADER";
@@ -461,34 +1195,87 @@ void main()
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Pre-resolved uniform of a program, the location is looked up again only when the program gets relinked
+template <typename T> class uniform_handle
+{
+public:
+  uniform_handle() { }
+  uniform_handle(detail::compiled_program *program, const std::string &name): _program(program), _name(name) { }
+
+  detail::compiled_program *program() const { return _program; }
+  const std::string &name() const { return _name; }
+
+  int index() const
+  {
+    if (!_program) return -1;
+
+    if (_generation != _program->generation())
+    {
+      _index = _program->find_uniform(_name.c_str());
+      _generation = _program->generation();
+    }
+
+    return _index;
+  }
+
+private:
+  detail::ptr<detail::compiled_program> _program;
+  std::string _name;
+  mutable int _index = -1;
+  mutable size_t _generation = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 template <typename... T> class layout
 {
+  template <typename Head> static void init_attribute(GLuint index, size_t size, size_t offset, GLuint divisor)
+  {
+    for (GLuint i = 0; i < detail::init_vao_arg<Head>::locations; ++i)
+    {
+      gl.EnableVertexAttribArray(index + i);
+      if (gl.VertexAttribDivisor) gl.VertexAttribDivisor(index + i, divisor);
+    }
+
+    detail::init_vao_arg<Head>::apply(index, size, reinterpret_cast<const void *>(offset));
+  }
+
   template <typename Head, typename... Tail> struct helper
   {
+    static const GLuint locations = detail::init_vao_arg<Head>::locations + helper<Tail...>::locations;
+
     Head head;
     helper<Tail...> tail;
 
-    void init_vao(GLuint index, size_t size, size_t offset)
+    void init_vao(GLuint index, size_t size, size_t offset, GLuint divisor)
     {
-      gl.EnableVertexAttribArray(index);
-      detail::init_vao_arg<Head>::apply(index, size, reinterpret_cast<const void *>(offset));
-      tail.init_vao(index + 1, size, offset + offsetof(std::remove_pointer_t<decltype(this)>, tail));
+      init_attribute<Head>(index, size, offset, divisor);
+      tail.init_vao(index + detail::init_vao_arg<Head>::locations, size,
+        offset + offsetof(std::remove_pointer_t<decltype(this)>, tail), divisor);
     }
   };
 
   template <typename Head> struct helper<Head>
   {
+    static const GLuint locations = detail::init_vao_arg<Head>::locations;
+
     Head head;
 
-    void init_vao(GLuint index, size_t size, size_t offset)
+    void init_vao(GLuint index, size_t size, size_t offset, GLuint divisor)
     {
-      gl.EnableVertexAttribArray(index);
-      detail::init_vao_arg<Head>::apply(index, size, reinterpret_cast<const void *>(offset));
+      init_attribute<Head>(index, size, offset, divisor);
     }
   };
 
 public:
-  static void init_vao() { helper<T...> h; h.init_vao(0, sizeof(h), 0); }
+  // Per-instance layouts start after the vertex layout locations and advance once every divisor instances
+  static void init_vao(size_t baseOffset = 0, GLuint firstLocation = 0, GLuint divisor = 0)
+  {
+    helper<T...> h;
+    h.init_vao(firstLocation, sizeof(h), baseOffset, divisor);
+  }
+
+  static GLuint num_locations() { return helper<T...>::locations; }
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -501,6 +1288,14 @@ struct vertex3d : layout<vec3, vec3, vec4, vec2>
   vec2 uv;
 };
 
+//---------------------------------------------------------------------------------------------------------------------
+// Per-instance data read by the GL3D_INSTANCED variant of the basic technique
+struct instance3d : layout<mat4, vec4>
+{
+  mat4 transform;
+  vec4 color = vec4::one();
+};
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 //---------------------------------------------------------------------------------------------------------------------
@@ -509,50 +1304,99 @@ template <typename T> class custom_geometry : public detail::base_geometry
 public:
   typedef detail::ptr<custom_geometry> ptr;
 
-  custom_geometry()
+  // Streaming geometry writes vertices directly into a ring of GPU visible memory, meant for data rebuilt every frame.
+  // Pointers from alloc_vertices are valid until the next alloc_vertices or bind.
+  explicit custom_geometry(bool streaming = false)
   {
-    
+    if (streaming)
+    {
+      _vertexBuffer = nullptr;
+      _stream = new detail::stream_buffer(gl.ARRAY_BUFFER);
+    }
   }
 
-  void clear_vertices() { _vertexCursor = 0; set_dirty(); }
-  void clear_indices() { _indexCursor = 0; set_dirty(); }
-  void clear() { _vertexCursor = _indexCursor = 0; set_dirty(); }
+  bool streaming() const { return _stream != nullptr; }
+
+  void clear_vertices() { next_stream_region(); _vertexCursor = 0; set_dirty(); }
+  void clear_indices() { _indexCursor = 0; _indicesDirty = true; set_dirty(); }
+  void clear() { next_stream_region(); _vertexCursor = _indexCursor = 0; _indicesDirty = true; set_dirty(); }
 
   size_t size_vertices() const override { return _vertexCursor; }
   size_t size_indices() const override { return _indexCursor; }
 
   T *alloc_vertices(size_t count)
   {
+    if (_stream)
+    {
+      auto base = _stream->map((_vertexCursor + count) * sizeof(T), _vertexCursor * sizeof(T));
+      if (!base) return nullptr;
+
+      auto result = reinterpret_cast<T *>(base) + _vertexCursor;
+      _vertexCursor += count;
+      return result;
+    }
+
     if (!_vertexBuffer)
       return nullptr;
 
-    if (_vertexCursor + count > size_vertices())
+    if (_vertexCursor + count > _vertices.size())
       _vertices.resize(_vertexCursor + count);
 
     auto result = _vertices.data() + _vertexCursor;
+    _vertexBuffer->invalidate(_vertexCursor * sizeof(T), count * sizeof(T));
     _vertexCursor += count;
     set_dirty();
     return result;
   }
 
+  // Gives write access to already allocated vertices, only the modified range gets uploaded again
+  T *modify_vertices(size_t first, size_t count)
+  {
+    if (!_vertexBuffer || first + count > _vertexCursor)
+      return nullptr;
+
+    _vertexBuffer->invalidate(first * sizeof(T), count * sizeof(T));
+    set_dirty();
+    return _vertices.data() + first;
+  }
+
+  // Indices are stored as 32-bit and uploaded as 16-bit whenever the vertex count allows it
+  uint32_t *alloc_indices(size_t count)
+  {
+    if (!_indexBuffer)
+      _indexBuffer = new detail::buffer();
+
+    if (_indexCursor + count > _indices.size())
+      _indices.resize(_indexCursor + count);
+
+    auto result = _indices.data() + _indexCursor;
+    _indexCursor += count;
+    _indicesDirty = true;
+    set_dirty();
+    return result;
+  }
+
   void pop_vertices(size_t count) { _vertexCursor = (count > _vertexCursor) ? 0 : (_vertexCursor - count); }
-  void pop_indices(size_t count) { _indexCursor = (count > _indexCursor) ? 0 : (_indexCursor - count); }
+  void pop_indices(size_t count) { _indexCursor = (count > _indexCursor) ? 0 : (_indexCursor - count); _indicesDirty = true; }
 
   bool bind() override
   {
     if (dirty())
     {
-      if (_vertexBuffer) _vertexBuffer->set_data(_vertices.data(), _vertexCursor * sizeof(T));
-      if (_indexBuffer) _indexBuffer->set_data(_indices.data(), _indexCursor * sizeof(int));
+      if (_vertexBuffer) _vertexBuffer->reference_data(_vertices.data(), _vertexCursor * sizeof(T));
+      if (_indexBuffer) upload_indices();
       set_dirty(false);
     }
 
+    if (_stream)
+      return bind_stream();
+
     if (!_vao.id && _vertexBuffer)
     {
       _vertexBuffer->bind(gl.ARRAY_BUFFER);
       gl.GenVertexArrays(1, &_vao.id);
-      gl.BindVertexArray(_vao);
-      T::init_vao();
+      gl_state.bind_vertex_array(_vao);
+      init_vao(0);
     }
 
     return detail::base_geometry::bind();
@@ -564,50 +1408,295 @@ protected:
 
   }
 
-  std::vector<T> _vertices;
-  size_t _vertexCursor = 0;
+  // Sets up the attributes of the bound VAO, the vertex data is in the bound ARRAY_BUFFER at offset
+  virtual void init_vao(size_t offset) { T::init_vao(offset); }
 
-  std::vector<int> _indices;
-  size_t _indexCursor = 0;
-};
+  // The attribute pointers follow the stream buffer, they change once per region instead of copying any data
+  bool bind_stream()
+  {
+    _stream->unmap();
+    if (!_stream->id())
+      return false;
 
-//---------------------------------------------------------------------------------------------------------------------
-typedef custom_geometry<vertex3d> geometry;
+    if (!_vao.id)
+      gl.GenVertexArrays(1, &_vao.id);
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    gl_state.bind_buffer(gl.ARRAY_BUFFER, _stream->id());
+    gl_state.bind_vertex_array(_vao);
 
-class technique : public detail::compiled_program
-{
+    if (_streamBuffer != _stream->id() || _streamOffset != _stream->offset())
+    {
+      init_vao(_stream->offset());
+      _streamBuffer = _stream->id();
+      _streamOffset = _stream->offset();
+    }
+
+    if (_indexBuffer)
+      _indexBuffer->bind(gl.ELEMENT_ARRAY_BUFFER);
+
+    return true;
+  }
+
+  void next_stream_region()
+  {
+    if (_stream && _vertexCursor)
+      _stream->next_region();
+  }
+
+  void upload_indices()
+  {
+    GLenum type = (_vertexCursor <= 0x10000) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    if (!_indicesDirty && type == _indexType)
+      return;
+
+    _indexType = type;
+    _indicesDirty = false;
+
+    if (_indexType == GL_UNSIGNED_INT)
+      _indexBuffer->set_data(_indices.data(), _indexCursor * sizeof(uint32_t));
+    else
+    {
+      auto data = static_cast<uint16_t *>(_indexBuffer->alloc_data(nullptr, _indexCursor * sizeof(uint16_t)));
+      for (size_t i = 0; i < _indexCursor; ++i) data[i] = static_cast<uint16_t>(_indices[i]);
+    }
+  }
+
+  std::vector<T> _vertices;
+  size_t _vertexCursor = 0;
+
+  detail::ptr<detail::stream_buffer> _stream;
+  GLuint _streamBuffer = 0;
+  size_t _streamOffset = 0;
+
+  std::vector<uint32_t> _indices;
+  size_t _indexCursor = 0;
+  bool _indicesDirty = true;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+typedef custom_geometry<vertex3d> geometry;
+
+//---------------------------------------------------------------------------------------------------------------------
+// Geometry with a second attribute stream of layout I advancing once per instance, its attributes follow the vertex
+// attribute locations. Drawing it draws all instances in a single call.
+template <typename T, typename I> class custom_instanced_geometry : public custom_geometry<T>
+{
+public:
+  typedef detail::ptr<custom_instanced_geometry> ptr;
+
+  explicit custom_instanced_geometry(bool streaming = false): custom_geometry<T>(streaming) { }
+
+  bool instanced() const override { return true; }
+  size_t size_instances() const override { return _instanceCursor; }
+
+  // Also the target for instance data generated on the GPU, e.g. by a compute shader
+  detail::buffer *instance_buffer() const { return _instanceBuffer; }
+
+  void clear_instances() { _instanceCursor = 0; this->set_dirty(); }
+
+  I *alloc_instances(size_t count)
+  {
+    if (_instanceCursor + count > _instances.size())
+      _instances.resize(_instanceCursor + count);
+
+    auto result = _instances.data() + _instanceCursor;
+    _instanceBuffer->invalidate(_instanceCursor * sizeof(I), count * sizeof(I));
+    _instanceCursor += count;
+    this->set_dirty();
+    return result;
+  }
+
+  // Gives write access to already allocated instances, only the modified range gets uploaded again
+  I *modify_instances(size_t first, size_t count)
+  {
+    if (first + count > _instanceCursor)
+      return nullptr;
+
+    _instanceBuffer->invalidate(first * sizeof(I), count * sizeof(I));
+    this->set_dirty();
+    return _instances.data() + first;
+  }
+
+  void pop_instances(size_t count) { _instanceCursor = (count > _instanceCursor) ? 0 : (_instanceCursor - count); }
+
+  bool bind() override
+  {
+    if (this->dirty())
+      _instanceBuffer->reference_data(_instances.data(), _instanceCursor * sizeof(I));
+
+    return custom_geometry<T>::bind();
+  }
+
+protected:
+  virtual ~custom_instanced_geometry() { }
+
+  void init_vao(size_t offset) override
+  {
+    custom_geometry<T>::init_vao(offset);
+    _instanceBuffer->bind(gl.ARRAY_BUFFER);
+    I::init_vao(0, T::num_locations(), 1);
+  }
+
+  detail::ptr<detail::buffer> _instanceBuffer = new detail::buffer();
+  std::vector<I> _instances;
+  size_t _instanceCursor = 0;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+typedef custom_instanced_geometry<vertex3d, instance3d> instanced_geometry;
+
+//---------------------------------------------------------------------------------------------------------------------
+// Many small meshes of layout T in one shared vertex and index buffer, so drawing them needs no VAO or buffer changes.
+// Queue meshes with context3d::batch and draw them all with context3d::draw_batch.
+template <typename T> class custom_geometry_pool : public detail::base_geometry_pool
+{
+public:
+  typedef detail::ptr<custom_geometry_pool> ptr;
+
+  // Non-indexed pools draw their meshes as plain vertex ranges
+  explicit custom_geometry_pool(bool indexed = true): detail::base_geometry_pool(indexed) { }
+
+  // Copies a mesh into the pool and returns its id, or invalid_mesh when it is empty or an indexed pool gets no indices
+  size_t add_mesh(const T *vertices, size_t numVertices, const uint32_t *indices = nullptr, size_t numIndices = 0)
+  {
+    auto id = alloc_mesh(numVertices, indices, numIndices);
+    if (id == invalid_mesh)
+      return id;
+
+    if (_vertices.size() < _vertexEnd)
+      _vertices.resize(_vertexEnd);
+
+    auto &m = _meshes[id];
+    std::copy(vertices, vertices + numVertices, _vertices.begin() + m.firstVertex);
+    _vertexBuffer->invalidate(m.firstVertex * sizeof(T), numVertices * sizeof(T));
+    return id;
+  }
+
+  // Gives write access to the vertices of a mesh, only they get uploaded again
+  T *modify_mesh(size_t mesh)
+  {
+    if (!valid(mesh))
+      return nullptr;
+
+    auto &m = _meshes[mesh];
+    _vertexBuffer->invalidate(m.firstVertex * sizeof(T), m.numVertices * sizeof(T));
+    set_dirty();
+    return _vertices.data() + m.firstVertex;
+  }
+
+  bool bind() override
+  {
+    if (dirty())
+    {
+      _vertexBuffer->reference_data(_vertices.data(), _vertexEnd * sizeof(T));
+      if (_indexBuffer) _indexBuffer->reference_data(_indices.data(), _indexEnd * sizeof(uint32_t));
+      set_dirty(false);
+    }
+
+    if (!_vao.id)
+    {
+      _vertexBuffer->bind(gl.ARRAY_BUFFER);
+      gl.GenVertexArrays(1, &_vao.id);
+      gl_state.bind_vertex_array(_vao);
+      T::init_vao();
+    }
+
+    return detail::base_geometry::bind();
+  }
+
+protected:
+  virtual ~custom_geometry_pool() { }
+
+  std::vector<T> _vertices;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+typedef custom_geometry_pool<vertex3d> geometry_pool;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Opt-in on-disk cache of linked program binaries, used by technique and compute once a directory is set. Entries are
+// keyed by the GLSL version, macro string, stage sources and the driver identity, binaries rejected by the driver
+// fall back to compiling from source.
+class program_binary_cache
+{
+public:
+  struct stats
+  {
+    size_t hits = 0;        // programs loaded from a cached binary
+    size_t misses = 0;      // programs compiled from source, includes rejected binaries
+    size_t rejected = 0;    // cached binaries refused by the driver
+    size_t stores = 0;      // binaries written to disk
+    double load_time = 0.0; // seconds spent reading and loading cached binaries
+  };
+
+  // The directory has to exist, empty string disables the cache
+  void set_directory(const std::string &path) { _directory = path; }
+  const std::string &directory() const { return _directory; }
+
+  bool enabled() const;
+
+  uint64_t make_key(const std::string &glslVersion, const std::string &macroString,
+    const std::vector<const std::string *> &sources) const;
+
+  bool load(uint64_t key, detail::gl_resource_program &program);
+  bool store(uint64_t key, const detail::gl_resource_program &program);
+
+  const stats &get_stats() const { return _stats; }
+  void reset_stats() { _stats = stats(); }
+
+private:
+  struct file_header
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t format;
+    uint32_t length;
+  };
+
+  static const uint32_t file_magic = 0x42334c47; // "GL3B"
+  static const uint32_t file_version = 1;
+
+  std::string file_name(uint64_t key) const;
+
+  std::string _directory;
+  stats _stats;
+};
+
+extern program_binary_cache program_cache;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class technique : public detail::compiled_program
+{
 public:
   typedef detail::ptr<technique> ptr;
 
   technique() { }
   
-  void set_vert_source(const std::string &code) { _vertSource = code; set_dirty(); }
+  void set_vert_source(const std::string &code) { _vertSource = code; clear_permutations(); }
   const std::string &vert_source() const { return _vertSource; }
 
-  void set_geom_source(const std::string &code) { _geomSource = code; set_dirty(); }
+  void set_geom_source(const std::string &code) { _geomSource = code; clear_permutations(); }
   const std::string &geom_source() const { return _geomSource; }
 
-  void set_frag_source(const std::string &code) { _fragSource = code; set_dirty(); }
+  void set_frag_source(const std::string &code) { _fragSource = code; clear_permutations(); }
   const std::string &frag_source() const { return _fragSource; }
 
-  bool bind() override;
-
 protected:
-  virtual ~technique()
+  virtual ~technique() { }
+
+  void get_stages(std::vector<stage> &stages) const override
   {
-    _vertShader.destroy();
-    _geomShader.destroy();
-    _fragShader.destroy();
+    stages.push_back({ gl.VERTEX_SHADER, &_vertSource });
+    stages.push_back({ gl.GEOMETRY_SHADER, &_geomSource });
+    stages.push_back({ gl.FRAGMENT_SHADER, &_fragSource });
   }
 
   std::string _vertSource;
   std::string _geomSource;
   std::string _fragSource;
-  detail::gl_resource_shader _vertShader;
-  detail::gl_resource_shader _geomShader;
-  detail::gl_resource_shader _fragShader;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -619,24 +1708,77 @@ public:
 
   compute() { }
 
-  void set_source(const std::string &code) { _source = code; set_dirty(); }
+  void set_source(const std::string &code) { _source = code; clear_permutations(); }
   const std::string &source() const { return _source; }
 
-  bool bind() override;
-  void dispatch(int numGroupsX, int numGroupsY, int numGroupsZ = 1);
+  // Binds the program and launches the work groups, false when compute shaders are unsupported or not ready
+  bool dispatch(int numGroupsX, int numGroupsY = 1, int numGroupsZ = 1);
 
-protected:
-  virtual ~compute()
+  // Group counts are three GLuints read by the GPU from the buffer at offset
+  bool dispatch_indirect(detail::buffer *args, size_t offset = 0);
+
+  // local_size declared in the shader, valid once linked
+  ivec3 work_group_size() const;
+
+  // Makes writes of previous dispatches visible to the following commands, see the gl_api *_BARRIER_BIT flags
+  static void barrier(GLbitfield barriers = gl.ALL_BARRIER_BITS) { if (gl.MemoryBarrier) gl.MemoryBarrier(barriers); }
+
+  // Results read as vertex or index data by following draws
+  static void barrier_vertex_data() { barrier(gl.VERTEX_ATTRIB_ARRAY_BARRIER_BIT | gl.ELEMENT_ARRAY_BARRIER_BIT); }
+
+  // Results read by following dispatches or draws through storage buffers
+  static void barrier_storage() { barrier(gl.SHADER_STORAGE_BARRIER_BIT); }
+
+  // Results read through image units or sampled as textures
+  static void barrier_images() { barrier(gl.SHADER_IMAGE_ACCESS_BARRIER_BIT | gl.TEXTURE_FETCH_BARRIER_BIT); }
+
+  // Results copied back to the CPU with buffer::read_data or uploaded over
+  static void barrier_readback()
   {
-    _shader.destroy();
+    barrier(gl.BUFFER_UPDATE_BARRIER_BIT | gl.PIXEL_BUFFER_BARRIER_BIT | gl.TEXTURE_UPDATE_BARRIER_BIT);
   }
 
+protected:
+  virtual ~compute() { }
+
+  void get_stages(std::vector<stage> &stages) const override { stages.push_back({ gl.COMPUTE_SHADER, &_source }); }
+
   std::string _source;
-  detail::gl_resource_shader _shader;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+namespace detail
+{
+
+//---------------------------------------------------------------------------------------------------------------------
+// Read-only mapping of a whole file, the OS pages it in when touched and nothing gets copied to the heap
+class mapped_file : public ref_counted
+{
+public:
+  mapped_file() { }
+
+  bool open(const char *path);
+  void close();
+
+  const uint8_t *data() const { return _data; }
+  size_t size() const { return _size; }
+
+protected:
+  virtual ~mapped_file() { close(); }
+
+  const uint8_t *_data = nullptr;
+  size_t _size = 0;
+#if defined(WIN32)
+  HANDLE _file = INVALID_HANDLE_VALUE;
+  HANDLE _mapping = nullptr;
+#endif
+};
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 class texture : public detail::compiled_object
 {
 public:
@@ -653,7 +1795,7 @@ public:
     size_t mip_level = 0;   // layer mip level
     ivec2 size;             // width and height in pixels
     size_t offset = 0;      // byte offset from start of the buffer
-    size_t row_stride = 0;  // row size in bytes
+    size_t row_stride = 0;  // row size in bytes, a row of blocks for compressed formats
     size_t length = 0;      // total part size in bytes
   };
 
@@ -663,8 +1805,14 @@ public:
     return nullptr;
   }
 
+  // Format is GL_RGBA, GL_DEPTH_COMPONENT, GL_DEPTH_STENCIL or a block compressed internal format like
+  // COMPRESSED_RGBA_BPTC_UNORM, whose pixels are uploaded as they are. Layers are the depth of 3D textures, cube
+  // arrays have 6 faces per cube.
   void set_params(int width, int height, GLenum format, size_t sizeLayers, size_t sizeMipLevels);
 
+  // False for formats unknown to gl_format_descriptor and compressed formats the driver does not support
+  static bool format_supported(GLenum format);
+
   void set_format(GLenum format) { set_params(_size.x, _size.y, format, _sizeLayers, _sizeMipLevels); }
   GLenum format() const { return _format; }
 
@@ -674,14 +1822,25 @@ public:
   void set_size_layers(size_t count) { set_params(_size.x, _size.y, _format, count, _sizeMipLevels); }
   size_t size_layers() const { return _sizeLayers; }
 
+  // Layers of a mip level, the depth of 3D textures halves with every level
+  size_t mip_layers(size_t mipLevel) const
+  {
+    return (_type == gl.TEXTURE_3D) ? maximum(_sizeLayers >> mipLevel, static_cast<size_t>(1)) : _sizeLayers;
+  }
+
   void set_size_mip_levels(size_t count) { set_params(_size.x, _size.y, _format, _sizeLayers, count); }
   size_t size_mip_levels(bool calculate = false) const;
   
   size_t size_bytes() const { return _sizeBytes; }
 
-  void set_pixel_buffer(detail::buffer *pb) { _pbo = pb; set_dirty(); }
+  void set_pixel_buffer(detail::buffer *pb) { drop_file(); _pbo = pb; set_dirty(); }
   detail::buffer *pixel_buffer() const { return _pbo; }
 
+  // Loads a KTX2 or DDS file (2D, array or cubemap, without supercompression) with the mip levels it contains and
+  // takes type, format and size from it. The file stays mapped until the next bind uploads the parts straight from
+  // the mapping, their offsets are file offsets until then.
+  bool load(const char *path);
+
   void set_filter(GLenum minFilter, GLenum magFilter);
   GLenum min_filter() const { return _minFilter; }
   GLenum mag_filter() const { return _magFilter; }
@@ -689,8 +1848,13 @@ public:
   void set_wrap(GLenum wrap) { if (wrap != _wrap) { _wrap = wrap; set_dirty(); } }
   GLenum wrap() const { return _wrap; }
 
+  // Finest mip level sampled, e.g. while the finer ones are still streamed in
+  void set_base_mip_level(size_t level) { if (level != _baseMipLevel) { _baseMipLevel = level; set_dirty(); } }
+  size_t base_mip_level() const { return _baseMipLevel; }
+
   void *alloc_pixels(const void *ptr, bool keep = false)
   {
+    drop_file();
     if (!_pbo || !_sizeBytes) return nullptr;
     set_dirty();
     return _pbo->alloc_data(ptr, _sizeBytes, keep);
@@ -698,13 +1862,35 @@ public:
 
   void set_pixels(const void *ptr)
   {
+    drop_file();
     if (!_pbo || !_sizeBytes) return;
     set_dirty();
     _pbo->set_data(ptr, _sizeBytes);
   }
-  
+
+  enum class mip_filter
+  {
+    box,   // average of the covered texels, partially covered ones weighted by coverage for odd sizes
+    kaiser // Kaiser windowed sinc over 3 texels of the smaller level, sharper than box but rings slightly
+  };
+
+  // Computes mip levels 1 and up of all layers in the pixel buffer from level 0, a load time alternative to
+  // glGenerateMipmap for GL_RGBA. Every level is filtered from the previous one kept in float, in linear space when
+  // srgb is set, with layers and rows spread over threads. Edges wrap with GL_REPEAT and clamp otherwise. An
+  // alphaReference above 0 scales the alpha of each level so that as many texels pass an alpha test against it as in
+  // level 0, which keeps alpha tested foliage from thinning out with distance. Pixels given to set_pixels() are copied
+  // into a buffer of the texture first, the caller's memory is not written.
+  bool generate_mips(mip_filter filter = mip_filter::box, bool srgb = false, float alphaReference = 0.0f);
+
   bool bind(int slot = 0);
 
+  // Binds a mip level to an image unit for imageLoad/imageStore, all layers of array textures
+  bool bind_image(GLuint unit, GLenum access = GL_NONE, size_t mipLevel = 0);
+
+  // Replaces a part of the allocated storage, the texture has to be bound to the active unit. pixels is an offset
+  // while a GL_PIXEL_UNPACK_BUFFER is bound.
+  bool upload_part(const part &p, const GLvoid *pixels);
+
 protected:
   virtual ~texture()
   {
@@ -712,10 +1898,23 @@ protected:
   }
 
   void update_parts();
+  void alloc_storage();
+
+  // Parts laid out by a loaded file are replaced with the default layout. Size, format, layers and mip levels stay the
+  // same, so does the storage allocated for them.
+  void drop_file()
+  {
+    if (!_file) return;
+    bool storageValid = _storageValid;
+    _file = nullptr;
+    update_parts();
+    _storageValid = storageValid;
+  }
 
   GLenum _type;
   detail::gl_resource_texture _texture;
   detail::ptr<detail::buffer> _pbo = new detail::buffer();
+  detail::ptr<detail::mapped_file> _file;
   std::vector<part> _parts;
   GLenum _format = GL_RGBA;
   ivec2 _size;
@@ -724,455 +1923,3764 @@ protected:
   size_t _sizeBytes = 0;
   GLenum _minFilter = GL_NEAREST, _magFilter = GL_NEAREST;
   GLenum _wrap = GL_REPEAT;
+  size_t _baseMipLevel = 0;
+  bool _storageValid = false; // storage allocated for the current parts
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Framebuffer object with color attachments and an optional depth/stencil attachment, all of the same size. Attached
+// textures are resized with the target. Multisampled targets draw into renderbuffers and resolve() blits them into
+// the attached textures.
 class render_target : public detail::compiled_object
 {
 public:
   typedef detail::ptr<render_target> ptr;
 
-  render_target()
+  static const size_t max_color_attachments = 8;
+
+  render_target() { }
+
+  GLuint id() const { return _fbo.id; }
+
+  void set_size(int width, int height)
   {
-    
+    if (_size.x != width || _size.y != height) { _size = ivec2(width, height); set_dirty(); }
   }
 
+  const ivec2 &size() const { return _size; }
+
+  // Clamped to GL_MAX_SAMPLES, 0 or 1 renders single sampled
+  void set_samples(int samples) { if (samples != _samples) { _samples = samples; set_dirty(); } }
+  int samples() const { return _samples; }
+
+  // Texture attachment (GL_RGBA textures), nullptr removes the attachment
+  void set_color_texture(size_t index, texture *tex);
+  texture *color_texture(size_t index) const { return (index < max_color_attachments) ? _colors[index].tex : nullptr; }
+
+  // Renderbuffer attachment for content never sampled, with an internal format like GL_RGBA8 or GL_RGBA16F
+  void set_color_buffer(size_t index, GLenum internalFormat);
+
+  // Depth renderbuffer, GL_DEPTH24_STENCIL8 and GL_DEPTH32F_STENCIL8 include stencil, GL_NONE removes it
+  void set_depth_buffer(GLenum internalFormat);
+
+  // Depth texture of GL_DEPTH_COMPONENT or GL_DEPTH_STENCIL format, e.g. for shadow maps
+  void set_depth_texture(texture *tex);
+  texture *depth_texture() const { return _depth.tex; }
+
+  // Buffers (GL_COLOR_BUFFER_BIT, GL_DEPTH_BUFFER_BIT, GL_STENCIL_BUFFER_BIT) whose content is discarded whenever the
+  // target gets bound, so tiled GPUs neither load them nor keep them around. Only for targets fully redrawn every time.
+  void set_invalidate_on_bind(GLbitfield buffers) { _invalidateOnBind = buffers; }
+  GLbitfield invalidate_on_bind() const { return _invalidateOnBind; }
+
+  // False when the attachments do not form a complete framebuffer
+  bool complete() const { return _complete; }
+
+  // Builds the framebuffer when attachments changed and binds it for drawing and reading
+  bool bind();
+  void unbind() { gl_state.bind_framebuffer(gl.FRAMEBUFFER, 0); }
+
+  // Discards the content of buffers, e.g. depth once the last draw is done so it never gets written back
+  void invalidate(GLbitfield buffers);
+
+  // Blits multisampled color (and depth into a depth texture) into the attached textures, discarding the
+  // multisampled buffers afterwards unless keep is set. Does nothing for single sampled targets.
+  bool resolve(bool keep = false);
+
 protected:
+  struct attachment
+  {
+    detail::ptr<texture> tex;
+    GLenum format = GL_NONE;                 // renderbuffer internal format when there is no texture
+    detail::gl_resource_renderbuffer buffer; // used for all attachments of multisampled targets
+  };
+
   virtual ~render_target()
   {
-    
+    for (auto &&a : _colors) a.buffer.destroy();
+    _depth.buffer.destroy();
+    _fbo.destroy();
+    _resolveFbo.destroy();
   }
+
+  bool build();
+  void attach(GLenum point, attachment &a, GLsizei samples);
+  void attach_resolve(GLenum point, const attachment &a);
+  bool has_stencil() const;
+  size_t get_invalidate_points(GLbitfield buffers, GLenum *points) const;
+
+  ivec2 _size;
+  int _samples = 0;
+  GLsizei _activeSamples = 0;
+  attachment _colors[max_color_attachments];
+  attachment _depth;
+  GLbitfield _invalidateOnBind = 0;
+  GLenum _readBuffer = GL_NONE;
+  bool _complete = false;
+  detail::gl_resource_framebuffer _fbo;
+  detail::gl_resource_framebuffer _resolveFbo; // textures of multisampled targets
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-class context3d
+// Hands out render targets for intermediate passes (blur, bloom, tone mapping...) by size, format and samples. A
+// target released within a frame is handed to the next request of the same descriptor, so passes whose lifetimes do
+// not overlap share its storage. Released targets are recycled across frames and destroyed once unused for a while,
+// all targets still acquired when a new frame starts are released.
+class render_target_pool
 {
 public:
-  context3d();
-  virtual ~context3d() { }
+  struct stats
+  {
+    size_t requests = 0;    // acquire() calls
+    size_t allocations = 0; // targets created, the other requests reused one
+    size_t naive_bytes = 0; // storage of a new target per request
+    size_t peak_bytes = 0;  // storage acquired at the same time at most
+    size_t pool_bytes = 0;  // storage held by the pool at the end of the frame
+  };
 
-  void clear();
+  render_target_pool() { }
+  ~render_target_pool() { clear(); }
 
-  bool bind(detail::base_geometry *geom);
-  bool bind(detail::compiled_program *prog);
-  bool bind(texture *tex, int slot = 0);
+  // Target with a single texture of the format, a color texture (GL_RGBA) or a depth texture (GL_DEPTH_COMPONENT,
+  // GL_DEPTH_STENCIL). Multisampled targets draw into renderbuffers and have to be resolved before sampling. The
+  // content is undefined, reused targets get their buffers invalidated.
+  render_target *acquire(int width, int height, GLenum format = GL_RGBA, int samples = 0);
 
-  bool set_uniform(const char *name, int value);
-  bool set_uniform(const char *name, const vec2 &value);
-  bool set_uniform(const char *name, const mat4 &value);
-  bool set_uniform(const char *name, texture *value);
-    
-  int get_free_texture_slot() const { for (int i = 0; i < 16; ++i) if (_textures[i].empty()) return i; return -1; }
+  // Makes the storage available to following requests, the target must not be used anymore
+  void release(render_target *rt);
 
-  bool draw(GLenum primitive = GL_TRIANGLES, size_t offset = 0, size_t length = static_cast<size_t>(-1));
+  // Released targets not requested for this many frames are destroyed
+  void set_max_unused_frames(size_t count) { _maxUnusedFrames = count; }
+  size_t max_unused_frames() const { return _maxUnusedFrames; }
 
-private:
-  technique::ptr _basicTechnique;
-  detail::ptr<detail::base_geometry> _geometry;
-  detail::ptr<detail::compiled_program> _program;
-  detail::ptr<texture> _textures[16];
-};
+  // Destroys all targets, including acquired ones
+  void clear() { _entries.clear(); _bytes = _acquiredBytes = 0; }
 
-}
+  size_t size() const { return _entries.size(); }
+  size_t size_bytes() const { return _bytes; }
 
-#endif // __GL3D_H__
+  const stats &frame_stats() const { return _frame; }
+  const stats &last_frame_stats() const { return _lastFrame; }
 
-#if defined(GL3D_IMPLEMENTATION)
-#ifndef __GL3D_H_IMPL__
-#define __GL3D_H_IMPL__
+private:
+  struct entry
+  {
+    ivec2 size;
+    GLenum format = GL_NONE;
+    int samples = 0;
+    size_t bytes = 0;
+    size_t last_frame = 0;
+    bool acquired = false;
+    render_target::ptr target;
+  };
 
-#ifdef _MSC_VER
-#pragma comment(lib, "opengl32.lib")
-#endif
+  void begin_frame();
 
-namespace gl3d {
+  std::vector<entry> _entries;
+  size_t _bytes = 0;
+  size_t _acquiredBytes = 0;
+  size_t _maxUnusedFrames = 4;
+  size_t _frameIndex = 0;
+  stats _frame, _lastFrame;
+};
 
-static detail::gl_api gl;
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-namespace detail {
+// Streams texture parts through a ring of pixel unpack memory, so large textures arrive over several frames instead
+// of stalling the bind that uploads them. Any thread reserves room for a part with begin_part(), writes its pixels
+// there and hands it over with end_part(). update() uploads the handed over parts in order until the frame's byte
+// budget is spent. Until all of its mip levels arrived, a texture samples from the finest level whose coarser levels
+// are all resident, so stream the small levels first.
+class texture_streamer
+{
+public:
+  struct stats
+  {
+    size_t parts = 0;   // parts uploaded
+    size_t bytes = 0;   // bytes uploaded
+    size_t pending = 0; // handed over parts left for the following frames
+  };
 
-//------------------------------------------------------------------------------------------------------------------------
-void gl_resource_buffer::destroy() { if (id > 0) gl.DeleteBuffers(1, &id); id = 0; }
-void gl_resource_vao::destroy() { if (id > 0) gl.DeleteVertexArrays(1, &id); id = 0; }
-void gl_resource_shader::destroy() { if (id > 0) gl.DeleteShader(id); id = 0; }
-void gl_resource_program::destroy() { if (id > 0) gl.DeleteProgram(id); id = 0; }
-void gl_resource_texture::destroy() { if (id > 0) glDeleteTextures(1, &id); id = 0; }
+  // The ring is a persistently mapped buffer with ARB_buffer_storage, which the threads write into directly, CPU
+  // memory copied into a buffer at upload otherwise. Needs the context current, as does the destructor.
+  texture_streamer(size_t ringSize = 32 * 1024 * 1024, size_t frameBudget = 4 * 1024 * 1024);
+  ~texture_streamer();
 
-//------------------------------------------------------------------------------------------------------------------------
-bool gl_api::init()
-{
-  for (auto &&i : _initializers)
-    if (!i->lambda(i->proc_address))
-      return false;
+  void set_frame_budget(size_t bytes) { _frameBudget = bytes; }
+  size_t frame_budget() const { return _frameBudget; }
+  size_t ring_size() const { return _ringSize; }
 
-  return true;
-}
+  // Thread safe. Returns where to write the pixels of a part, laid out as texture::part describes it, or nullptr
+  // while the ring is full (parts larger than the ring never fit). The texture must not change until the upload.
+  uint8_t *begin_part(texture *tex, size_t layerIndex, size_t mipLevel);
 
-//------------------------------------------------------------------------------------------------------------------------
-bool gl_resource_shader::compile(GLenum shaderType, const std::string &source)
-{
-  if (!id) id = gl.CreateShader(shaderType);
-  auto srcPtr = source.c_str();
-  gl.ShaderSource(id, 1, &srcPtr, nullptr);
-  gl.CompileShader(id);
+  // Thread safe, queues the part written to pixels
+  void end_part(uint8_t *pixels);
 
-  GLint status; gl.GetShaderiv(id, gl.COMPILE_STATUS, &status);
-  if (status == GL_FALSE)
-  {
-    gl.DeleteShader(id); id = 0;
-    return false;
-  }
+  // Render thread, once per frame. Reclaims the ring space of uploads the GPU is done with and uploads queued parts.
+  void update();
 
-  return true;
-}
+  // Upload statistics of the last update()
+  const stats &update_stats() const { return _stats; }
 
-//------------------------------------------------------------------------------------------------------------------------
-bool gl_resource_program::link(const std::initializer_list<gl_resource_shader> &shaders)
+private:
+  struct upload
+  {
+    texture::ptr tex;
+    size_t layer_index;
+    size_t mip_level;
+    size_t offset;     // ring offset
+    size_t size;
+    bool ready;        // pixels written
+    size_t submission; // update() that uploaded it, 0 while queued
+  };
+
+  struct residency
+  {
+    texture::ptr tex;
+    std::vector<size_t> layers; // uploaded layers per mip level
+  };
+
+  bool alloc(size_t size, size_t &offset);
+  void submit(upload &u);
+  void retire();
+
+  size_t _ringSize;
+  size_t _frameBudget;
+  size_t _head = 0;
+  uint8_t *_persistentData = nullptr;
+  std::vector<uint8_t> _staging;
+  detail::gl_resource_buffer _buffer;
+  std::deque<upload> _uploads;                            // in ring order
+  std::deque<std::pair<size_t, detail::GLsync>> _fences; // submission and its fence
+  size_t _submission = 0;
+  size_t _completedSubmission = 0;
+  std::map<texture *, residency> _residency;              // textures with mip levels still missing
+  std::mutex _mutex;
+  stats _stats;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace detail
+{
+
+//---------------------------------------------------------------------------------------------------------------------
+// Linear allocator for data rebuilt every frame. reset() keeps the blocks, so once they have grown to a frame's size
+// allocating is just bumping an offset.
+class arena
+{
+public:
+  explicit arena(size_t blockSize = 64 * 1024): _blockSize(blockSize) { }
+  arena(const arena &) = delete;
+  arena &operator=(const arena &) = delete;
+  ~arena() { for (auto &&b : _blocks) delete [] b.data; }
+
+  void *alloc(size_t size, size_t alignment = 16)
+  {
+    if (_current < _blocks.size())
+    {
+      auto &b = _blocks[_current];
+      size_t offset = (_offset + alignment - 1) & ~(alignment - 1);
+      if (offset + size <= b.size)
+      {
+        _offset = offset + size;
+        _used += size;
+        return b.data + offset;
+      }
+    }
+
+    return alloc_block(size, alignment);
+  }
+
+  void reset() { _current = 0; _offset = 0; _used = 0; }
+
+  size_t used() const { return _used; }
+  size_t capacity() const { size_t size = 0; for (auto &&b : _blocks) size += b.size; return size; }
+
+private:
+  struct block
+  {
+    uint8_t *data;
+    size_t size;
+  };
+
+  void *alloc_block(size_t size, size_t alignment);
+
+  std::vector<block> _blocks;
+  size_t _current = 0;
+  size_t _offset = 0;
+  size_t _used = 0;
+  size_t _blockSize;
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Draws recorded by a deferred context3d, with the objects and uniform values they use. sort() orders them by a 64-bit
+// key of layer (8 bits), program (12), texture set (12), geometry (12) and depth (20), objects get per-flush ids in
+// the order they are first used. Equal keys keep their submission order.
+class draw_queue
+{
+public:
+  struct stats
+  {
+    size_t draws = 0;
+    size_t program_changes = 0;            // state changes executing the sorted draws
+    size_t geometry_changes = 0;
+    size_t texture_changes = 0;
+    size_t submitted_program_changes = 0;  // the same draws executed in submission order, as in immediate mode
+    size_t submitted_geometry_changes = 0;
+    size_t submitted_texture_changes = 0;
+  };
+
+  struct uniform_record
+  {
+    compiled_program *program; // program the index belongs to, the placeholder of a pending program
+    int index;
+    bool (*apply)(compiled_program *, int, const void *);
+    uint8_t value[sizeof(mat4)];
+  };
+
+  struct program_entry
+  {
+    ptr<compiled_program> program;
+    compiled_program::permutation_id permutation;
+    std::vector<uniform_record> uniforms; // latest value of every uniform set since the last flush
+    bool changed = false;                 // uniforms changed since the last recorded draw
+    size_t block = 0;                     // uniform block of the last recorded draw
+  };
+
+  struct command
+  {
+    uint32_t program, textures, geometry;
+    size_t uniforms, numUniforms;         // range of uniform_records applied before the draw
+    GLenum primitive;
+    size_t offset, length, numInstances;
+    size_t batch, batchSize;              // range of indirect commands, for geometry pool batches
+  };
+
+  bool empty() const { return _commands.empty(); }
+  size_t size() const { return _commands.size(); }
+
+  uint32_t program_id(compiled_program *program);
+
+  template <typename T> bool set_uniform(uint32_t program, compiled_program *target, int index, const T &value)
+  {
+    static_assert(sizeof(T) <= sizeof(uniform_record::value), "unsupported uniform type");
+    if (!target || index < 0 || index >= static_cast<int>(target->uniforms().size())) return false;
+
+    auto &entry = _programs[program];
+    auto iter = std::find_if(entry.uniforms.begin(), entry.uniforms.end(),
+      [&](const uniform_record &u) { return u.program == target && u.index == index; });
+
+    if (iter == entry.uniforms.end())
+      iter = entry.uniforms.insert(entry.uniforms.end(), { target, index, &apply_uniform<T>, {} });
+    else if (!memcmp(iter->value, &value, sizeof(T)))
+      return true;
+
+    memcpy(iter->value, &value, sizeof(T));
+    entry.changed = true;
+    return true;
+  }
+
+  // Records a draw with the uniforms currently set for its program, cmd gets its object ids and uniform range here
+  void push(command cmd, texture *const *textures, base_geometry *geom, uint8_t layer, float depth);
+
+  // Appends indirect commands of a geometry pool batch, returns their offset for command::batch
+  size_t push_batch(const std::vector<draw_elements_indirect_command> &batch);
+
+  // Returns the command indices in key order and adds their state changes to the stats
+  const std::vector<uint32_t> &sort(stats &st);
+
+  const command &get_command(size_t i) const { return _commands[i]; }
+  const program_entry &get_program(uint32_t id) const { return _programs[id]; }
+  size_t num_programs() const { return _programs.size(); }
+  texture *const *get_textures(uint32_t id) const { return _textureSets[id].data(); }
+  base_geometry *get_geometry(uint32_t id) const { return _geometries[id]; }
+  const uniform_record *get_uniforms(size_t offset) const { return _uniforms.data() + offset; }
+  const draw_elements_indirect_command *get_batch(size_t offset) const { return _batches.data() + offset; }
+
+  void clear();
+
+private:
+  typedef std::array<texture *, 16> texture_set;
+
+  template <typename T> static bool apply_uniform(compiled_program *program, int index, const void *value)
+  {
+    T v;
+    memcpy(static_cast<void *>(&v), value, sizeof(T));
+    return program->set_uniform(index, v);
+  }
+
+  static uint64_t make_key(uint8_t layer, uint32_t program, uint32_t textures, uint32_t geometry, float depth);
+
+  std::vector<command> _commands;
+  std::vector<uint64_t> _keys;
+  std::vector<uint32_t> _order, _scratch;
+  std::vector<uniform_record> _uniforms;
+  std::vector<draw_elements_indirect_command> _batches;
+
+  std::vector<program_entry> _programs;
+  std::map<std::pair<compiled_program *, compiled_program::permutation_id>, uint32_t> _programIds;
+  std::vector<texture_set> _textureSets;
+  std::vector<ptr<texture>> _textureRefs;
+  std::map<texture_set, uint32_t> _textureSetIds;
+  std::vector<ptr<base_geometry>> _geometries;
+  std::unordered_map<base_geometry *, uint32_t> _geometryIds;
+};
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class context3d
+{
+public:
+  context3d();
+  virtual ~context3d() { }
+
+  void clear();
+
+  bool bind(detail::base_geometry *geom);
+  bool bind(detail::compiled_program *prog);
+  bool bind(texture *tex, int slot = 0);
+
+  // Draws go to the render target, or to the window for nullptr, the viewport is set to cover it. Deferred draws
+  // recorded so far are flushed into the previous target first.
+  bool bind(render_target *rt);
+
+  // Size of the window framebuffer, set by the window backends before every paint
+  void set_backbuffer_size(int width, int height) { _backbufferSize = ivec2(width, height); }
+
+  bool set_uniform(const char *name, int value) { return set_uniform_value(name, value); }
+  bool set_uniform(const char *name, float value) { return set_uniform_value(name, value); }
+  bool set_uniform(const char *name, const vec2 &value) { return set_uniform_value(name, value); }
+  bool set_uniform(const char *name, const vec3 &value) { return set_uniform_value(name, value); }
+  bool set_uniform(const char *name, const vec4 &value) { return set_uniform_value(name, value); }
+  bool set_uniform(const char *name, const mat4 &value) { return set_uniform_value(name, value); }
+  bool set_uniform(const char *name, texture *value);
+
+  template <typename T> bool set_uniform(const uniform_handle<T> &handle, const T &value)
+  {
+    auto program = active_program();
+    if (!program || handle.program() != program) return false;
+    return apply_uniform(program, handle.index(), value);
+  }
+
+  bool set_uniform(const uniform_handle<texture *> &handle, texture *value);
+    
+  int get_free_texture_slot() const { for (int i = 0; i < 16; ++i) if (_textures[i].empty()) return i; return -1; }
+
+  // Draws indexed when the geometry has indices, offset and length are then in indices instead of vertices.
+  // Instanced geometries draw all of their instances, geometry pools all of their meshes.
+  bool draw(GLenum primitive = GL_TRIANGLES, size_t offset = 0, size_t length = static_cast<size_t>(-1));
+
+  // Draws numInstances copies in one call, shaders tell them apart by gl_InstanceID or per-instance attributes
+  bool draw_instanced(size_t numInstances, GLenum primitive = GL_TRIANGLES, size_t offset = 0,
+    size_t length = static_cast<size_t>(-1));
+
+  // Queues a mesh of the bound geometry pool, binding another geometry drops the queue
+  bool batch(size_t mesh, size_t numInstances = 1);
+  size_t batch_size() const { return _batch.size(); }
+
+  // Draws the queued meshes with one glMultiDraw*Indirect call and empties the queue. Without GL 4.3 it falls back to
+  // glMultiDrawElementsBaseVertex / glMultiDrawArrays, or a call per mesh for meshes with several instances.
+  bool draw_batch(GLenum primitive = GL_TRIANGLES);
+
+  // Deferred mode records draws together with the uniforms and textures set for them, flush() executes them sorted
+  // by layer, program, texture set, geometry and depth. Geometries and textures must not change until the flush.
+  void set_deferred(bool deferred);
+  bool deferred() const { return _deferred; }
+
+  // Sort inputs of the following deferred draws, lower layers are drawn first (e.g. opaque before transparent) and
+  // smaller depths first within the same state. Depths can be negative, pass -distance to draw back to front.
+  void set_draw_layer(uint8_t layer) { _drawLayer = layer; }
+  void set_draw_depth(float depth) { _drawDepth = depth; }
+
+  // Executes the recorded draws, the window backends call it after every paint event
+  void flush();
+
+  typedef detail::draw_queue::stats queue_stats;
+  const queue_stats &queue_frame_stats() const { return _queueFrame; }
+  const queue_stats &queue_last_frame_stats() const { return _queueLastFrame; }
+
+private:
+  // Program receiving uniforms and draws, made current again in case other code (e.g. a dispatch) changed it
+  detail::compiled_program *active_program() const
+  {
+    if (!_program) return nullptr;
+    auto program = _program->active();
+    if (!_deferred) gl_state.use_program(program->id());
+    return program;
+  }
+
+  template <typename T> bool set_uniform_value(const char *name, const T &value)
+  {
+    auto program = active_program();
+    if (!program) return false;
+    return apply_uniform(program, program->find_uniform(name), value);
+  }
+
+  template <typename T> bool apply_uniform(detail::compiled_program *program, int index, const T &value)
+  {
+    if (_deferred) return _queue.set_uniform(_queue.program_id(_program), program, index, value);
+    return program->set_uniform(index, value);
+  }
+
+  bool set_uniform_texture(int index, texture *value);
+  bool prepare_draw();
+  bool draw_geometry(GLenum primitive, size_t offset, size_t length, size_t numInstances);
+  bool draw_batch_indirect(GLenum primitive, bool indexed);
+  bool queue_draw(detail::draw_queue::command &cmd);
+  void draw_batch_direct(GLenum primitive, bool indexed);
+
+  technique::ptr _basicTechnique;
+  detail::compiled_program::permutation_id _basicPermutation;
+  detail::compiled_program::permutation_id _instancedPermutation;
+  detail::ptr<detail::base_geometry> _geometry;
+  detail::ptr<detail::compiled_program> _program;
+  detail::ptr<texture> _textures[16];
+  render_target::ptr _renderTarget;
+  ivec2 _backbufferSize;
+
+  // array draws keep the first vertex in firstIndex
+  std::vector<detail::draw_elements_indirect_command> _batch;
+  detail::ptr<detail::stream_buffer> _indirectBuffer;
+  size_t _indirectCursor = 0;
+  size_t _indirectFrame = 0;
+  std::vector<GLsizei> _batchCounts;
+  std::vector<GLint> _batchFirsts;
+  std::vector<const GLvoid *> _batchIndices;
+
+  bool _deferred = false;
+  uint8_t _drawLayer = 0;
+  float _drawDepth = 0.0f;
+  detail::draw_queue _queue;
+  queue_stats _queueFrame, _queueLastFrame;
+  size_t _queueFrameIndex = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Records context3d calls without touching GL, so worker threads can prepare draws in parallel. A buffer is filled by
+// one thread at a time and executed on the render thread, buffers run in the order they are executed. Commands and
+// uniform names live in an arena reused after reset(), recording stops allocating once it has grown to a frame's size.
+class command_buffer : public detail::ref_counted
+{
+public:
+  typedef detail::ptr<command_buffer> ptr;
+
+  command_buffer() { }
+
+  void bind(detail::base_geometry *geom)
+  {
+    push<detail::base_geometry *>(&run_bind<detail::base_geometry *>, geom) = geom;
+  }
+
+  void bind(detail::compiled_program *prog)
+  {
+    push<detail::compiled_program *>(&run_bind<detail::compiled_program *>, prog) = prog;
+  }
+
+  void bind(texture *tex, int slot = 0) { push<texture_args>(&run_bind_texture, tex) = { tex, slot }; }
+  void bind(render_target *rt) { push<render_target *>(&run_bind<render_target *>, rt) = rt; }
+
+  void set_uniform(const char *name, int value) { record_uniform<int>(name, nullptr, value); }
+  void set_uniform(const char *name, float value) { record_uniform<float>(name, nullptr, value); }
+  void set_uniform(const char *name, const vec2 &value) { record_uniform<vec2>(name, nullptr, value); }
+  void set_uniform(const char *name, const vec3 &value) { record_uniform<vec3>(name, nullptr, value); }
+  void set_uniform(const char *name, const vec4 &value) { record_uniform<vec4>(name, nullptr, value); }
+  void set_uniform(const char *name, const mat4 &value) { record_uniform<mat4>(name, nullptr, value); }
+  void set_uniform(const char *name, texture *value) { record_uniform<texture *>(name, nullptr, value, value); }
+
+  // The handle is referenced, it has to stay alive until the buffer gets executed
+  template <typename T> void set_uniform(const uniform_handle<T> &handle, const T &value)
+  {
+    record_uniform<T>(nullptr, &handle, value);
+  }
+
+  void set_uniform(const uniform_handle<texture *> &handle, texture *value)
+  {
+    record_uniform<texture *>(nullptr, &handle, value, value);
+  }
+
+  void draw(GLenum primitive = GL_TRIANGLES, size_t offset = 0, size_t length = static_cast<size_t>(-1))
+  {
+    push(&run_draw) = { primitive, offset, length, 0 };
+  }
+
+  void draw_instanced(size_t numInstances, GLenum primitive = GL_TRIANGLES, size_t offset = 0,
+    size_t length = static_cast<size_t>(-1))
+  {
+    push(&run_draw) = { primitive, offset, length, numInstances };
+  }
+
+  void batch(size_t mesh, size_t numInstances = 1) { push(&run_batch) = { GL_NONE, mesh, 0, numInstances }; }
+  void draw_batch(GLenum primitive = GL_TRIANGLES) { push(&run_draw_batch) = { primitive, 0, 0, 0 }; }
+
+  void set_draw_layer(uint8_t layer) { push<uint8_t>(&run_draw_layer) = layer; }
+  void set_draw_depth(float depth) { push<float>(&run_draw_depth) = depth; }
+
+  // Replays the commands in recording order on the thread owning the context, returns false if any of them failed.
+  // The buffer stays intact and can be executed again.
+  bool execute(context3d &ctx) const;
+
+  // Drops the commands and releases the objects they hold, to be called on the render thread
+  void reset();
+
+  size_t num_commands() const { return _numCommands; }
+  size_t size_bytes() const { return _arena.used(); }
+
+protected:
+  virtual ~command_buffer() { reset(); }
+
+  struct command
+  {
+    bool (*run)(context3d &ctx, const command *cmd);
+    command *next;
+    const detail::ref_counted *ref; // released by reset()
+  };
+
+  template <typename T> struct typed_command : command { T args; };
+
+  struct texture_args { texture *tex; int slot; };
+  struct draw_args { GLenum primitive; size_t offset, length, count; };
+
+  template <typename T> struct uniform_args
+  {
+    const char *name;
+    const uniform_handle<T> *handle;
+    T value;
+  };
+
+  template <typename T> static const T &args(const command *cmd)
+  {
+    return static_cast<const typed_command<T> *>(cmd)->args;
+  }
+
+  // Appends a command running fn, the returned arguments are filled in by the caller
+  template <typename T> T &push(bool (*fn)(context3d &, const command *), const detail::ref_counted *ref = nullptr)
+  {
+    auto cmd = new (_arena.alloc(sizeof(typed_command<T>), alignof(typed_command<T>))) typed_command<T>();
+    cmd->run = fn;
+    cmd->next = nullptr;
+    cmd->ref = ref;
+    if (ref) ref->ref();
+
+    if (_last) _last->next = cmd; else _first = cmd;
+    _last = cmd;
+    ++_numCommands;
+    return cmd->args;
+  }
+
+  draw_args &push(bool (*fn)(context3d &, const command *)) { return push<draw_args>(fn); }
+
+  template <typename T> void record_uniform(const char *name, const uniform_handle<T> *handle, const T &value,
+    const detail::ref_counted *ref = nullptr)
+  {
+    char *nameCopy = nullptr;
+    if (name)
+    {
+      size_t length = strlen(name) + 1;
+      nameCopy = static_cast<char *>(_arena.alloc(length, 1));
+      memcpy(nameCopy, name, length);
+    }
+
+    push<uniform_args<T>>(&run_uniform<T>, ref) = { nameCopy, handle, value };
+  }
+
+  template <typename T> static bool run_bind(context3d &ctx, const command *cmd) { return ctx.bind(args<T>(cmd)); }
+
+  static bool run_bind_texture(context3d &ctx, const command *cmd)
+  {
+    auto &a = args<texture_args>(cmd);
+    return ctx.bind(a.tex, a.slot);
+  }
+
+  template <typename T> static bool run_uniform(context3d &ctx, const command *cmd)
+  {
+    auto &a = args<uniform_args<T>>(cmd);
+    return a.handle ? ctx.set_uniform(*a.handle, a.value) : ctx.set_uniform(a.name, a.value);
+  }
+
+  static bool run_draw(context3d &ctx, const command *cmd)
+  {
+    auto &a = args<draw_args>(cmd);
+    return a.count ? ctx.draw_instanced(a.count, a.primitive, a.offset, a.length) :
+      ctx.draw(a.primitive, a.offset, a.length);
+  }
+
+  static bool run_batch(context3d &ctx, const command *cmd)
+  {
+    auto &a = args<draw_args>(cmd);
+    return ctx.batch(a.offset, a.count);
+  }
+
+  static bool run_draw_batch(context3d &ctx, const command *cmd)
+  {
+    return ctx.draw_batch(args<draw_args>(cmd).primitive);
+  }
+
+  static bool run_draw_layer(context3d &ctx, const command *cmd)
+  {
+    ctx.set_draw_layer(args<uint8_t>(cmd));
+    return true;
+  }
+
+  static bool run_draw_depth(context3d &ctx, const command *cmd)
+  {
+    ctx.set_draw_depth(args<float>(cmd));
+    return true;
+  }
+
+  detail::arena _arena;
+  command *_first = nullptr;
+  command *_last = nullptr;
+  size_t _numCommands = 0;
+};
+
+}
+
+#endif // __GL3D_H__
+
+#if defined(GL3D_IMPLEMENTATION)
+#ifndef __GL3D_H_IMPL__
+#define __GL3D_H_IMPL__
+
+#ifdef _MSC_VER
+#pragma comment(lib, "opengl32.lib")
+#endif
+
+namespace gl3d {
+
+detail::gl_api gl;
+detail::gl_state_cache gl_state;
+program_binary_cache program_cache;
+
+namespace detail {
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_resource_buffer::destroy() { if (id > 0) { gl_state.forget_buffer(id); gl.DeleteBuffers(1, &id); } id = 0; }
+void gl_resource_vao::destroy() { if (id > 0) { gl_state.forget_vertex_array(id); gl.DeleteVertexArrays(1, &id); } id = 0; }
+void gl_resource_shader::destroy() { if (id > 0) gl.DeleteShader(id); id = 0; }
+void gl_resource_program::destroy() { if (id > 0) { gl_state.forget_program(id); gl.DeleteProgram(id); } id = 0; }
+void gl_resource_texture::destroy() { if (id > 0) { gl_state.forget_texture(id); glDeleteTextures(1, &id); } id = 0; }
+void gl_resource_framebuffer::destroy() { if (id > 0) { gl_state.forget_framebuffer(id); gl.DeleteFramebuffers(1, &id); } id = 0; }
+void gl_resource_renderbuffer::destroy() { if (id > 0) gl.DeleteRenderbuffers(1, &id); id = 0; }
+
+//------------------------------------------------------------------------------------------------------------------------
+bool gl_api::init()
+{
+  for (auto &&i : _initializers)
+    if (!i->lambda(i->proc_address))
+      return false;
+
+  bool khrParallel = has_extension("GL_KHR_parallel_shader_compile");
+  parallel_shader_compile = khrParallel || has_extension("GL_ARB_parallel_shader_compile");
+
+  // let the driver pick the number of compiler threads
+  if (khrParallel && MaxShaderCompilerThreadsKHR)
+    MaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+
+  GLint major = 0, minor = 0;
+  glGetIntegerv(MAJOR_VERSION, &major);
+  glGetIntegerv(MINOR_VERSION, &minor);
+  int version = major * 10 + minor;
+  texture_compression_s3tc = has_extension("GL_EXT_texture_compression_s3tc");
+  texture_compression_bptc = version >= 42 || has_extension("GL_ARB_texture_compression_bptc");
+  texture_compression_etc2 = version >= 43 || has_extension("GL_ARB_ES3_compatibility");
+  texture_compression_astc = has_extension("GL_KHR_texture_compression_astc_ldr");
+
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool gl_api::has_extension(const char *name) const
+{
+  if (!GetStringi)
+    return false;
+
+  GLint numExtensions = 0;
+  glGetIntegerv(NUM_EXTENSIONS, &numExtensions);
+  for (GLint i = 0; i < numExtensions; ++i)
+  {
+    auto ext = reinterpret_cast<const char *>(GetStringi(GL_EXTENSIONS, i));
+    if (ext && !strcmp(ext, name)) return true;
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_state_cache::invalidate()
+{
+  _program = _vao = _activeTexture = unknown;
+  _drawFramebuffer = _readFramebuffer = unknown;
+  _numBuffers = _numCaps = 0;
+  for (auto &&t : _textures) t = { GL_NONE, unknown };
+  _blendSrc = _blendDst = GL_NONE;
+  _viewport[0] = _viewport[1] = _viewport[2] = _viewport[3] = -1;
+  _scissor[0] = _scissor[1] = _scissor[2] = _scissor[3] = -1;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_state_cache::use_program(GLuint id)
+{
+  if (update(_program, id))
+    gl.UseProgram(id);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_state_cache::bind_vertex_array(GLuint id)
+{
+  if (update(_vao, id))
+  {
+    gl.BindVertexArray(id);
+
+    // element array binding is part of the VAO
+    for (size_t i = 0; i < _numBuffers; ++i)
+      if (_buffers[i].target == gl.ELEMENT_ARRAY_BUFFER) _buffers[i].id = unknown;
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_state_cache::bind_buffer(GLenum target, GLuint id)
+{
+  size_t i = 0;
+  while (i < _numBuffers && _buffers[i].target != target) ++i;
+  if (i == _numBuffers && _numBuffers < 16) _buffers[_numBuffers++] = { target, unknown };
+
+  if (i == 16 || update(_buffers[i].id, id))
+    gl.BindBuffer(target, id);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_state_cache::bind_framebuffer(GLenum target, GLuint id)
+{
+  if (target == gl.FRAMEBUFFER)
+  {
+    if (_drawFramebuffer == id && _readFramebuffer == id) { ++_frame.elided; return; }
+    _drawFramebuffer = _readFramebuffer = id; ++_frame.calls;
+    gl.BindFramebuffer(target, id);
+  }
+  else if (update((target == gl.READ_FRAMEBUFFER) ? _readFramebuffer : _drawFramebuffer, id))
+    gl.BindFramebuffer(target, id);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_state_cache::active_texture(int unit)
+{
+  if (update(_activeTexture, static_cast<GLuint>(unit)))
+    gl.ActiveTexture(gl.TEXTURE0 + unit);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_state_cache::bind_texture(int unit, GLenum target, GLuint id)
+{
+  active_texture(unit);
+
+  auto &t = _textures[unit % max_texture_units];
+  if (t.target != target) { t.target = target; t.id = unknown; }
+  if (update(t.id, id))
+    glBindTexture(target, id);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_state_cache::set_enabled(GLenum cap, bool enabled)
+{
+  size_t i = 0;
+  while (i < _numCaps && _caps[i].cap != cap) ++i;
+  if (i == _numCaps && _numCaps < 8) _caps[_numCaps++] = { cap, -1 };
+
+  if (i == 8 || update(_caps[i].enabled, enabled ? 1 : 0))
+  {
+    if (enabled) glEnable(cap);
+    else glDisable(cap);
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_state_cache::set_blend_func(GLenum src, GLenum dst)
+{
+  if (_blendSrc != src || _blendDst != dst)
+  {
+    _blendSrc = src; _blendDst = dst;
+    ++_frame.calls;
+    glBlendFunc(src, dst);
+  }
+  else
+    ++_frame.elided;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_state_cache::set_viewport(int x, int y, int width, int height)
+{
+  if (_viewport[0] != x || _viewport[1] != y || _viewport[2] != width || _viewport[3] != height)
+  {
+    _viewport[0] = x; _viewport[1] = y; _viewport[2] = width; _viewport[3] = height;
+    ++_frame.calls;
+    glViewport(x, y, width, height);
+  }
+  else
+    ++_frame.elided;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void gl_state_cache::set_scissor(int x, int y, int width, int height)
+{
+  if (_scissor[0] != x || _scissor[1] != y || _scissor[2] != width || _scissor[3] != height)
+  {
+    _scissor[0] = x; _scissor[1] = y; _scissor[2] = width; _scissor[3] = height;
+    ++_frame.calls;
+    glScissor(x, y, width, height);
+  }
+  else
+    ++_frame.elided;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+compiled_program::permutation_id compiled_program::declare_permutation(const macro_set &macros)
+{
+  permutation_id id = hash_macros(macros);
+  auto &entry = _permutations[id];
+  entry.macros = macros;
+  return id;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool compiled_program::select_permutation(permutation_id id)
+{
+  if (id == _permutation)
+    return true;
+
+  if (id != _macrosPermutation && _permutations.find(id) == _permutations.end())
+    return false;
+
+  _permutation = id;
+  set_dirty();
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void compiled_program::precompile_permutations()
+{
+  std::vector<permutation_id> ids;
+  for (auto &&kvp : _permutations)
+    if (!kvp.second.program.id && kvp.first != _programPermutation)
+      ids.push_back(kvp.first);
+
+  permutation_id selected = _permutation;
+  for (auto id : ids)
+  {
+    select_permutation(id);
+    bind();
+  }
+
+  select_permutation(selected);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+size_t compiled_program::num_resident_permutations() const
+{
+  size_t count = _program.id ? 1 : 0;
+  for (auto &&kvp : _permutations) if (kvp.second.program.id && !kvp.second.pending) ++count;
+  return count;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void compiled_program::clear_permutations()
+{
+  // declared macro sets are kept, only the programs are built from the old sources
+  for (auto &&kvp : _permutations)
+  {
+    kvp.second.program.destroy();
+    kvp.second.uniforms.clear();
+    kvp.second.uniform_indices.clear();
+    kvp.second.pending = kvp.second.failed = false;
+  }
+
+  _programPermutation = 0;
+  _numPending = 0;
+  set_dirty();
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void compiled_program::sync_macros()
+{
+  if (_macrosPermutation == _permutation)
+    return;
+
+  _macros = _permutations.find(_permutation)->second.macros;
+  _macrosPermutation = _permutation;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void compiled_program::swap_program(permutation_entry &entry)
+{
+  std::swap(_program, entry.program);
+  _uniforms.swap(entry.uniforms);
+  _uniformIndices.swap(entry.uniform_indices);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool compiled_program::activate_permutation()
+{
+  if (_programPermutation != _permutation)
+  {
+    // park the current program, its entry always exists once linked
+    if (_programPermutation && _program.id)
+    {
+      auto &parked = _permutations[_programPermutation];
+      swap_program(parked);
+      parked.last_use = ++_permutationClock;
+    }
+
+    _programPermutation = 0;
+  }
+
+  // for the same macro set only a finished asynchronous rebuild replaces the program, otherwise it gets rebuilt
+  auto iter = _permutations.find(_permutation);
+  if (iter == _permutations.end() || !iter->second.program.id || iter->second.pending)
+    return false;
+
+  _program.destroy();
+  swap_program(iter->second);
+  iter->second.last_use = ++_permutationClock;
+  _programPermutation = _permutation;
+  ++_generation;
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void compiled_program::finish_permutation()
+{
+  auto result = _permutations.emplace(_permutation, permutation_entry());
+  if (result.second) result.first->second.macros = macros();
+
+  result.first->second.last_use = ++_permutationClock;
+  _programPermutation = _permutation;
+  evict_permutations();
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void compiled_program::evict_permutations()
+{
+  while (num_resident_permutations() > _maxPermutations)
+  {
+    permutation_entry *oldest = nullptr;
+    for (auto &&kvp : _permutations)
+      if (kvp.second.program.id && !kvp.second.pending && (!oldest || kvp.second.last_use < oldest->last_use))
+        oldest = &kvp.second;
+
+    if (!oldest)
+      break;
+
+    oldest->program.destroy();
+    oldest->uniforms.clear();
+    oldest->uniform_indices.clear();
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool compiled_program::pending() const
+{
+  if (!_dirty || !_numPending)
+    return false;
+
+  auto iter = _permutations.find(_permutation);
+  return iter != _permutations.end() && iter->second.pending;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool compiled_program::bind()
+{
+  if (_numPending)
+    poll_permutations();
+
+  if (dirty() && !activate_permutation())
+  {
+    auto result = _permutations.emplace(_permutation, permutation_entry());
+    auto &entry = result.first->second;
+    if (result.second) entry.macros = macros();
+
+    if (entry.pending)
+      return bind_placeholder();
+
+    // not linked again until the sources change, and a program left from other sources must not stand in for it
+    if (entry.failed)
+    {
+      if (_programPermutation != _permutation && _program.id)
+      {
+        _program.destroy();
+        reflect_uniforms();
+      }
+
+      return bind_placeholder();
+    }
+
+    std::string macroString = get_macro_string();
+    bool useCache = program_cache.enabled();
+    uint64_t cacheKey = useCache ? make_cache_key(macroString) : 0;
+
+    if (!useCache || !program_cache.load(cacheKey, _program))
+    {
+      if (_async)
+      {
+        entry.program.id = submit_program(0, macroString, useCache);
+        entry.pending = true;
+        entry.submit_frame = gl_state.frame_index();
+        entry.cache_key = cacheKey;
+        ++_numPending;
+        return bind_placeholder();
+      }
+
+      _program.id = submit_program(_program.id, macroString, useCache);
+
+      GLint status; gl.GetProgramiv(_program.id, gl.LINK_STATUS, &status);
+      if (status == GL_FALSE)
+        _program.destroy();
+      else if (useCache)
+        program_cache.store(cacheKey, _program);
+    }
+
+    reflect_uniforms();
+    finish_permutation();
+  }
+
+  set_dirty(false);
+  gl_state.use_program(_program.id);
+  return _program.id != 0;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+GLuint compiled_program::submit_program(GLuint program, const std::string &macroString, bool retrievable) const
+{
+  std::vector<stage> stages;
+  get_stages(stages);
+
+  if (!program) program = gl.CreateProgram();
+
+  std::vector<GLuint> shaders;
+  for (auto &&st : stages)
+  {
+    if (st.source->empty())
+      continue;
+
+    std::string source = macroString + *st.source;
+    auto srcPtr = source.c_str();
+    GLuint shader = gl.CreateShader(st.type);
+    gl.ShaderSource(shader, 1, &srcPtr, nullptr);
+    gl.CompileShader(shader);
+    gl.AttachShader(program, shader);
+    shaders.push_back(shader);
+  }
+
+  if (retrievable && gl.ProgramParameteri) gl.ProgramParameteri(program, gl.PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  gl.LinkProgram(program);
+
+  // the linked program does not depend on the shader objects anymore
+  for (auto shader : shaders)
+  {
+    gl.DetachShader(program, shader);
+    gl.DeleteShader(shader);
+  }
+
+  return program;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+uint64_t compiled_program::make_cache_key(const std::string &macroString) const
+{
+  std::vector<stage> stages;
+  get_stages(stages);
+
+  std::vector<const std::string *> sources;
+  for (auto &&st : stages) sources.push_back(st.source);
+  return program_cache.make_key(_glslVersion, macroString, sources);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool compiled_program::bind_placeholder()
+{
+  if (_placeholder) _placeholder->bind();
+  else gl_state.use_program(0);
+  return false;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void compiled_program::poll_permutations()
+{
+  bool completed = false;
+
+  for (auto &&kvp : _permutations)
+  {
+    auto &entry = kvp.second;
+    if (!entry.pending)
+      continue;
+
+    if (gl.parallel_shader_compile)
+    {
+      GLint done = GL_FALSE;
+      gl.GetProgramiv(entry.program.id, gl.COMPLETION_STATUS, &done);
+      if (done == GL_FALSE) continue;
+    }
+    else if (gl_state.frame_index() == entry.submit_frame)
+      continue;
+
+    entry.pending = false;
+    --_numPending;
+
+    GLint status; gl.GetProgramiv(entry.program.id, gl.LINK_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+      entry.program.destroy();
+      entry.failed = true;
+      continue;
+    }
+
+    if (entry.cache_key)
+      program_cache.store(entry.cache_key, entry.program);
+
+    // the finished program is parked, bind() swaps it in once selected
+    swap_program(entry);
+    reflect_uniforms();
+    swap_program(entry);
+    entry.last_use = ++_permutationClock;
+    completed = true;
+  }
+
+  if (completed)
+    evict_permutations();
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void compiled_program::reflect_uniforms()
+{
+  _uniforms.clear();
+  _uniformIndices.clear();
+  ++_generation;
+
+  if (!_program.id)
+    return;
+
+  GLint numUniforms = 0, maxLength = 0;
+  gl.GetProgramiv(_program.id, gl.ACTIVE_UNIFORMS, &numUniforms);
+  gl.GetProgramiv(_program.id, gl.ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+  std::vector<char> name(maxLength + 1);
+  int numTextureUnits = 0;
+
+  for (GLint i = 0; i < numUniforms; ++i)
+  {
+    uniform_info u;
+    GLsizei length = 0;
+    gl.GetActiveUniform(_program.id, i, static_cast<GLsizei>(name.size()), &length, &u.size, &u.type, name.data());
+    u.name.assign(name.data(), length);
+
+    if (u.name.size() > 3 && !u.name.compare(u.name.size() - 3, 3, "[0]"))
+      u.name.resize(u.name.size() - 3);
+
+    // members of uniform blocks have no location
+    u.location = gl.GetUniformLocation(_program.id, u.name.c_str());
+    if (u.location < 0)
+      continue;
+
+    if (is_sampler_type(u.type))
+    {
+      u.texture_unit = numTextureUnits;
+      numTextureUnits += u.size;
+    }
+
+    _uniformIndices[hash_string(u.name.c_str())] = static_cast<int>(_uniforms.size());
+    _uniforms.push_back(u);
+
+    // array elements get entries of their own at consecutive locations, so they can be set by name and cached apart
+    for (GLint element = 1; element < u.size; ++element)
+    {
+      uniform_info e = u;
+      e.name = u.name + "[" + std::to_string(element) + "]";
+      e.location = u.location + element;
+      e.size = u.size - element;
+      if (e.texture_unit >= 0) e.texture_unit += element;
+      _uniformIndices[hash_string(e.name.c_str())] = static_cast<int>(_uniforms.size());
+      _uniforms.push_back(e);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void buffer::invalidate(size_t offset, size_t size)
+{
+  set_dirty();
+  if (!size) return;
+
+  size_t begin = offset, end = offset + size;
+
+  // first range that ends at or after the new one begins, everything from there that touches it gets merged
+  auto it = std::lower_bound(_dirtyRanges.begin(), _dirtyRanges.end(), begin,
+    [](const std::pair<size_t, size_t> &r, size_t value) { return r.second < value; });
+
+  auto last = it;
+  while (last != _dirtyRanges.end() && last->first <= end)
+  {
+    begin = minimum(begin, last->first);
+    end = maximum(end, last->second);
+    ++last;
+  }
+
+  it = _dirtyRanges.erase(it, last);
+  _dirtyRanges.insert(it, std::make_pair(begin, end));
+
+  // too many small uploads cost more than a single bigger one
+  if (_dirtyRanges.size() > max_dirty_ranges)
+  {
+    auto merged = std::make_pair(_dirtyRanges.front().first, _dirtyRanges.back().second);
+    _dirtyRanges.clear();
+    _dirtyRanges.push_back(merged);
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool buffer::bind(GLenum type)
+{
+  if (dirty())
+  {
+    if (!_buffer.id) gl.GenBuffers(1, &_buffer.id);
+    gl_state.bind_buffer(type, _buffer.id);
+
+    if (_size > _capacity)
+    {
+      // grow geometrically, so a buffer that keeps growing does not get reallocated every time
+      _capacity = _capacity ? maximum(_size, _capacity * 2) : _size;
+      gl.BufferData(type, _capacity, (_capacity == _size) ? _data : nullptr, gl.DYNAMIC_DRAW);
+      if (_capacity != _size && _data) gl.BufferSubData(type, 0, _size, _data);
+    }
+    else if (_fullUpload)
+    {
+      // orphan the old storage instead of waiting for the GPU to finish with it
+      gl.BufferData(type, _capacity, nullptr, gl.DYNAMIC_DRAW);
+      if (_size && _data) gl.BufferSubData(type, 0, _size, _data);
+    }
+    else if (_data)
+    {
+      for (auto &&r : _dirtyRanges)
+        if (r.first < _size)
+          gl.BufferSubData(type, r.first, minimum(r.second, _size) - r.first, _data + r.first);
+    }
+
+    _fullUpload = false;
+    _dirtyRanges.clear();
+
+    if (_owner && !_keepData && _data) { delete [] _data; _data = nullptr; }
+    set_dirty(false);
+  }
+  else
+    gl_state.bind_buffer(type, _buffer.id);
+
+  return _buffer.id > 0;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void buffer::unbind(GLenum type)
+{
+  gl_state.bind_buffer(type, 0);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool buffer::bind_base(GLenum type, GLuint index, size_t offset, size_t size)
+{
+  if (!gl.BindBufferBase || !bind(type))
+    return false;
+
+  // also binds the generic target to the same buffer, so the state cache stays valid
+  if (size)
+    gl.BindBufferRange(type, index, _buffer.id, offset, size);
+  else
+    gl.BindBufferBase(type, index, _buffer.id);
+
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool buffer::read_data(void *ptr, size_t offset, size_t size)
+{
+  if (!gl.GetBufferSubData || offset + size > _capacity || !bind(gl.COPY_READ_BUFFER))
+    return false;
+
+  gl.GetBufferSubData(gl.COPY_READ_BUFFER, offset, size, ptr);
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool stream_buffer::create()
+{
+  size_t size = _regionSize * num_regions;
+
+  gl.GenBuffers(1, &_buffer.id);
+  gl_state.bind_buffer(_target, _buffer.id);
+
+  _persistent = gl.BufferStorage != nullptr;
+  if (_persistent)
+  {
+    GLbitfield flags = gl.MAP_WRITE_BIT | gl.MAP_PERSISTENT_BIT | gl.MAP_COHERENT_BIT;
+    gl.BufferStorage(_target, size, nullptr, flags);
+    _persistentData = static_cast<uint8_t *>(gl.MapBufferRange(_target, 0, size, flags));
+  }
+  else
+    gl.BufferData(_target, size, nullptr, gl.STREAM_DRAW);
+
+  return _buffer.id > 0 && (!_persistent || _persistentData);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void stream_buffer::destroy()
+{
+  delete_fences();
+
+  // deleting the buffer also unmaps it
+  _buffer.destroy();
+  _persistentData = _mapped = nullptr;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void stream_buffer::delete_fences()
+{
+  for (auto &&f : _fences)
+  {
+    if (f) gl.DeleteSync(f);
+    f = nullptr;
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+uint8_t *stream_buffer::map(size_t size, size_t keep)
+{
+  if (!_buffer.id && !create())
+    return nullptr;
+
+  if (size > _regionSize)
+  {
+    unmap();
+
+    // the already written part of the region is copied on the GPU, the mapping is never read back
+    gl_resource_buffer old = _buffer;
+    size_t oldOffset = offset();
+
+    delete_fences();
+    _buffer.id = 0;
+    _persistentData = nullptr;
+    _region = 0;
+    _regionSize = align(maximum(size, _regionSize * 2));
+
+    bool created = create();
+    if (created && keep)
+    {
+      gl_state.bind_buffer(gl.COPY_READ_BUFFER, old.id);
+      gl_state.bind_buffer(gl.COPY_WRITE_BUFFER, _buffer.id);
+      gl.CopyBufferSubData(gl.COPY_READ_BUFFER, gl.COPY_WRITE_BUFFER, oldOffset, 0, keep);
+    }
+
+    old.destroy();
+    if (!created)
+      return nullptr;
+  }
+
+  if (_persistent)
+    return _persistentData + offset();
+
+  if (!_mapped)
+  {
+    // the fence of this region was already waited for, the GPU does not read it anymore
+    GLbitfield flags = gl.MAP_WRITE_BIT | gl.MAP_UNSYNCHRONIZED_BIT | (keep ? 0 : gl.MAP_INVALIDATE_RANGE_BIT);
+    gl_state.bind_buffer(_target, _buffer.id);
+    _mapped = static_cast<uint8_t *>(gl.MapBufferRange(_target, offset(), _regionSize, flags));
+  }
+
+  return _mapped;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void stream_buffer::unmap()
+{
+  if (!_mapped)
+    return;
+
+  gl_state.bind_buffer(_target, _buffer.id);
+  gl.UnmapBuffer(_target);
+  _mapped = nullptr;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void stream_buffer::next_region()
+{
+  if (!_buffer.id)
+    return;
+
+  unmap();
+
+  if (_fences[_region]) gl.DeleteSync(_fences[_region]);
+  _fences[_region] = gl.FenceSync(gl.SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+  _region = (_region + 1) % num_regions;
+  if (!_fences[_region])
+    return;
+
+  // flush on the first wait, otherwise the fence might never get to the GPU
+  GLbitfield flags = gl.SYNC_FLUSH_COMMANDS_BIT;
+  while (gl.ClientWaitSync(_fences[_region], flags, 1000000) == gl.TIMEOUT_EXPIRED)
+    flags = 0;
+
+  gl.DeleteSync(_fences[_region]);
+  _fences[_region] = nullptr;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool base_geometry::bind()
+{
+  if (!_vertexBuffer || !_vao.id)
+    return false;
+
+  _vertexBuffer->bind(gl.ARRAY_BUFFER);
+  gl_state.bind_vertex_array(_vao);
+
+  if (_indexBuffer)
+    _indexBuffer->bind(gl.ELEMENT_ARRAY_BUFFER);
+  
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void base_geometry::unbind()
+{
+  if (_vertexBuffer)
+    _vertexBuffer->unbind(gl.ARRAY_BUFFER);
+  
+  gl_state.bind_vertex_array(0);
+
+  if (_indexBuffer)
+    _indexBuffer->unbind(gl.ELEMENT_ARRAY_BUFFER);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+size_t base_geometry_pool::alloc_mesh(size_t numVertices, const uint32_t *indices, size_t numIndices)
+{
+  if (!numVertices || (indexed() && (!indices || !numIndices)))
+    return invalid_mesh;
+
+  mesh_range m;
+  m.firstVertex = alloc_range(_freeVertices, _vertexEnd, numVertices);
+  m.numVertices = numVertices;
+
+  if (indexed())
+  {
+    m.firstIndex = alloc_range(_freeIndices, _indexEnd, numIndices);
+    m.numIndices = numIndices;
+
+    if (_indices.size() < _indexEnd)
+      _indices.resize(_indexEnd);
+
+    std::copy(indices, indices + numIndices, _indices.begin() + m.firstIndex);
+    _indexBuffer->invalidate(m.firstIndex * sizeof(uint32_t), numIndices * sizeof(uint32_t));
+  }
+
+  size_t id = _meshes.size();
+  if (_freeMeshes.empty())
+    _meshes.push_back(m);
+  else
+  {
+    id = _freeMeshes.back();
+    _freeMeshes.pop_back();
+    _meshes[id] = m;
+  }
+
+  set_dirty();
+  return id;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void base_geometry_pool::remove_mesh(size_t mesh)
+{
+  if (!valid(mesh))
+    return;
+
+  auto &m = _meshes[mesh];
+  free_range(_freeVertices, _vertexEnd, m.firstVertex, m.numVertices);
+  if (m.numIndices) free_range(_freeIndices, _indexEnd, m.firstIndex, m.numIndices);
+
+  m = mesh_range();
+  _freeMeshes.push_back(mesh);
+  set_dirty();
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void base_geometry_pool::clear()
+{
+  _meshes.clear();
+  _freeMeshes.clear();
+  _freeVertices.clear();
+  _freeIndices.clear();
+  _vertexEnd = _indexEnd = 0;
+  set_dirty();
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+size_t base_geometry_pool::alloc_range(free_list &freeRanges, size_t &end, size_t count)
+{
+  // first fit, the used part only grows when no hole is large enough
+  for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it)
+  {
+    if (it->second - it->first < count)
+      continue;
+
+    size_t first = it->first;
+    it->first += count;
+    if (it->first == it->second) freeRanges.erase(it);
+    return first;
+  }
+
+  size_t first = end;
+  end += count;
+  return first;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void base_geometry_pool::free_range(free_list &freeRanges, size_t &end, size_t first, size_t count)
+{
+  auto it = std::lower_bound(freeRanges.begin(), freeRanges.end(), std::make_pair(first, first));
+  it = freeRanges.insert(it, { first, first + count });
+
+  // merge with adjacent holes
+  if (it + 1 != freeRanges.end() && (it + 1)->first == it->second)
+  {
+    it->second = (it + 1)->second;
+    freeRanges.erase(it + 1);
+  }
+
+  if (it != freeRanges.begin() && (it - 1)->second == it->first)
+  {
+    (it - 1)->second = it->second;
+    it = freeRanges.erase(it) - 1;
+  }
+
+  // a hole at the end just shrinks the used part
+  if (it->second == end)
+  {
+    end = it->first;
+    freeRanges.erase(it);
+  }
+}
+
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool program_binary_cache::enabled() const
+{
+  if (_directory.empty() || !gl.ProgramParameteri || !gl.GetProgramBinary || !gl.ProgramBinary)
+    return false;
+
+  GLint numFormats = 0;
+  glGetIntegerv(gl.NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+  return numFormats > 0;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+uint64_t program_binary_cache::make_key(const std::string &glslVersion, const std::string &macroString,
+  const std::vector<const std::string *> &sources) const
+{
+  // binaries are only valid for the driver that produced them
+  uint64_t hash = detail::hash_string("gl3d-program-binary");
+  for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+  {
+    auto str = reinterpret_cast<const char *>(glGetString(name));
+    hash = detail::hash_string("\x1e", detail::hash_string(str ? str : "", hash));
+  }
+
+  hash = detail::hash_string("\x1e", detail::hash_string(glslVersion.c_str(), hash));
+  hash = detail::hash_string("\x1e", detail::hash_string(macroString.c_str(), hash));
+
+  // empty stages are separated too, so moving code between stages changes the key
+  for (auto &&src : sources)
+    hash = detail::hash_string("\x1e", detail::hash_string(src->c_str(), hash));
+
+  return hash;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+std::string program_binary_cache::file_name(uint64_t key) const
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+
+  char last = _directory.back();
+  return (last == '/' || last == '\\') ? _directory + name : _directory + "/" + name;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool program_binary_cache::load(uint64_t key, detail::gl_resource_program &program)
+{
+  auto startTime = std::chrono::steady_clock::now();
+
+  FILE *f = fopen(file_name(key).c_str(), "rb");
+  if (!f)
+  {
+    ++_stats.misses;
+    return false;
+  }
+
+  file_header header;
+  std::vector<uint8_t> data;
+  bool valid = fread(&header, sizeof(header), 1, f) == 1
+    && header.magic == file_magic && header.version == file_version && header.key == key && header.length > 0;
+
+  // the length of a truncated or corrupted file is not allocated before it is checked against the file size
+  if (valid)
+  {
+    long start = ftell(f);
+    valid = start >= 0 && !fseek(f, 0, SEEK_END) && ftell(f) - start == static_cast<long>(header.length)
+      && !fseek(f, start, SEEK_SET);
+  }
+
+  if (valid)
+  {
+    data.resize(header.length);
+    valid = fread(data.data(), 1, data.size(), f) == data.size();
+  }
+
+  fclose(f);
+
+  GLint status = GL_FALSE;
+  if (valid)
+  {
+    if (!program.id) program.id = gl.CreateProgram();
+    gl.ProgramBinary(program.id, header.format, data.data(), static_cast<GLsizei>(data.size()));
+    gl.GetProgramiv(program.id, gl.LINK_STATUS, &status);
+  }
+
+  // the driver may refuse binaries after an update, the entry gets replaced once compiled again
+  if (status == GL_FALSE)
+  {
+    ++_stats.misses;
+    ++_stats.rejected;
+    return false;
+  }
+
+  ++_stats.hits;
+  _stats.load_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool program_binary_cache::store(uint64_t key, const detail::gl_resource_program &program)
+{
+  if (!program.id)
+    return false;
+
+  GLint length = 0;
+  gl.GetProgramiv(program.id, gl.PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return false;
+
+  file_header header = { file_magic, file_version, key, 0, 0 };
+  std::vector<uint8_t> data(length);
+  GLenum format = GL_NONE;
+  GLsizei written = 0;
+  gl.GetProgramBinary(program.id, length, &written, &format, data.data());
+  if (written <= 0)
+    return false;
+
+  header.format = format;
+  header.length = static_cast<uint32_t>(written);
+
+  // write to a temporary file first, so a crash never leaves a truncated entry behind
+  std::string fileName = file_name(key);
+  std::string tempName = fileName + ".tmp";
+  FILE *f = fopen(tempName.c_str(), "wb");
+  if (!f)
+    return false;
+
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+    && fwrite(data.data(), 1, written, f) == static_cast<size_t>(written);
+  ok = (fclose(f) == 0) && ok;
+
+  remove(fileName.c_str());
+  if (!ok || rename(tempName.c_str(), fileName.c_str()) != 0)
+  {
+    remove(tempName.c_str());
+    return false;
+  }
+
+  ++_stats.stores;
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool compute::dispatch(int numGroupsX, int numGroupsY, int numGroupsZ)
+{
+  if (!gl.DispatchCompute || !bind())
+    return false;
+
+  gl.DispatchCompute(numGroupsX, numGroupsY, numGroupsZ);
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool compute::dispatch_indirect(detail::buffer *args, size_t offset)
+{
+  if (!gl.DispatchComputeIndirect || !args || !bind() || !args->bind(gl.DISPATCH_INDIRECT_BUFFER))
+    return false;
+
+  gl.DispatchComputeIndirect(offset);
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+ivec3 compute::work_group_size() const
+{
+  GLint size[3] = { 0, 0, 0 };
+  if (_program.id) gl.GetProgramiv(_program.id, gl.COMPUTE_WORK_GROUP_SIZE, size);
+  return ivec3(size[0], size[1], size[2]);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void texture::update_parts()
+{
+  set_dirty();
+  _storageValid = false;
+  _parts.clear();
+  _sizeBytes = 0;
+  size_t numMips = size_mip_levels(true);
+  auto desc = detail::gl_format_descriptor::get(_format);
+  for (size_t i = 0; i < _sizeLayers; ++i)
+  {
+    for (size_t mip = 0; mip < numMips && i < mip_layers(mip); ++mip)
+    {
+      part p;
+      p.layer_index = i;
+      p.mip_level = mip;
+      p.size = size(mip);
+      p.offset = _sizeBytes;
+      p.row_stride = desc.row_size(p.size.x);
+      _sizeBytes += p.length = desc.image_size(p.size.x, p.size.y);
+      _parts.push_back(p);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void texture::set_params(int width, int height, GLenum format, size_t sizeLayers, size_t sizeMipLevels)
+{
+  if (_size.x != width || _size.y != height || _format != format || _sizeLayers != sizeLayers || _sizeMipLevels != sizeMipLevels)
+  {
+    _file = nullptr;
+    if (_type == GL_TEXTURE_1D || _type == GL_TEXTURE_2D) sizeLayers = 1;
+    else if (_type == gl.TEXTURE_CUBE_MAP) sizeLayers = 6;
+    _size = ivec2(width, height); _format = format; _sizeLayers = sizeLayers; _sizeMipLevels = sizeMipLevels;
+    update_parts();
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+size_t texture::size_mip_levels(bool calculate) const
+{
+  if (calculate && _sizeMipLevels == 0)
+  {
+    size_t num = 1;
+    while (true) { ivec2 s = size(num - 1); if (s.x == 1 && s.y == 1) break; ++num; }
+    return num;
+  }
+
+  return _sizeMipLevels;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool texture::format_supported(GLenum format)
+{
+  auto desc = detail::gl_format_descriptor::get(format);
+  if (!desc.compressed())
+    return desc.block_size != 0;
+
+  switch (format)
+  {
+    case detail::gl_api::COMPRESSED_RED_RGTC1:
+    case detail::gl_api::COMPRESSED_SIGNED_RED_RGTC1:
+    case detail::gl_api::COMPRESSED_RG_RGTC2:
+    case detail::gl_api::COMPRESSED_SIGNED_RG_RGTC2:
+      return true;
+
+    case detail::gl_api::COMPRESSED_RGB_S3TC_DXT1:
+    case detail::gl_api::COMPRESSED_RGBA_S3TC_DXT1:
+    case detail::gl_api::COMPRESSED_RGBA_S3TC_DXT3:
+    case detail::gl_api::COMPRESSED_RGBA_S3TC_DXT5:
+    case detail::gl_api::COMPRESSED_SRGB_S3TC_DXT1:
+    case detail::gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT1:
+    case detail::gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT3:
+    case detail::gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT5:
+      return gl.texture_compression_s3tc;
+
+    case detail::gl_api::COMPRESSED_RGBA_BPTC_UNORM:
+    case detail::gl_api::COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+    case detail::gl_api::COMPRESSED_RGB_BPTC_SIGNED_FLOAT:
+    case detail::gl_api::COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT:
+      return gl.texture_compression_bptc;
+
+    default:
+      // the remaining formats are ASTC and ETC2/EAC
+      return (format >= gl.COMPRESSED_R11_EAC && format <= gl.COMPRESSED_SRGB8_ALPHA8_ETC2_EAC) ?
+        gl.texture_compression_etc2 : gl.texture_compression_astc;
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool texture::bind(int slot)
+{
+  if (dirty())
+  {
+    // storage of another size or format gets a new texture object, immutable storage cannot be reallocated
+    if (!_storageValid) _texture.destroy();
+
+    bool allocate = !_texture.id;
+    if (allocate) glGenTextures(1, &_texture.id);
+    gl_state.bind_texture(slot, _type, _texture.id);
+
+    if (allocate)
+    {
+      gl_state.bind_buffer(gl.PIXEL_UNPACK_BUFFER, 0);
+      alloc_storage();
+      _storageValid = true;
+    }
+
+    // without pixels the storage stays uninitialized, e.g. for textures written by compute shaders. Loaded files are
+    // uploaded from their mapping, no unpack buffer must be bound then.
+    if (_pbo->dirty())
+    {
+      auto filePixels = _file ? _file->data() : nullptr;
+      if (filePixels || (_sizeBytes && _pbo->size() >= _sizeBytes))
+      {
+        if (filePixels) gl_state.bind_buffer(gl.PIXEL_UNPACK_BUFFER, 0);
+        else _pbo->bind(gl.PIXEL_UNPACK_BUFFER);
+
+        for (auto &&p : _parts)
+          upload_part(p, filePixels ? filePixels + p.offset : reinterpret_cast<const GLvoid *>(p.offset));
+
+        if (!filePixels) _pbo->unbind(gl.PIXEL_UNPACK_BUFFER);
+      }
+
+      _pbo->set_dirty(false);
+      drop_file();
+    }
+
+    glTexParameteri(_type, GL_TEXTURE_MIN_FILTER, _minFilter);
+    glTexParameteri(_type, GL_TEXTURE_MAG_FILTER, _magFilter);
+    glTexParameteri(_type, GL_TEXTURE_WRAP_S, _wrap);
+    glTexParameteri(_type, GL_TEXTURE_WRAP_T, _wrap);
+    glTexParameteri(_type, gl.TEXTURE_WRAP_R, _wrap);
+    glTexParameteri(_type, gl.TEXTURE_BASE_LEVEL, static_cast<GLint>(_baseMipLevel));
+    glTexParameteri(_type, gl.TEXTURE_MAX_LEVEL, static_cast<GLint>(size_mip_levels(true) - 1));
+    set_dirty(false);
+  }
+  else
+    gl_state.bind_texture(slot, _type, _texture.id);
+
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void texture::alloc_storage()
+{
+  auto desc = detail::gl_format_descriptor::get(_format);
+  auto numMips = static_cast<GLsizei>(size_mip_levels(true));
+  auto base = size(0);
+  bool layered = _type == gl.TEXTURE_2D_ARRAY || _type == gl.TEXTURE_CUBE_MAP_ARRAY || _type == gl.TEXTURE_3D;
+
+  // immutable storage is validated once instead of on every draw
+  if (gl.TexStorage2D && gl.TexStorage3D && _type != GL_TEXTURE_1D)
+  {
+    if (layered)
+      gl.TexStorage3D(_type, numMips, desc.layout, base.x, base.y, static_cast<GLsizei>(_sizeLayers));
+    else
+      gl.TexStorage2D(_type, numMips, desc.layout, base.x, base.y);
+
+    return;
+  }
+
+  for (GLint mip = 0; mip < numMips; ++mip)
+  {
+    auto s = size(static_cast<size_t>(mip));
+    auto layers = static_cast<GLsizei>(mip_layers(static_cast<size_t>(mip)));
+    auto length = static_cast<GLsizei>(desc.image_size(s.x, s.y));
+
+    if (_type == GL_TEXTURE_1D)
+      glTexImage1D(_type, mip, desc.layout, s.x, 0, _format, desc.element_format, nullptr);
+    else if (layered && desc.compressed())
+      gl.CompressedTexImage3D(_type, mip, desc.layout, s.x, s.y, layers, 0, length * layers, nullptr);
+    else if (layered)
+      gl.TexImage3D(_type, mip, desc.layout, s.x, s.y, layers, 0, _format, desc.element_format, nullptr);
+    else
+    {
+      // cubemap faces are allocated one by one
+      bool cube = _type == gl.TEXTURE_CUBE_MAP;
+      for (GLenum face = 0; face < (cube ? 6u : 1u); ++face)
+      {
+        GLenum target = cube ? gl.TEXTURE_CUBE_MAP_POSITIVE_X + face : _type;
+        if (desc.compressed())
+          gl.CompressedTexImage2D(target, mip, desc.layout, s.x, s.y, 0, length, nullptr);
+        else
+          glTexImage2D(target, mip, desc.layout, s.x, s.y, 0, _format, desc.element_format, nullptr);
+      }
+    }
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool texture::upload_part(const part &p, const GLvoid *pixels)
+{
+  auto desc = detail::gl_format_descriptor::get(_format);
+  auto mip = static_cast<GLint>(p.mip_level);
+  auto layer = static_cast<GLint>(p.layer_index);
+  auto length = static_cast<GLsizei>(p.length);
+
+  if (_type == GL_TEXTURE_1D)
+  {
+    if (desc.compressed()) return false;
+    glTexSubImage1D(_type, mip, 0, p.size.x, _format, desc.element_format, pixels);
+  }
+  else if (_type == gl.TEXTURE_2D_ARRAY || _type == gl.TEXTURE_CUBE_MAP_ARRAY || _type == gl.TEXTURE_3D)
+  {
+    // a layer, a face of a cube array or a slice of a 3D texture
+    if (desc.compressed())
+      gl.CompressedTexSubImage3D(_type, mip, 0, 0, layer, p.size.x, p.size.y, 1, desc.layout, length, pixels);
+    else
+      gl.TexSubImage3D(_type, mip, 0, 0, layer, p.size.x, p.size.y, 1, _format, desc.element_format, pixels);
+  }
+  else
+  {
+    GLenum target = (_type == gl.TEXTURE_CUBE_MAP) ? gl.TEXTURE_CUBE_MAP_POSITIVE_X + static_cast<GLenum>(layer) : _type;
+    if (desc.compressed())
+      gl.CompressedTexSubImage2D(target, mip, 0, 0, p.size.x, p.size.y, desc.layout, length, pixels);
+    else
+      glTexSubImage2D(target, mip, 0, 0, p.size.x, p.size.y, _format, desc.element_format, pixels);
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool texture::bind_image(GLuint unit, GLenum access, size_t mipLevel)
+{
+  // uploads pending changes on a unit context3d does not use, so its texture on unit 0 stays bound
+  if (!gl.BindImageTexture || !bind(detail::gl_state_cache::max_texture_units - 1))
+    return false;
+
+  bool layered = _type != GL_TEXTURE_1D && _type != GL_TEXTURE_2D;
+  GLenum format = detail::gl_format_descriptor::get(_format).layout;
+  gl.BindImageTexture(unit, _texture.id, static_cast<GLint>(mipLevel), layered ? GL_TRUE : GL_FALSE, 0,
+    (access != GL_NONE) ? access : gl.READ_WRITE, format);
+
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void texture::set_filter(GLenum minFilter, GLenum magFilter)
+{
+  if (minFilter != _minFilter || magFilter != _magFilter) 
+  {
+    _minFilter = minFilter; _magFilter = magFilter;
+    set_dirty();
+  }
+}
+
+namespace detail
+{
+
+//------------------------------------------------------------------------------------------------------------------------
+bool mapped_file::open(const char *path)
+{
+  close();
+
+#if defined(WIN32)
+  _file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  LARGE_INTEGER size;
+  if (_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(_file, &size) || !size.QuadPart)
+  {
+    close();
+    return false;
+  }
+
+  _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  _data = _mapping ? static_cast<const uint8_t *>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+  _size = static_cast<size_t>(size.QuadPart);
+#else
+  int fd = ::open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0)
+  {
+    if (fd >= 0) ::close(fd);
+    return false;
+  }
+
+  // the mapping keeps the file referenced, the descriptor is not needed anymore
+  void *data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  _data = (data != MAP_FAILED) ? static_cast<const uint8_t *>(data) : nullptr;
+  _size = static_cast<size_t>(st.st_size);
+#endif
+
+  if (!_data)
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void mapped_file::close()
+{
+#if defined(WIN32)
+  if (_data) UnmapViewOfFile(_data);
+  if (_mapping) CloseHandle(_mapping);
+  if (_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+  _mapping = nullptr;
+  _file = INVALID_HANDLE_VALUE;
+#else
+  if (_data) munmap(const_cast<uint8_t *>(_data), _size);
+#endif
+
+  _data = nullptr;
+  _size = 0;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+// Parts of a texture file, offsets are relative to the start of the file
+struct texture_file_layout
+{
+  GLenum type = GL_TEXTURE_2D;
+  GLenum format = GL_NONE;
+  ivec2 size;
+  size_t layers = 1;
+  size_t mip_levels = 1;
+  size_t file_size = 0;
+  std::vector<texture::part> parts;
+
+  // Returns the offset past the part, 0 when it does not fit into the file
+  size_t add_part(size_t layer, size_t mip, size_t offset)
+  {
+    auto desc = gl_format_descriptor::get(format);
+    texture::part p;
+    p.layer_index = layer;
+    p.mip_level = mip;
+    p.size = calculate_mip_size(size.x, size.y, mip);
+    p.offset = offset;
+    p.row_stride = desc.row_size(p.size.x);
+    p.length = desc.image_size(p.size.x, p.size.y);
+    if (offset > file_size || p.length > file_size - offset) return 0;
+
+    parts.push_back(p);
+    return offset + p.length;
+  }
+};
+
+inline uint32_t read_u32(const uint8_t *data) { uint32_t v; memcpy(&v, data, sizeof(v)); return v; }
+inline uint64_t read_u64(const uint8_t *data) { uint64_t v; memcpy(&v, data, sizeof(v)); return v; }
+
+inline uint32_t make_fourcc(const char *code)
+{
+  return static_cast<uint32_t>(code[0]) | (static_cast<uint32_t>(code[1]) << 8) |
+    (static_cast<uint32_t>(code[2]) << 16) | (static_cast<uint32_t>(code[3]) << 24);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+GLenum texture_format_from_vk(uint32_t vkFormat)
+{
+  // block compressed formats come in UNORM / SRGB (or SNORM) pairs
+  static const GLenum formats[] = {
+    gl_api::COMPRESSED_RGB_S3TC_DXT1, gl_api::COMPRESSED_SRGB_S3TC_DXT1,                      // 131
+    gl_api::COMPRESSED_RGBA_S3TC_DXT1, gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT1,
+    gl_api::COMPRESSED_RGBA_S3TC_DXT3, gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT3,
+    gl_api::COMPRESSED_RGBA_S3TC_DXT5, gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT5,
+    gl_api::COMPRESSED_RED_RGTC1, gl_api::COMPRESSED_SIGNED_RED_RGTC1,
+    gl_api::COMPRESSED_RG_RGTC2, gl_api::COMPRESSED_SIGNED_RG_RGTC2,
+    gl_api::COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT, gl_api::COMPRESSED_RGB_BPTC_SIGNED_FLOAT,
+    gl_api::COMPRESSED_RGBA_BPTC_UNORM, gl_api::COMPRESSED_SRGB_ALPHA_BPTC_UNORM,
+    gl_api::COMPRESSED_RGB8_ETC2, gl_api::COMPRESSED_SRGB8_ETC2,                              // 147
+    gl_api::COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2, gl_api::COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2,
+    gl_api::COMPRESSED_RGBA8_ETC2_EAC, gl_api::COMPRESSED_SRGB8_ALPHA8_ETC2_EAC,
+    gl_api::COMPRESSED_R11_EAC, gl_api::COMPRESSED_SIGNED_R11_EAC,
+    gl_api::COMPRESSED_RG11_EAC, gl_api::COMPRESSED_SIGNED_RG11_EAC };
+
+  const uint32_t firstBlockFormat = 131, firstAstcFormat = 157, lastAstcFormat = 184;
+  if (vkFormat == 37) return GL_RGBA; // VK_FORMAT_R8G8B8A8_UNORM
+  if (vkFormat >= firstBlockFormat && vkFormat < firstAstcFormat) return formats[vkFormat - firstBlockFormat];
+
+  // ASTC alternates UNORM and SRGB in the order of the GL formats
+  if (vkFormat >= firstAstcFormat && vkFormat <= lastAstcFormat)
+  {
+    uint32_t index = vkFormat - firstAstcFormat;
+    return ((index & 1) ? gl_api::COMPRESSED_SRGB8_ALPHA8_ASTC_4x4 : gl_api::COMPRESSED_RGBA_ASTC_4x4) + index / 2;
+  }
+
+  return GL_NONE;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+GLenum texture_format_from_dxgi(uint32_t dxgiFormat)
+{
+  switch (dxgiFormat)
+  {
+    case 28: return GL_RGBA; // DXGI_FORMAT_R8G8B8A8_UNORM
+    case 71: return gl_api::COMPRESSED_RGBA_S3TC_DXT1;
+    case 72: return gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT1;
+    case 74: return gl_api::COMPRESSED_RGBA_S3TC_DXT3;
+    case 75: return gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT3;
+    case 77: return gl_api::COMPRESSED_RGBA_S3TC_DXT5;
+    case 78: return gl_api::COMPRESSED_SRGB_ALPHA_S3TC_DXT5;
+    case 80: return gl_api::COMPRESSED_RED_RGTC1;
+    case 81: return gl_api::COMPRESSED_SIGNED_RED_RGTC1;
+    case 83: return gl_api::COMPRESSED_RG_RGTC2;
+    case 84: return gl_api::COMPRESSED_SIGNED_RG_RGTC2;
+    case 95: return gl_api::COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT;
+    case 96: return gl_api::COMPRESSED_RGB_BPTC_SIGNED_FLOAT;
+    case 98: return gl_api::COMPRESSED_RGBA_BPTC_UNORM;
+    case 99: return gl_api::COMPRESSED_SRGB_ALPHA_BPTC_UNORM;
+    default: return GL_NONE;
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool parse_ktx2(const uint8_t *data, texture_file_layout &layout)
+{
+  // identifier, header and index
+  const size_t headerSize = 80, levelIndexSize = 24;
+  if (layout.file_size < headerSize) return false;
+
+  uint32_t width = read_u32(data + 20), height = read_u32(data + 24), depth = read_u32(data + 28);
+  uint32_t layers = read_u32(data + 32), faces = read_u32(data + 36), levels = read_u32(data + 40);
+  uint32_t supercompression = read_u32(data + 44);
+
+  layout.format = texture_format_from_vk(read_u32(data + 12));
+  if (layout.format == GL_NONE || !width || depth || supercompression || (faces != 1 && faces != 6))
+    return false;
+
+  // 1D textures load as 2D textures of height 1, level count 0 asks for mip generation
+  layout.size = ivec2(static_cast<int>(width), static_cast<int>(maximum(height, 1u)));
+  layout.mip_levels = maximum(levels, 1u);
+  layout.layers = maximum(layers, 1u) * faces;
+  if (faces == 6) layout.type = layers ? gl_api::TEXTURE_CUBE_MAP_ARRAY : gl_api::TEXTURE_CUBE_MAP;
+  else layout.type = layers ? gl_api::TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+
+  if (layout.file_size < headerSize + layout.mip_levels * levelIndexSize)
+    return false;
+
+  // a level holds the images of all layers and faces
+  for (size_t mip = 0; mip < layout.mip_levels; ++mip)
+  {
+    auto offset = static_cast<size_t>(read_u64(data + headerSize + mip * levelIndexSize));
+    for (size_t layer = 0; layer < layout.layers; ++layer)
+      if (!(offset = layout.add_part(layer, mip, offset))) return false;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool parse_dds(const uint8_t *data, texture_file_layout &layout)
+{
+  const size_t headerSize = 128, dx10HeaderSize = 20;
+  if (layout.file_size < headerSize || read_u32(data + 4) != 124) return false;
+
+  uint32_t height = read_u32(data + 12), width = read_u32(data + 16), mips = read_u32(data + 28);
+  uint32_t pixelFlags = read_u32(data + 80), fourcc = read_u32(data + 84), bits = read_u32(data + 88);
+  uint32_t caps2 = read_u32(data + 112);
+  bool cube = (caps2 & 0x200) != 0, volume = (caps2 & 0x200000) != 0;
+  size_t layers = 1, offset = headerSize;
+
+  if (fourcc == make_fourcc("DX10"))
+  {
+    if (layout.file_size < headerSize + dx10HeaderSize) return false;
+    layout.format = texture_format_from_dxgi(read_u32(data + 128));
+    volume = read_u32(data + 132) == 4; // D3D10_RESOURCE_DIMENSION_TEXTURE3D
+    cube = (read_u32(data + 136) & 0x4) != 0;
+    layers = maximum(read_u32(data + 140), 1u);
+    offset += dx10HeaderSize;
+  }
+  else if (fourcc == make_fourcc("DXT1")) layout.format = gl_api::COMPRESSED_RGBA_S3TC_DXT1;
+  else if (fourcc == make_fourcc("DXT3")) layout.format = gl_api::COMPRESSED_RGBA_S3TC_DXT3;
+  else if (fourcc == make_fourcc("DXT5")) layout.format = gl_api::COMPRESSED_RGBA_S3TC_DXT5;
+  else if (fourcc == make_fourcc("ATI1") || fourcc == make_fourcc("BC4U")) layout.format = gl_api::COMPRESSED_RED_RGTC1;
+  else if (fourcc == make_fourcc("BC4S")) layout.format = gl_api::COMPRESSED_SIGNED_RED_RGTC1;
+  else if (fourcc == make_fourcc("ATI2") || fourcc == make_fourcc("BC5U")) layout.format = gl_api::COMPRESSED_RG_RGTC2;
+  else if (fourcc == make_fourcc("BC5S")) layout.format = gl_api::COMPRESSED_SIGNED_RG_RGTC2;
+  else if ((pixelFlags & 0x40) && bits == 32 && read_u32(data + 92) == 0xFF && read_u32(data + 96) == 0xFF00 &&
+    read_u32(data + 100) == 0xFF0000)
+    layout.format = GL_RGBA; // DDPF_RGB with bytes in RGBA order
+
+  if (layout.format == GL_NONE || !width || !height || volume)
+    return false;
+
+  layout.size = ivec2(static_cast<int>(width), static_cast<int>(height));
+  layout.mip_levels = maximum(mips, 1u);
+  layout.layers = layers * (cube ? 6 : 1);
+  if (cube) layout.type = (layers > 1) ? gl_api::TEXTURE_CUBE_MAP_ARRAY : gl_api::TEXTURE_CUBE_MAP;
+  else layout.type = (layers > 1) ? gl_api::TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+
+  // every layer and face holds its whole mip chain
+  for (size_t layer = 0; layer < layout.layers; ++layer)
+    for (size_t mip = 0; mip < layout.mip_levels; ++mip)
+      if (!(offset = layout.add_part(layer, mip, offset))) return false;
+
+  return true;
+}
+
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool texture::load(const char *path)
+{
+  static const uint8_t ktx2Identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+  detail::ptr<detail::mapped_file> file = new detail::mapped_file();
+  if (!file->open(path))
+    return false;
+
+  detail::texture_file_layout layout;
+  layout.file_size = file->size();
+  bool valid = false;
+  if (file->size() >= sizeof(ktx2Identifier) && !memcmp(file->data(), ktx2Identifier, sizeof(ktx2Identifier)))
+    valid = detail::parse_ktx2(file->data(), layout);
+  else if (file->size() >= 4 && !memcmp(file->data(), "DDS ", 4))
+    valid = detail::parse_dds(file->data(), layout);
+
+  if (!valid)
+    return false;
+
+  _storageValid = false;
+  _type = layout.type;
+  _format = layout.format;
+  _size = layout.size;
+  _sizeLayers = layout.layers;
+  _sizeMipLevels = layout.mip_levels;
+  _parts = std::move(layout.parts);
+  _sizeBytes = 0;
+  for (auto &&p : _parts) _sizeBytes += p.length;
+
+  _file = file;
+  _pbo->clear();
+  set_dirty();
+  return true;
+}
+
+namespace detail
+{
+
+//------------------------------------------------------------------------------------------------------------------------
+// Modified Bessel function of the first kind, the power series converges fast for the arguments of the Kaiser window
+inline float bessel_i0(float x)
+{
+  float sum = 1.0f, term = 1.0f, q = x * x / 4;
+  for (int k = 1; k < 16; ++k) { term *= q / static_cast<float>(k * k); sum += term; }
+  return sum;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+// Taps of a separable filter from srcSize to dstSize texels along one axis, the same number for every destination
+// texel with unused ones weighted 0. Equal sizes copy.
+struct mip_kernel
+{
+  size_t taps = 1;
+  std::vector<size_t> indices;
+  std::vector<float> weights;
+
+  void build(size_t srcSize, size_t dstSize, texture::mip_filter filter, bool wrap)
+  {
+    static const float kaiserWidth = 3.0f, kaiserAlpha = 4.0f, pi = 3.14159265358f;
+
+    float scale = static_cast<float>(srcSize) / dstSize;
+    float radius = (filter == texture::mip_filter::box) ? scale / 2 : kaiserWidth * scale;
+    taps = (srcSize == dstSize) ? 1 : static_cast<size_t>(ceil(radius * 2)) + 1;
+    if (filter == texture::mip_filter::box && srcSize == dstSize * 2) taps = 2; // texel aligned, no partial ones
+    indices.assign(dstSize * taps, 0);
+    weights.assign(dstSize * taps, 0.0f);
+
+    for (size_t i = 0; i < dstSize; ++i)
+    {
+      float center = (i + 0.5f) * scale, sum = 0;
+      int first = (taps == 1) ? static_cast<int>(i) : static_cast<int>(floor(center - radius));
+      for (size_t t = 0; t < taps; ++t)
+      {
+        int src = first + static_cast<int>(t);
+        float w = 1;
+        if (taps > 1 && filter == texture::mip_filter::box)
+          w = maximum(0.0f, minimum(src + 1.0f, center + radius) - maximum(static_cast<float>(src), center - radius));
+        else if (taps > 1)
+        {
+          // distance in destination texels
+          float x = (src + 0.5f - center) / scale, r = x / kaiserWidth;
+          float sinc = (x != 0) ? sin(pi * x) / (pi * x) : 1.0f;
+          w = (r * r < 1) ? sinc * bessel_i0(kaiserAlpha * sqrt(1 - r * r)) / bessel_i0(kaiserAlpha) : 0.0f;
+        }
+
+        int n = static_cast<int>(srcSize);
+        indices[i * taps + t] = wrap ? (src % n + n) % n : minimum(maximum(src, 0), n - 1);
+        weights[i * taps + t] = w;
+        sum += w;
+      }
+
+      for (size_t t = 0; t < taps; ++t) weights[i * taps + t] /= sum;
+    }
+  }
+
+  // RGBA float row to dstSize RGBA floats
+  void filter_row(const float *src, float *dst) const
+  {
+    for (size_t i = 0, n = indices.size() / taps; i < n; ++i)
+    {
+      simd4f acc = simd_splat(0);
+      for (size_t t = 0; t < taps; ++t)
+        acc = simd_add(acc, simd_mul(simd_load(src + indices[i * taps + t] * 4), simd_splat(weights[i * taps + t])));
+
+      simd_store(dst + i * 4, acc);
+    }
+  }
+};
+
+//------------------------------------------------------------------------------------------------------------------------
+// sRGB decoding table and, for encoding with rounding in sRGB space, the linear values halfway between the codes
+struct srgb_table
+{
+  float decode[256];
+  float thresholds[255];
+
+  srgb_table()
+  {
+    auto toLinear = [](double c) { return (c <= 0.04045) ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4); };
+    for (int i = 0; i < 256; ++i) decode[i] = static_cast<float>(toLinear(i / 255.0));
+    for (int i = 0; i < 255; ++i) thresholds[i] = static_cast<float>(toLinear((i + 0.5) / 255.0));
+  }
+
+  uint8_t encode(float linear) const
+  {
+    return static_cast<uint8_t>(std::upper_bound(thresholds, thresholds + 255, linear) - thresholds);
+  }
+};
+
+//------------------------------------------------------------------------------------------------------------------------
+// Share of RGBA float texels whose alpha times scale passes an alpha test against reference
+inline float alpha_coverage(const float *pixels, size_t count, float scale, float reference)
+{
+  size_t passed = 0;
+  for (size_t i = 0; i < count; ++i) passed += (pixels[i * 4 + 3] * scale >= reference) ? 1 : 0;
+  return count ? static_cast<float>(passed) / count : 0.0f;
+}
+
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool texture::generate_mips(mip_filter filter, bool srgb, float alphaReference)
+{
+  if (_format != GL_RGBA || _file || !_pbo->data() || _pbo->size() != _sizeBytes)
+    return false;
+
+  size_t numMips = size_mip_levels(true);
+  if (numMips < 2)
+    return true;
+
+  uint8_t *pixels = _pbo->owns_data() ? const_cast<uint8_t *>(_pbo->data()) :
+    static_cast<uint8_t *>(_pbo->alloc_data(_pbo->data(), _sizeBytes));
+
+  static const detail::srgb_table srgbTable;
+  bool cube = _type == gl.TEXTURE_CUBE_MAP || _type == gl.TEXTURE_CUBE_MAP_ARRAY;
+  bool wrap = _wrap == GL_REPEAT && !cube;
+
+  // rows per thread, small levels are not worth a thread
+  auto batch = [](int width) { return static_cast<size_t>(maximum(1, 16384 / width)); };
+
+  auto levelParts = [this](size_t mipLevel) {
+    std::vector<const part *> result;
+    for (size_t i = 0; i < mip_layers(mipLevel); ++i) result.push_back(find_part(i, mipLevel));
+    return result;
+  };
+
+  // level 0 in float, linear when srgb
+  ivec2 srcSize = size(0);
+  size_t srcLayers = mip_layers(0);
+  auto srcParts = levelParts(0);
+  std::vector<float> src(srcLayers * srcSize.y * srcSize.x * 4), dst, horizontal;
+  parallel_for(srcLayers * srcSize.y, batch(srcSize.x), [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; ++r)
+    {
+      auto p = srcParts[r / srcSize.y];
+      const uint8_t *in = pixels + p->offset + (r % srcSize.y) * p->row_stride;
+      float *out = &src[r * srcSize.x * 4];
+      for (int i = 0; i < srcSize.x * 4; ++i)
+        out[i] = (srgb && (i & 3) != 3) ? srgbTable.decode[in[i]] : in[i] / 255.0f;
+    }
+  });
+
+  // alpha test pass rates of level 0, per layer except for 3D textures whose layers merge in the smaller levels
+  bool volume = _type == gl.TEXTURE_3D;
+  std::vector<float> coverage(volume ? 1 : srcLayers, 1.0f);
+  size_t texelsPerCoverage = srcSize.x * srcSize.y * (volume ? srcLayers : 1);
+  if (alphaReference > 0)
+  {
+    for (size_t i = 0; i < coverage.size(); ++i)
+      coverage[i] = detail::alpha_coverage(&src[i * texelsPerCoverage * 4], texelsPerCoverage, 1, alphaReference);
+  }
+
+  detail::mip_kernel kx, ky, kz;
+  for (size_t mip = 1; mip < numMips; ++mip)
+  {
+    ivec2 dstSize = size(mip);
+    size_t dstLayers = mip_layers(mip);
+    auto dstParts = levelParts(mip);
+    kx.build(srcSize.x, dstSize.x, filter, wrap);
+    ky.build(srcSize.y, dstSize.y, filter, wrap);
+    kz.build(srcLayers, dstLayers, filter, wrap);
+
+    // horizontally into every source row, then vertically (and across the layers of 3D textures) from those
+    horizontal.resize(srcLayers * srcSize.y * dstSize.x * 4);
+    parallel_for(srcLayers * srcSize.y, batch(srcSize.x), [&](size_t begin, size_t end) {
+      for (size_t r = begin; r < end; ++r) kx.filter_row(&src[r * srcSize.x * 4], &horizontal[r * dstSize.x * 4]);
+    });
+
+    dst.resize(dstLayers * dstSize.y * dstSize.x * 4);
+    parallel_for(dstLayers * dstSize.y, batch(dstSize.x * static_cast<int>(ky.taps)), [&](size_t begin, size_t end) {
+      for (size_t r = begin; r < end; ++r)
+      {
+        size_t layer = r / dstSize.y, y = r % dstSize.y;
+        float *out = &dst[r * dstSize.x * 4];
+        std::fill(out, out + dstSize.x * 4, 0.0f);
+
+        for (size_t tz = 0; tz < kz.taps; ++tz)
+        {
+          for (size_t ty = 0; ty < ky.taps; ++ty)
+          {
+            float w = kz.weights[layer * kz.taps + tz] * ky.weights[y * ky.taps + ty];
+            if (w == 0) continue;
+
+            size_t row = kz.indices[layer * kz.taps + tz] * srcSize.y + ky.indices[y * ky.taps + ty];
+            const float *in = &horizontal[row * dstSize.x * 4];
+            detail::simd4f weight = detail::simd_splat(w);
+            for (int i = 0; i < dstSize.x * 4; i += 4)
+              detail::simd_store(out + i, detail::simd_add(detail::simd_load(out + i),
+                detail::simd_mul(detail::simd_load(in + i), weight)));
+          }
+        }
+      }
+    });
+
+    // alpha scale matching the coverage of level 0, by bisection as the pass rate only grows with the scale
+    std::vector<float> alphaScale(coverage.size(), 1.0f);
+    size_t texelsPerScale = dstSize.x * dstSize.y * (volume ? dstLayers : 1);
+    if (alphaReference > 0)
+    {
+      parallel_for(alphaScale.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+        {
+          const float *texels = &dst[i * texelsPerScale * 4];
+          float low = 0, high = 1;
+          while (high < 256 && detail::alpha_coverage(texels, texelsPerScale, high, alphaReference) < coverage[i])
+            high *= 2;
+
+          for (int step = 0; step < 16; ++step)
+          {
+            float mid = (low + high) / 2;
+            if (detail::alpha_coverage(texels, texelsPerScale, mid, alphaReference) < coverage[i]) low = mid;
+            else high = mid;
+          }
+
+          alphaScale[i] = high;
+        }
+      });
+    }
+
+    parallel_for(dstLayers * dstSize.y, batch(dstSize.x), [&](size_t begin, size_t end) {
+      for (size_t r = begin; r < end; ++r)
+      {
+        size_t layer = r / dstSize.y;
+        auto p = dstParts[layer];
+        float scale = alphaScale[volume ? 0 : layer];
+        const float *in = &dst[r * dstSize.x * 4];
+        uint8_t *out = pixels + p->offset + (r % dstSize.y) * p->row_stride;
+        for (int i = 0; i < dstSize.x * 4; ++i)
+        {
+          float v = minimum(maximum((i & 3) == 3 ? in[i] * scale : in[i], 0.0f), 1.0f);
+          out[i] = (srgb && (i & 3) != 3) ? srgbTable.encode(v) : static_cast<uint8_t>(v * 255 + 0.5f);
+        }
+      }
+    });
+
+    for (auto &&p : dstParts) _pbo->invalidate(p->offset, p->length);
+
+    src.swap(dst);
+    srcSize = dstSize;
+    srcLayers = dstLayers;
+  }
+
+  set_dirty();
+  return true;
+}
+
+namespace detail
+{
+
+//------------------------------------------------------------------------------------------------------------------------
+void *arena::alloc_block(size_t size, size_t alignment)
+{
+  // continue in the next block large enough, blocks kept from previous frames are reused
+  size_t needed = size + alignment;
+  size_t next = _blocks.empty() ? 0 : _current + 1;
+  while (next < _blocks.size() && _blocks[next].size < needed) ++next;
+
+  if (next == _blocks.size())
+  {
+    size_t blockSize = maximum(needed, _blockSize);
+    _blocks.push_back({ new uint8_t[blockSize], blockSize });
+  }
+
+  _current = next;
+  _offset = 0;
+  return alloc(size, alignment);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+uint32_t draw_queue::program_id(compiled_program *program)
+{
+  auto key = std::make_pair(program, program ? program->permutation() : 0);
+  auto iter = _programIds.find(key);
+  if (iter != _programIds.end())
+    return iter->second;
+
+  auto id = static_cast<uint32_t>(_programs.size());
+  _programs.emplace_back();
+  _programs.back().program = program;
+  _programs.back().permutation = key.second;
+  _programIds[key] = id;
+  return id;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void draw_queue::push(command cmd, texture *const *textures, base_geometry *geom, uint8_t layer, float depth)
+{
+  texture_set set;
+  std::copy(textures, textures + set.size(), set.begin());
+
+  auto textureIter = _textureSetIds.find(set);
+  if (textureIter == _textureSetIds.end())
+  {
+    textureIter = _textureSetIds.insert({ set, static_cast<uint32_t>(_textureSets.size()) }).first;
+    _textureSets.push_back(set);
+    for (auto t : set) if (t) _textureRefs.push_back(t);
+  }
+
+  auto geometryIter = _geometryIds.find(geom);
+  if (geometryIter == _geometryIds.end())
+  {
+    geometryIter = _geometryIds.insert({ geom, static_cast<uint32_t>(_geometries.size()) }).first;
+    _geometries.push_back(geom);
+  }
+
+  // draws without uniform changes in between share the same block
+  auto &entry = _programs[cmd.program];
+  if (entry.changed || entry.uniforms.empty())
+  {
+    entry.block = _uniforms.size();
+    _uniforms.insert(_uniforms.end(), entry.uniforms.begin(), entry.uniforms.end());
+    entry.changed = false;
+  }
+
+  cmd.textures = textureIter->second;
+  cmd.geometry = geometryIter->second;
+  cmd.uniforms = entry.block;
+  cmd.numUniforms = entry.uniforms.size();
+
+  _commands.push_back(cmd);
+  _keys.push_back(make_key(layer, cmd.program, cmd.textures, cmd.geometry, depth));
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+size_t draw_queue::push_batch(const std::vector<draw_elements_indirect_command> &batch)
+{
+  size_t offset = _batches.size();
+  _batches.insert(_batches.end(), batch.begin(), batch.end());
+  return offset;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+uint64_t draw_queue::make_key(uint8_t layer, uint32_t program, uint32_t textures, uint32_t geometry, float depth)
+{
+  // flipping all bits of negative floats and the sign bit of the others makes them compare like unsigned integers,
+  // the top 20 bits are kept
+  uint32_t depthBits;
+  memcpy(&depthBits, &depth, sizeof(depthBits));
+  depthBits = (depthBits & 0x80000000u) ? ~depthBits : (depthBits | 0x80000000u);
+
+  return (static_cast<uint64_t>(layer) << 56) | (static_cast<uint64_t>(program & 0xFFF) << 44) |
+    (static_cast<uint64_t>(textures & 0xFFF) << 32) | (static_cast<uint64_t>(geometry & 0xFFF) << 20) |
+    (depthBits >> 12);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+const std::vector<uint32_t> &draw_queue::sort(stats &st)
+{
+  size_t n = _commands.size();
+  _order.resize(n);
+  _scratch.resize(n);
+  for (size_t i = 0; i < n; ++i) _order[i] = static_cast<uint32_t>(i);
+
+  // LSD radix sort by bytes, which is stable, bytes that are the same for all keys are skipped
+  std::vector<std::array<size_t, 256>> counts(8);
+  for (auto &&c : counts) c.fill(0);
+  for (auto key : _keys)
+    for (size_t b = 0; b < 8; ++b) ++counts[b][(key >> (b * 8)) & 0xFF];
+
+  for (size_t b = 0; b < 8 && n; ++b)
+  {
+    auto &c = counts[b];
+    if (c[(_keys[0] >> (b * 8)) & 0xFF] == n)
+      continue;
+
+    size_t sum = 0;
+    for (auto &&x : c) { size_t count = x; x = sum; sum += count; }
+    for (auto i : _order) _scratch[c[(_keys[i] >> (b * 8)) & 0xFF]++] = i;
+    _order.swap(_scratch);
+  }
+
+  auto count_changes = [&](bool sorted, size_t &programs, size_t &geometries, size_t &textures)
+  {
+    const command *last = nullptr;
+    for (size_t i = 0; i < n; ++i)
+    {
+      auto &cmd = _commands[sorted ? _order[i] : i];
+      if (!last || cmd.program != last->program) ++programs;
+      if (!last || cmd.geometry != last->geometry) ++geometries;
+      if (!last || cmd.textures != last->textures) ++textures;
+      last = &cmd;
+    }
+  };
+
+  st.draws += n;
+  count_changes(true, st.program_changes, st.geometry_changes, st.texture_changes);
+  count_changes(false, st.submitted_program_changes, st.submitted_geometry_changes, st.submitted_texture_changes);
+  return _order;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void draw_queue::clear()
+{
+  _commands.clear();
+  _keys.clear();
+  _uniforms.clear();
+  _batches.clear();
+  _programs.clear();
+  _programIds.clear();
+  _textureSets.clear();
+  _textureRefs.clear();
+  _textureSetIds.clear();
+  _geometries.clear();
+  _geometryIds.clear();
+}
+
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void render_target::set_color_texture(size_t index, texture *tex)
+{
+  if (index >= max_color_attachments) return;
+  _colors[index].tex = tex;
+  _colors[index].format = GL_NONE;
+  set_dirty();
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void render_target::set_color_buffer(size_t index, GLenum internalFormat)
+{
+  if (index >= max_color_attachments) return;
+  _colors[index].tex = nullptr;
+  _colors[index].format = internalFormat;
+  set_dirty();
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void render_target::set_depth_buffer(GLenum internalFormat)
+{
+  _depth.tex = nullptr;
+  _depth.format = internalFormat;
+  set_dirty();
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void render_target::set_depth_texture(texture *tex)
+{
+  _depth.tex = tex;
+  _depth.format = GL_NONE;
+  set_dirty();
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool render_target::has_stencil() const
+{
+  GLenum format = _depth.tex ? _depth.tex->format() : _depth.format;
+  return format == gl.DEPTH_STENCIL || format == gl.DEPTH24_STENCIL8 || format == gl.DEPTH32F_STENCIL8;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool render_target::bind()
+{
+  if (dirty()) build();
+  if (!_complete) return false;
+
+  gl_state.bind_framebuffer(gl.FRAMEBUFFER, _fbo.id);
+  if (_invalidateOnBind) invalidate(_invalidateOnBind);
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void render_target::attach(GLenum point, attachment &a, GLsizei samples)
+{
+  if (a.tex)
+  {
+    // the texture storage is reallocated without pixels when the size changes, on a unit context3d does not use
+    auto size = a.tex->size(0);
+    if ((size.x != _size.x || size.y != _size.y || !a.tex->id()) && a.tex->pixel_buffer())
+    {
+      a.tex->set_size(_size.x, _size.y);
+      a.tex->pixel_buffer()->clear();
+    }
+
+    a.tex->bind(detail::gl_state_cache::max_texture_units - 1);
+
+    if (!samples)
+    {
+      a.buffer.destroy();
+      gl.FramebufferTexture2D(gl.FRAMEBUFFER, point, GL_TEXTURE_2D, a.tex->id(), 0);
+      return;
+    }
+  }
+
+  GLenum format = a.tex ? detail::gl_format_descriptor::get(a.tex->format()).layout : a.format;
+  if (!a.buffer.id) gl.GenRenderbuffers(1, &a.buffer.id);
+  gl.BindRenderbuffer(gl.RENDERBUFFER, a.buffer.id);
+  gl.RenderbufferStorageMultisample(gl.RENDERBUFFER, samples, format, _size.x, _size.y);
+  gl.FramebufferRenderbuffer(gl.FRAMEBUFFER, point, gl.RENDERBUFFER, a.buffer.id);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void render_target::attach_resolve(GLenum point, const attachment &a)
+{
+  if (a.tex)
+    gl.FramebufferTexture2D(gl.FRAMEBUFFER, point, GL_TEXTURE_2D, a.tex->id(), 0);
+  else
+    gl.FramebufferRenderbuffer(gl.FRAMEBUFFER, point, gl.RENDERBUFFER, 0);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool render_target::build()
+{
+  set_dirty(false);
+  _complete = false;
+  if (_size.x <= 0 || _size.y <= 0)
+    return false;
+
+  GLint maxSamples = 0;
+  if (_samples > 1) glGetIntegerv(gl.MAX_SAMPLES, &maxSamples);
+  _activeSamples = (maxSamples > 1) ? minimum(static_cast<GLint>(_samples), maxSamples) : 0;
+
+  if (!_fbo.id) gl.GenFramebuffers(1, &_fbo.id);
+  gl_state.bind_framebuffer(gl.FRAMEBUFFER, _fbo.id);
+
+  GLenum drawBuffers[max_color_attachments];
+  GLenum resolveBuffers[max_color_attachments];
+  GLsizei numDrawBuffers = 0, numResolveBuffers = 0;
+  _readBuffer = GL_NONE;
+
+  for (size_t i = 0; i < max_color_attachments; ++i)
+  {
+    auto &a = _colors[i];
+    GLenum point = gl.COLOR_ATTACHMENT0 + static_cast<GLenum>(i);
+    drawBuffers[i] = resolveBuffers[i] = GL_NONE;
+
+    if (!a.tex && a.format == GL_NONE)
+    {
+      gl.FramebufferRenderbuffer(gl.FRAMEBUFFER, point, gl.RENDERBUFFER, 0);
+      a.buffer.destroy();
+      continue;
+    }
+
+    attach(point, a, _activeSamples);
+    drawBuffers[i] = point;
+    numDrawBuffers = static_cast<GLsizei>(i + 1);
+    if (_readBuffer == GL_NONE) _readBuffer = point;
+
+    if (a.tex)
+    {
+      resolveBuffers[i] = point;
+      numResolveBuffers = static_cast<GLsizei>(i + 1);
+    }
+  }
+
+  // detaching from the depth/stencil point detaches both
+  gl.FramebufferRenderbuffer(gl.FRAMEBUFFER, gl.DEPTH_STENCIL_ATTACHMENT, gl.RENDERBUFFER, 0);
+  GLenum depthPoint = has_stencil() ? gl.DEPTH_STENCIL_ATTACHMENT : gl.DEPTH_ATTACHMENT;
+  if (_depth.tex || _depth.format != GL_NONE)
+    attach(depthPoint, _depth, _activeSamples);
+  else
+    _depth.buffer.destroy();
+
+  // depth only targets draw to and read from no color buffer
+  GLenum none = GL_NONE;
+  if (numDrawBuffers) gl.DrawBuffers(numDrawBuffers, drawBuffers); else gl.DrawBuffers(1, &none);
+  glReadBuffer(_readBuffer);
+  _complete = gl.CheckFramebufferStatus(gl.FRAMEBUFFER) == gl.FRAMEBUFFER_COMPLETE;
+
+  // multisampled targets are resolved into a second framebuffer holding the textures
+  if (_activeSamples && (numResolveBuffers || _depth.tex))
+  {
+    if (!_resolveFbo.id) gl.GenFramebuffers(1, &_resolveFbo.id);
+    gl_state.bind_framebuffer(gl.FRAMEBUFFER, _resolveFbo.id);
+
+    for (size_t i = 0; i < max_color_attachments; ++i)
+      attach_resolve(gl.COLOR_ATTACHMENT0 + static_cast<GLenum>(i), _colors[i]);
+
+    gl.FramebufferRenderbuffer(gl.FRAMEBUFFER, gl.DEPTH_STENCIL_ATTACHMENT, gl.RENDERBUFFER, 0);
+    attach_resolve(depthPoint, _depth);
+
+    if (numResolveBuffers) gl.DrawBuffers(numResolveBuffers, resolveBuffers); else gl.DrawBuffers(1, &none);
+    glReadBuffer(GL_NONE);
+    _complete &= gl.CheckFramebufferStatus(gl.FRAMEBUFFER) == gl.FRAMEBUFFER_COMPLETE;
+
+    gl_state.bind_framebuffer(gl.FRAMEBUFFER, _fbo.id);
+  }
+  else
+    _resolveFbo.destroy();
+
+  return _complete;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+size_t render_target::get_invalidate_points(GLbitfield buffers, GLenum *points) const
+{
+  size_t count = 0;
+  if (buffers & GL_COLOR_BUFFER_BIT)
+  {
+    for (size_t i = 0; i < max_color_attachments; ++i)
+      if (_colors[i].tex || _colors[i].format != GL_NONE)
+        points[count++] = gl.COLOR_ATTACHMENT0 + static_cast<GLenum>(i);
+  }
+
+  if (!_depth.tex && _depth.format == GL_NONE)
+    return count;
+
+  bool depth = (buffers & GL_DEPTH_BUFFER_BIT) != 0;
+  bool stencil = (buffers & GL_STENCIL_BUFFER_BIT) && has_stencil();
+  if (depth && stencil)
+    points[count++] = gl.DEPTH_STENCIL_ATTACHMENT;
+  else if (depth)
+    points[count++] = gl.DEPTH_ATTACHMENT;
+  else if (stencil)
+    points[count++] = gl.STENCIL_ATTACHMENT;
+
+  return count;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void render_target::invalidate(GLbitfield buffers)
+{
+  if (!gl.InvalidateFramebuffer || !_fbo.id || dirty())
+    return;
+
+  GLenum points[max_color_attachments + 1];
+  auto count = static_cast<GLsizei>(get_invalidate_points(buffers, points));
+  if (!count)
+    return;
+
+  GLuint draw = gl_state.draw_framebuffer();
+  gl_state.bind_framebuffer(gl.DRAW_FRAMEBUFFER, _fbo.id);
+  gl.InvalidateFramebuffer(gl.DRAW_FRAMEBUFFER, count, points);
+  gl_state.bind_framebuffer(gl.DRAW_FRAMEBUFFER, draw);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool render_target::resolve(bool keep)
+{
+  GLuint draw = gl_state.draw_framebuffer(), read = gl_state.read_framebuffer();
+  if (dirty()) build();
+  if (!_complete) return false;
+  if (!_activeSamples || !_resolveFbo.id) return true;
+
+  gl_state.bind_framebuffer(gl.READ_FRAMEBUFFER, _fbo.id);
+  gl_state.bind_framebuffer(gl.DRAW_FRAMEBUFFER, _resolveFbo.id);
+
+  // a blit per texture, each one selects its own read and draw buffer
+  GLenum drawBuffers[max_color_attachments];
+  for (size_t i = 0; i < max_color_attachments; ++i)
+  {
+    GLenum point = gl.COLOR_ATTACHMENT0 + static_cast<GLenum>(i);
+    drawBuffers[i] = GL_NONE;
+    if (!_colors[i].tex) continue;
+
+    drawBuffers[i] = point;
+    glReadBuffer(point);
+    gl.DrawBuffers(static_cast<GLsizei>(i + 1), drawBuffers);
+    gl.BlitFramebuffer(0, 0, _size.x, _size.y, 0, 0, _size.x, _size.y, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    drawBuffers[i] = GL_NONE;
+  }
+
+  if (_depth.tex)
+  {
+    GLbitfield mask = GL_DEPTH_BUFFER_BIT | (has_stencil() ? GL_STENCIL_BUFFER_BIT : 0);
+    gl.BlitFramebuffer(0, 0, _size.x, _size.y, 0, 0, _size.x, _size.y, mask, GL_NEAREST);
+  }
+
+  glReadBuffer(_readBuffer);
+  gl_state.bind_framebuffer(gl.READ_FRAMEBUFFER, read);
+  gl_state.bind_framebuffer(gl.DRAW_FRAMEBUFFER, draw);
+
+  // the multisampled content is not needed anymore, tiled GPUs do not have to write it back
+  if (!keep) invalidate(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+render_target *render_target_pool::acquire(int width, int height, GLenum format, int samples)
+{
+  if (_frameIndex != gl_state.frame_index()) begin_frame();
+
+  // compressed formats cannot be rendered to
+  auto desc = detail::gl_format_descriptor::get(format);
+  if (width <= 0 || height <= 0 || !desc.block_size || desc.compressed()) return nullptr;
+  if (samples < 2) samples = 0;
+
+  // multisampled targets hold the renderbuffer and the texture it is resolved into
+  size_t bytes = desc.image_size(width, height) * (samples ? samples + 1 : 1);
+  ++_frame.requests;
+  _frame.naive_bytes += bytes;
+
+  entry *e = nullptr;
+  for (auto &&c : _entries)
+  {
+    if (!c.acquired && c.size.x == width && c.size.y == height && c.format == format && c.samples == samples)
+    {
+      e = &c;
+      break;
+    }
+  }
+
+  if (e)
+  {
+    // nothing of the previous user is needed, tiled GPUs do not load it
+    e->target->invalidate(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+  }
+  else
+  {
+    texture::ptr tex = new texture();
+    tex->set_params(width, height, format, 1, 1);
+    tex->set_filter(GL_LINEAR, GL_LINEAR);
+    tex->set_wrap(gl.CLAMP_TO_EDGE);
+
+    render_target::ptr rt = new render_target();
+    rt->set_size(width, height);
+    rt->set_samples(samples);
+    if (format == GL_DEPTH_COMPONENT || format == gl.DEPTH_STENCIL) rt->set_depth_texture(tex);
+    else rt->set_color_texture(0, tex);
+
+    _entries.emplace_back();
+    e = &_entries.back();
+    e->size = ivec2(width, height);
+    e->format = format;
+    e->samples = samples;
+    e->bytes = bytes;
+    e->target = rt;
+
+    _bytes += bytes;
+    ++_frame.allocations;
+  }
+
+  e->acquired = true;
+  e->last_frame = _frameIndex;
+  _acquiredBytes += e->bytes;
+  _frame.peak_bytes = maximum(_frame.peak_bytes, _acquiredBytes);
+  _frame.pool_bytes = _bytes;
+  return e->target;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void render_target_pool::release(render_target *rt)
+{
+  for (auto &&e : _entries)
+  {
+    if (e.acquired && e.target == rt)
+    {
+      e.acquired = false;
+      _acquiredBytes -= e.bytes;
+      return;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void render_target_pool::begin_frame()
+{
+  _frameIndex = gl_state.frame_index();
+
+  // targets are frame scoped, the unused ones are destroyed
+  _entries.erase(std::remove_if(_entries.begin(), _entries.end(),
+    [this](const entry &e) { return _frameIndex - e.last_frame > _maxUnusedFrames; }), _entries.end());
+
+  _bytes = _acquiredBytes = 0;
+  for (auto &&e : _entries)
+  {
+    e.acquired = false;
+    _bytes += e.bytes;
+  }
+
+  _lastFrame = _frame;
+  _frame = stats();
+  _frame.pool_bytes = _bytes;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+texture_streamer::texture_streamer(size_t ringSize, size_t frameBudget): _ringSize(ringSize), _frameBudget(frameBudget)
+{
+  gl.GenBuffers(1, &_buffer.id);
+  gl_state.bind_buffer(gl.PIXEL_UNPACK_BUFFER, _buffer.id);
+
+  if (gl.BufferStorage)
+  {
+    GLbitfield flags = gl.MAP_WRITE_BIT | gl.MAP_PERSISTENT_BIT | gl.MAP_COHERENT_BIT;
+    gl.BufferStorage(gl.PIXEL_UNPACK_BUFFER, _ringSize, nullptr, flags);
+    _persistentData = static_cast<uint8_t *>(gl.MapBufferRange(gl.PIXEL_UNPACK_BUFFER, 0, _ringSize, flags));
+  }
+  else
+  {
+    gl.BufferData(gl.PIXEL_UNPACK_BUFFER, _ringSize, nullptr, gl.STREAM_DRAW);
+    _staging.resize(_ringSize);
+  }
+
+  gl_state.bind_buffer(gl.PIXEL_UNPACK_BUFFER, 0);
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+texture_streamer::~texture_streamer()
+{
+  for (auto &&f : _fences) gl.DeleteSync(f.second);
+
+  // deleting the buffer also unmaps it
+  _buffer.destroy();
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+bool texture_streamer::alloc(size_t size, size_t &offset)
+{
+  if (_uploads.empty()) _head = 0;
+  size_t tail = _uploads.empty() ? 0 : _uploads.front().offset;
+
+  // the head never catches up with the tail, equal offsets mean an empty ring
+  if (_uploads.empty() || _head > tail)
+  {
+    if (_ringSize - _head >= size) offset = _head;
+    else if (tail > size) offset = 0; // wraps around, the end stays unused until the tail passes it
+    else return false;
+  }
+  else if (tail - _head > size) offset = _head;
+  else return false;
+
+  _head = offset + size;
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+uint8_t *texture_streamer::begin_part(texture *tex, size_t layerIndex, size_t mipLevel)
 {
-  if (!id) id = gl.CreateProgram();
+  auto part = tex ? tex->find_part(layerIndex, mipLevel) : nullptr;
+  uint8_t *ring = _persistentData ? _persistentData : _staging.data();
+  if (!part || !part->length || !ring)
+    return nullptr;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  // aligned for any pixel type
+  size_t offset = 0, size = (part->length + 15) & ~static_cast<size_t>(15);
+  if (!alloc(size, offset))
+    return nullptr;
+
+  _uploads.push_back({ tex, layerIndex, mipLevel, offset, size, false, 0 });
+  return ring + offset;
+}
 
-  for (auto &&s : shaders) gl.AttachShader(id, s);
-  gl.LinkProgram(id);
+//------------------------------------------------------------------------------------------------------------------------
+void texture_streamer::end_part(uint8_t *pixels)
+{
+  uint8_t *ring = _persistentData ? _persistentData : _staging.data();
+  size_t offset = static_cast<size_t>(pixels - ring);
 
-  GLint status; gl.GetProgramiv(id, gl.LINK_STATUS, &status);
-  for (auto &&s : shaders) gl.DetachShader(id, s);
-  if (status == GL_FALSE)
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto it = _uploads.rbegin(); it != _uploads.rend(); ++it)
   {
-    gl.DeleteProgram(id); id = 0;
-    return false;
+    if (it->offset == offset && !it->submission)
+    {
+      it->ready = true;
+      return;
+    }
   }
-
-  return true;
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool buffer::bind(GLenum type)
+void texture_streamer::retire()
 {
-  if (dirty())
+  // fences complete in order, stop at the first one still pending
+  while (!_fences.empty())
   {
-    if (!_buffer.id) gl.GenBuffers(1, &_buffer.id);
-    gl.BindBuffer(type, _buffer.id);
-    gl.BufferData(type, _size, _data, gl.STREAM_DRAW);
+    GLenum status = gl.ClientWaitSync(_fences.front().second, gl.SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (status == gl.TIMEOUT_EXPIRED) break;
 
-    if (_owner && !_keepData && _data) { delete [] _data; _data = nullptr; }
-    set_dirty(false);
+    _completedSubmission = _fences.front().first;
+    gl.DeleteSync(_fences.front().second);
+    _fences.pop_front();
   }
-  else
-    gl.BindBuffer(type, _buffer.id);
 
-  return _buffer.id > 0;
+  while (!_uploads.empty() && _uploads.front().submission && _uploads.front().submission <= _completedSubmission)
+    _uploads.pop_front();
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-void buffer::unbind(GLenum type)
+void texture_streamer::submit(upload &u)
 {
-  gl.BindBuffer(type, 0);
+  u.submission = _submission;
+  auto part = u.tex->find_part(u.layer_index, u.mip_level);
+  if (!part) return;
+
+  // allocates the storage on first use, on a unit context3d does not use
+  u.tex->bind(detail::gl_state_cache::max_texture_units - 1);
+  gl_state.bind_buffer(gl.PIXEL_UNPACK_BUFFER, _buffer.id);
+  if (!_persistentData) gl.BufferSubData(gl.PIXEL_UNPACK_BUFFER, u.offset, part->length, _staging.data() + u.offset);
+  if (!u.tex->upload_part(*part, reinterpret_cast<const GLvoid *>(u.offset))) return;
+
+  ++_stats.parts;
+  _stats.bytes += part->length;
+
+  // samples from the finest level with all coarser levels complete, the coarsest one until it is complete itself
+  auto &r = _residency[u.tex];
+  size_t numMips = u.tex->size_mip_levels(true);
+  if (r.layers.size() != numMips) { r.tex = u.tex; r.layers.assign(numMips, 0); }
+  if (u.mip_level < numMips) ++r.layers[u.mip_level];
+
+  size_t base = numMips;
+  while (base > 0 && r.layers[base - 1] >= u.tex->mip_layers(base - 1)) --base;
+  u.tex->set_base_mip_level(minimum(base, numMips - 1));
+
+  if (!base)
+    _residency.erase(u.tex);
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool base_geometry::bind()
+void texture_streamer::update()
 {
-  if (!_vertexBuffer || !_vao.id)
-    return false;
+  std::lock_guard<std::mutex> lock(_mutex);
+  retire();
+
+  // parts go in order, the first one over the budget and all after it wait for the next frame
+  _stats = stats();
+  ++_submission;
+  bool submitted = false, full = false;
+  for (auto &&u : _uploads)
+  {
+    if (!u.ready || u.submission) continue;
 
-  _vertexBuffer->bind(gl.ARRAY_BUFFER);
-  gl.BindVertexArray(_vao);
+    full = full || (submitted && _stats.bytes + u.size > _frameBudget);
+    if (full) ++_stats.pending;
+    else { submit(u); submitted = true; }
+  }
 
-  if (_indexBuffer)
-    _indexBuffer->bind(gl.ELEMENT_ARRAY_BUFFER);
-  
-  return true;
+  if (!submitted)
+    return;
+
+  gl_state.bind_buffer(gl.PIXEL_UNPACK_BUFFER, 0);
+  _fences.push_back({ _submission, gl.FenceSync(gl.SYNC_GPU_COMMANDS_COMPLETE, 0) });
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-void base_geometry::unbind()
+context3d::context3d()
 {
-  if (_vertexBuffer)
-    _vertexBuffer->unbind(gl.ARRAY_BUFFER);
-  
-  gl.BindVertexArray(0);
-
-  if (_indexBuffer)
-    _indexBuffer->unbind(gl.ELEMENT_ARRAY_BUFFER);
+  _basicTechnique = new technique();
+  _basicTechnique->set_vert_source(detail::vertex_shader_code3d);
+  _basicTechnique->set_frag_source(detail::fragment_shader_code3d);
+  _basicPermutation = _basicTechnique->permutation();
+  _instancedPermutation = _basicTechnique->declare_permutation({ { "GL3D_INSTANCED", "1" } });
 }
 
+//------------------------------------------------------------------------------------------------------------------------
+void context3d::clear()
+{
+  flush();
+
+  // GL bindings are left in place, the state cache filters out rebinding the same objects next frame
+  _geometry = nullptr;
+  _program = nullptr;
+  _batch.clear();
+
+  for (size_t i = 0; i < 16; ++i)
+  {
+    _textures[i] = nullptr;
+  }
+
+  bind(_basicTechnique);
+  bind(static_cast<render_target *>(nullptr));
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool technique::bind()
+bool context3d::bind(detail::base_geometry *geom)
 {
-  if (dirty())
+  // the basic technique switches to its variant reading the per-instance transform, before any uniforms get set
+  if (_program == _basicTechnique)
   {
-    std::string macroString = get_macro_string();
-
-    if (!_vertSource.empty())
-      _vertShader.compile(gl.VERTEX_SHADER, macroString + _vertSource);
-    else
-      _vertShader.destroy();
+    _basicTechnique->select_permutation((geom && geom->instanced()) ? _instancedPermutation : _basicPermutation);
+    if (_basicTechnique->dirty()) bind(_basicTechnique);
+  }
 
-    if (!_geomSource.empty())
-      _geomShader.compile(gl.GEOMETRY_SHADER, macroString + _geomSource);
-    else
-      _geomShader.destroy();
+  if (_deferred)
+  {
+    if (geom != _geometry) _batch.clear();
+    _geometry = geom;
+    return true;
+  }
 
-    if (!_fragSource.empty())
-      _fragShader.compile(gl.FRAGMENT_SHADER, macroString + _fragSource);
-    else
-      _fragShader.destroy();
-    
-    _program.link({ _vertShader, _geomShader, _fragShader });
-    set_dirty(false);
+  // a dirty geometry may have changed vertex or instance data since it was bound
+  if (geom != _geometry || (geom && geom->dirty()))
+  {
+    if (geom != _geometry) _batch.clear();
+    if (_geometry = geom) return _geometry->bind();
+    gl_state.bind_vertex_array(0);
   }
 
-  gl.UseProgram(_program.id);
-  return _program.id != 0;
+  return true;
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool compute::bind()
+bool context3d::bind(detail::compiled_program *prog)
 {
-  if (dirty())
+  // recording only compiles, programs get made current when the draws are executed
+  if (_deferred)
   {
-    std::string macroString = get_macro_string();
+    _program = prog;
+    return !prog || !prog->dirty() || prog->bind();
+  }
 
-    if (!_source.empty())
-      _shader.compile(gl.COMPUTE_SHADER, macroString + _source);
-    else
-      _shader.destroy();
-    
-    _program.link({ _shader });
-    set_dirty(false);
+  // a dirty program may have switched permutation and needs to be bound again
+  if (prog != _program || (prog && prog->dirty()))
+  {
+    if (_program = prog) return _program->bind();
+    gl_state.use_program(0);
   }
 
-  gl.UseProgram(_program.id);
-  return _program.id != 0;
+  return true;
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-void compute::dispatch(int numGroupsX, int numGroupsY, int numGroupsZ)
+bool context3d::bind(texture *tex, int slot)
 {
-  
+  if (slot < 0 || slot >= 16) return false;
+  _textures[slot] = tex;
+  return (tex && !_deferred) ? tex->bind(slot) : true;
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-void texture::update_parts()
+bool context3d::bind(render_target *rt)
 {
-  set_dirty();
-  _parts.clear();
-  _sizeBytes = 0;
-  size_t numMips = size_mip_levels(true);
-  size_t pixelSize = detail::gl_format_descriptor::get(_format).pixel_size;
-  for (size_t i = 0; i < _sizeLayers; ++i)
+  // draws are sorted within a render target only
+  if (_deferred && rt != _renderTarget) flush();
+
+  // binding the same target again keeps its content
+  if (rt && rt == _renderTarget && !rt->dirty()) return true;
+  _renderTarget = rt;
+
+  if (!rt)
   {
-    for (size_t mip = 0; mip < numMips; ++mip)
-    {
-      part p;
-      p.layer_index = i;
-      p.mip_level = mip;
-      p.size = size(mip);
-      p.offset = _sizeBytes;
-      p.row_stride = p.size.x * pixelSize;
-      _sizeBytes += p.length = p.row_stride * p.size.y;
-      _parts.push_back(p);
-    }
+    gl_state.bind_framebuffer(gl.FRAMEBUFFER, 0);
+    if (_backbufferSize.x > 0 && _backbufferSize.y > 0)
+      gl_state.set_viewport(0, 0, _backbufferSize.x, _backbufferSize.y);
+
+    return true;
   }
+
+  if (!rt->bind()) return false;
+  gl_state.set_viewport(0, 0, rt->size().x, rt->size().y);
+  return true;
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-void texture::set_params(int width, int height, GLenum format, size_t sizeLayers, size_t sizeMipLevels)
+bool context3d::set_uniform(const char *name, texture *value)
 {
-  if (_size.x != width || _size.y != height || _format != format || _sizeLayers != sizeLayers || _sizeMipLevels != sizeMipLevels)
-  {
-    if (_type == GL_TEXTURE_1D || _type == GL_TEXTURE_2D) sizeLayers = 1;
-    else if (_type == gl.TEXTURE_CUBE_MAP) sizeLayers = 6;
-    _size = ivec2(width, height); _format = format; _sizeLayers = sizeLayers;
-    update_parts();
-  }
+  auto program = active_program();
+  if (!program) return false;
+  return set_uniform_texture(program->find_uniform(name), value);
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-size_t texture::size_mip_levels(bool calculate) const
+bool context3d::set_uniform(const uniform_handle<texture *> &handle, texture *value)
 {
-  if (calculate && _sizeMipLevels == 0)
-  {
-    size_t num = 1;
-    while (true) { ivec2 s = size(num - 1); if (s.x == 1 && s.y == 1) break; ++num; }
-    return num;
-  }
-
-  return _sizeMipLevels;
+  auto program = active_program();
+  if (!program || handle.program() != program) return false;
+  return set_uniform_texture(handle.index(), value);
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool texture::bind(int slot)
+bool context3d::set_uniform_texture(int index, texture *value)
 {
-  if (dirty())
-  {
-    if (!_texture.id) glGenTextures(1, &_texture.id);
-    gl.ActiveTexture(gl.TEXTURE0 + slot);
-    glBindTexture(_type, _texture.id);
+  if (index < 0) return false;
 
-    if (_pbo->dirty())
-    {
-      _pbo->bind(gl.PIXEL_UNPACK_BUFFER);
-      auto desc = detail::gl_format_descriptor::get(_format);
-      if (_type == GL_TEXTURE_1D || _type == GL_TEXTURE_2D)
-      {
-        for (auto &&p : _parts)
-          glTexImage2D(_type, static_cast<GLint>(p.mip_level), desc.layout, p.size.x, p.size.y, 0, _format, desc.element_format, reinterpret_cast<const GLvoid *>(p.offset));
-      }
-      _pbo->unbind(gl.PIXEL_UNPACK_BUFFER);
-    }
+  // samplers get fixed units at link time, so the unit uniform is uploaded only once
+  auto program = active_program();
+  int slot = program->uniforms()[index].texture_unit;
+  if (slot < 0) return false;
+  return bind(value, slot) && apply_uniform(program, index, slot);
+}
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, _minFilter);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, _magFilter);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, _wrap);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, _wrap);
-    set_dirty(false);
-  }
-  else
+//------------------------------------------------------------------------------------------------------------------------
+bool context3d::draw(GLenum primitive, size_t offset, size_t length)
+{
+  if (!_geometry) return false;
+  if (_geometry->instanced()) return draw_instanced(_geometry->size_instances(), primitive, offset, length);
+
+  if (auto pool = _geometry->as_pool())
   {
-    gl.ActiveTexture(gl.TEXTURE0 + slot);
-    glBindTexture(GL_TEXTURE_2D, _texture.id);
+    for (size_t i = 0; i < pool->max_mesh_id(); ++i) batch(i);
+    return draw_batch(primitive);
   }
 
-  return true;
+  return draw_geometry(primitive, offset, length, 0);
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-void texture::set_filter(GLenum minFilter, GLenum magFilter)
+bool context3d::draw_instanced(size_t numInstances, GLenum primitive, size_t offset, size_t length)
 {
-  if (minFilter != _minFilter || magFilter != _magFilter) 
-  {
-    _minFilter = minFilter; _magFilter = magFilter;
-    set_dirty();
-  }
+  if (!_geometry || !numInstances) return false;
+  return draw_geometry(primitive, offset, length, numInstances);
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-context3d::context3d()
+bool context3d::prepare_draw()
 {
-  _basicTechnique = new technique();
-  _basicTechnique->set_vert_source(detail::vertex_shader_code3d);
-  _basicTechnique->set_frag_source(detail::fragment_shader_code3d);
+  // pending programs are only polled by bind(), so uniforms set meanwhile stay with the placeholder
+  if (_program && _program->dirty() && !_program->pending()) _program->bind();
+  return !_program || active_program()->ready();
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-void context3d::clear()
+bool context3d::draw_geometry(GLenum primitive, size_t offset, size_t length, size_t numInstances)
 {
-  if (_geometry) _geometry->unbind();
-  _geometry = nullptr;
+  if (_deferred)
+  {
+    detail::draw_queue::command cmd = { };
+    cmd.program = _queue.program_id(_program);
+    cmd.primitive = primitive;
+    cmd.offset = offset;
+    cmd.length = length;
+    cmd.numInstances = numInstances;
+    return queue_draw(cmd);
+  }
 
-  if (_program) _program->unbind();
-  _program = nullptr;
+  if (!prepare_draw()) return false;
 
-  for (size_t i = 0; i < 16; ++i)
+  auto numVertices = _geometry->size_vertices();
+  bool indexed = _geometry->index_buffer() && _geometry->size_indices();
+  
+  auto numElements = indexed ? _geometry->size_indices() : numVertices;
+  if (offset >= numElements || !numVertices) return false;
+  
+  if (offset + length > numElements)
+    length = numElements - offset;
+  
+  auto count = static_cast<GLsizei>(length);
+  auto instances = static_cast<GLsizei>(numInstances);
+
+  if (indexed)
   {
-    _textures[i] = nullptr;
+    auto type = _geometry->index_type();
+    size_t indexSize = (type == GL_UNSIGNED_SHORT) ? sizeof(uint16_t) : sizeof(uint32_t);
+    auto indices = reinterpret_cast<const GLvoid *>(offset * indexSize);
+
+    if (numInstances)
+      gl.DrawElementsInstanced(primitive, count, type, indices, instances);
+    else
+      gl.DrawRangeElements(primitive, 0, static_cast<GLuint>(numVertices - 1), count, type, indices);
   }
+  else if (numInstances)
+    gl.DrawArraysInstanced(primitive, static_cast<GLint>(offset), count, instances);
+  else
+    glDrawArrays(primitive, static_cast<GLint>(offset), count);
 
-  bind(_basicTechnique);
+  return true;
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool context3d::bind(detail::base_geometry *geom)
+bool context3d::batch(size_t mesh, size_t numInstances)
 {
-  if (geom != _geometry)
+  auto pool = _geometry ? _geometry->as_pool() : nullptr;
+  if (!pool || !pool->valid(mesh) || !numInstances) return false;
+
+  auto &m = pool->mesh(mesh);
+  detail::draw_elements_indirect_command cmd;
+  cmd.instanceCount = static_cast<GLuint>(numInstances);
+  cmd.baseInstance = 0;
+
+  if (pool->indexed())
   {
-    if (_geometry) _geometry->unbind();
-    if (_geometry = geom) return _geometry->bind();
+    cmd.count = static_cast<GLuint>(m.numIndices);
+    cmd.firstIndex = static_cast<GLuint>(m.firstIndex);
+    cmd.baseVertex = static_cast<GLint>(m.firstVertex);
+  }
+  else
+  {
+    cmd.count = static_cast<GLuint>(m.numVertices);
+    cmd.firstIndex = static_cast<GLuint>(m.firstVertex);
+    cmd.baseVertex = 0;
   }
 
+  _batch.push_back(cmd);
   return true;
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool context3d::bind(detail::compiled_program *prog)
+bool context3d::draw_batch(GLenum primitive)
 {
-  if (prog != _program)
+  auto pool = _geometry ? _geometry->as_pool() : nullptr;
+  if (!pool || _batch.empty()) { _batch.clear(); return false; }
+
+  if (_deferred)
   {
-    if (_program) _program->unbind();
-    if (_program = prog) return _program->bind();
+    detail::draw_queue::command cmd = { };
+    cmd.program = _queue.program_id(_program);
+    cmd.primitive = primitive;
+    cmd.batch = _queue.push_batch(_batch);
+    cmd.batchSize = _batch.size();
+    _batch.clear();
+    return queue_draw(cmd);
   }
 
+  // the pool gets uploaded by bind, meshes added after binding it are not in the GPU buffers yet
+  if ((pool->dirty() && !pool->bind()) || !prepare_draw()) { _batch.clear(); return false; }
+
+  bool indexed = pool->indexed();
+  if (!draw_batch_indirect(primitive, indexed))
+    draw_batch_direct(primitive, indexed);
+
+  _batch.clear();
   return true;
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool context3d::bind(texture *tex, int slot)
+bool context3d::draw_batch_indirect(GLenum primitive, bool indexed)
 {
+  if (!gl.MultiDrawElementsIndirect || !gl.MultiDrawArraysIndirect)
+    return false;
+
+  if (!_indirectBuffer)
+    _indirectBuffer = new detail::stream_buffer(gl.DRAW_INDIRECT_BUFFER, 64 * 1024);
+
+  // batches of a frame are appended to the same region, the ring only advances per frame or when a region is full
+  size_t size = _batch.size() * (indexed ? sizeof(detail::draw_elements_indirect_command) :
+    sizeof(detail::draw_arrays_indirect_command));
+
+  bool full = _indirectCursor && _indirectCursor + size > _indirectBuffer->region_size();
+  if (full || _indirectFrame != gl_state.frame_index())
+  {
+    _indirectBuffer->next_region();
+    _indirectFrame = gl_state.frame_index();
+    _indirectCursor = 0;
+  }
+
+  auto data = _indirectBuffer->map(_indirectCursor + size, _indirectCursor);
+  if (!data)
+    return false;
+
+  data += _indirectCursor;
+  if (indexed)
+    memcpy(data, _batch.data(), size);
+  else
+  {
+    auto cmd = reinterpret_cast<detail::draw_arrays_indirect_command *>(data);
+    for (auto &&b : _batch) *cmd++ = { b.count, b.instanceCount, b.firstIndex, b.baseInstance };
+  }
+
+  _indirectBuffer->unmap();
+  gl_state.bind_buffer(gl.DRAW_INDIRECT_BUFFER, _indirectBuffer->id());
+
+  auto commands = reinterpret_cast<const GLvoid *>(_indirectBuffer->offset() + _indirectCursor);
+  auto count = static_cast<GLsizei>(_batch.size());
+  if (indexed)
+    gl.MultiDrawElementsIndirect(primitive, GL_UNSIGNED_INT, commands, count, 0);
+  else
+    gl.MultiDrawArraysIndirect(primitive, commands, count, 0);
+
+  _indirectCursor += size;
   return true;
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool context3d::set_uniform(const char *name, int value)
+void context3d::draw_batch_direct(GLenum primitive, bool indexed)
 {
-  if (!_program) return false;
-  auto id = gl.GetUniformLocation(_program->id(), name);
-  if (id >= 0)
+  _batchCounts.clear();
+  _batchFirsts.clear();
+  _batchIndices.clear();
+
+  for (auto &&b : _batch)
   {
-    gl.Uniform1i(id, value);
-    return true;      
+    auto indices = reinterpret_cast<const GLvoid *>(b.firstIndex * sizeof(uint32_t));
+    auto count = static_cast<GLsizei>(b.count);
+
+    // instanced meshes cannot be part of a multi-draw without indirect commands
+    if (b.instanceCount > 1)
+    {
+      auto instances = static_cast<GLsizei>(b.instanceCount);
+      if (indexed)
+        gl.DrawElementsInstancedBaseVertex(primitive, count, GL_UNSIGNED_INT, indices, instances, b.baseVertex);
+      else
+        gl.DrawArraysInstanced(primitive, static_cast<GLint>(b.firstIndex), count, instances);
+      continue;
+    }
+
+    _batchCounts.push_back(count);
+    _batchFirsts.push_back(indexed ? b.baseVertex : static_cast<GLint>(b.firstIndex));
+    if (indexed) _batchIndices.push_back(indices);
   }
-  return false;
+
+  if (_batchCounts.empty())
+    return;
+
+  auto count = static_cast<GLsizei>(_batchCounts.size());
+  if (indexed)
+    gl.MultiDrawElementsBaseVertex(primitive, _batchCounts.data(), GL_UNSIGNED_INT, _batchIndices.data(), count,
+      _batchFirsts.data());
+  else
+    gl.MultiDrawArrays(primitive, _batchFirsts.data(), _batchCounts.data(), count);
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool context3d::set_uniform(const char *name, const vec2 &value)
+bool context3d::queue_draw(detail::draw_queue::command &cmd)
 {
-  if (!_program) return false;
-  auto id = gl.GetUniformLocation(_program->id(), name);
-  if (id >= 0)
-  {
-    gl.Uniform2fv(id, 1, value.data);
-    return true;      
-  }
-  return false;
+  texture *textures[16];
+  for (size_t i = 0; i < 16; ++i) textures[i] = _textures[i];
+
+  _queue.push(cmd, textures, _geometry, _drawLayer, _drawDepth);
+  return true;
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool context3d::set_uniform(const char *name, const mat4 &value)
+void context3d::set_deferred(bool deferred)
 {
-  if (!_program) return false;
-  auto id = gl.GetUniformLocation(_program->id(), name);
-  if (id >= 0)
-  {
-    gl.UniformMatrix4fv(id, 1, GL_FALSE, value.data);
-    return true;      
-  }
-  return false;
+  if (deferred == _deferred)
+    return;
+
+  flush();
+  _deferred = deferred;
+  if (_deferred)
+    return;
+
+  // nothing was bound while recording, bind the current objects for immediate draws
+  detail::ptr<detail::compiled_program> program = _program;
+  detail::ptr<detail::base_geometry> geometry = _geometry;
+  _program = nullptr;
+  _geometry = nullptr;
+
+  bind(program);
+  bind(geometry);
+  for (int i = 0; i < 16; ++i) bind(_textures[i], i);
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool context3d::set_uniform(const char *name, texture *value)
+void context3d::flush()
 {
-  if (!_program) return false;
-  auto id = gl.GetUniformLocation(_program->id(), name);
-  if (id >= 0)
+  if (_queueFrameIndex != gl_state.frame_index())
   {
-    auto slot = get_free_texture_slot(); if (slot < 0) return false;
-    value->bind(slot);
-    gl.Uniform1i(id, slot);
-    return true;
+    _queueLastFrame = _queueFrame;
+    _queueFrame = queue_stats();
+    _queueFrameIndex = gl_state.frame_index();
   }
-  return false;
+
+  if (_queue.empty())
+    return;
+
+  // the draws are executed through the immediate paths, the recording state is restored afterwards
+  detail::ptr<detail::compiled_program> program = _program;
+  detail::ptr<detail::base_geometry> geometry = _geometry;
+  detail::ptr<texture> textures[16];
+  for (size_t i = 0; i < 16; ++i) textures[i] = _textures[i];
+
+  // so are the selected permutations, the draws select the recorded ones and bind(geom) switches the basic technique
+  std::vector<std::pair<detail::compiled_program *, detail::compiled_program::permutation_id>> permutations;
+  permutations.reserve(_queue.num_programs() + 1);
+  permutations.emplace_back(_basicTechnique, _basicTechnique->permutation());
+  for (uint32_t i = 0; i < _queue.num_programs(); ++i)
+  {
+    auto &entry = _queue.get_program(i);
+    if (entry.program) permutations.emplace_back(entry.program, entry.program->permutation());
+  }
+
+  _deferred = false;
+  _program = nullptr;
+  _geometry = nullptr;
+
+  uint32_t textureSet = static_cast<uint32_t>(-1);
+  for (auto i : _queue.sort(_queueFrame))
+  {
+    auto &cmd = _queue.get_command(i);
+    auto &entry = _queue.get_program(cmd.program);
+
+    if (entry.program) entry.program->select_permutation(entry.permutation);
+    bind(entry.program);
+    bind(_queue.get_geometry(cmd.geometry));
+
+    if (cmd.textures != textureSet)
+    {
+      auto set = _queue.get_textures(cmd.textures);
+      for (int slot = 0; slot < 16; ++slot) bind(set[slot], slot);
+      textureSet = cmd.textures;
+    }
+
+    // uniforms recorded for the placeholder do not apply once the program is ready and the other way around
+    auto active = active_program();
+    auto uniforms = _queue.get_uniforms(cmd.uniforms);
+    for (size_t u = 0; u < cmd.numUniforms; ++u)
+      if (uniforms[u].program == active) uniforms[u].apply(active, uniforms[u].index, uniforms[u].value);
+
+    if (cmd.batchSize)
+    {
+      auto batch = _queue.get_batch(cmd.batch);
+      _batch.assign(batch, batch + cmd.batchSize);
+      draw_batch(cmd.primitive);
+    }
+    else
+      draw_geometry(cmd.primitive, cmd.offset, cmd.length, cmd.numInstances);
+  }
+
+  _queue.clear();
+  for (auto &&p : permutations) p.first->select_permutation(p.second);
+
+  _deferred = true;
+  _program = program;
+  _geometry = geometry;
+  for (size_t i = 0; i < 16; ++i) _textures[i] = textures[i];
 }
 
 //------------------------------------------------------------------------------------------------------------------------
-bool context3d::draw(GLenum primitive, size_t offset, size_t length)
+bool command_buffer::execute(context3d &ctx) const
 {
-  if (!_geometry) return false;
-  
-  auto numElements = _geometry->size_vertices();
-  if (offset >= numElements) return false;
-  
-  if (offset + length > numElements)
-    length = numElements - offset;
-  
-  glDrawArrays(primitive, static_cast<GLint>(offset), static_cast<GLsizei>(length));
-  return true;
+  bool result = true;
+  for (auto cmd = _first; cmd; cmd = cmd->next)
+    result &= cmd->run(ctx, cmd);
+
+  return result;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+void command_buffer::reset()
+{
+  for (auto cmd = _first; cmd; cmd = cmd->next)
+    if (cmd->ref) cmd->ref->unref();
+
+  _arena.reset();
+  _first = _last = nullptr;
+  _numCommands = 0;
 }
 
 }
@@ -1,6 +1,10 @@
 #ifndef __GL2D_H__
 #define __GL2D_H__
 
+#include <cctype>
+#include <cstdarg>
+#include <cstdio>
+
 #include "gl3d.h"
 
 namespace gl3d {
@@ -111,12 +115,38 @@ struct font : public detail::ref_counted
     int x_advance;
   };
 
+  // Characters below dense_range (ASCII and Latin-1) are found with a single array lookup
+  static const int dense_range = 256;
+
   int base;
   int line_height;
-  std::map<int, char_info> char_infos;
-  std::map<uint64_t, int> kernings;
+  std::vector<char_info> char_infos; // sorted by id
   texture::ptr font_texture = new texture();
 
+  const char_info *find_char(int id) const
+  {
+    if (id >= 0 && id < dense_range)
+      return (_dense[id] >= 0) ? &char_infos[_dense[id]] : nullptr;
+
+    auto it = std::lower_bound(char_infos.begin() + _sparseBegin, char_infos.end(), id,
+      [](const char_info &chi, int value) { return chi.id < value; });
+
+    return (it != char_infos.end() && it->id == id) ? &(*it) : nullptr;
+  }
+
+  int kerning(int first, int second) const
+  {
+    if (_kernings.empty() || first <= 0 || second <= 0)
+      return 0;
+
+    uint64_t key = kerning_key(first, second);
+    for (size_t i = kerning_slot(key); ; i = (i + 1) & (_kernings.size() - 1))
+    {
+      if (_kernings[i].key == key) return _kernings[i].amount;
+      if (!_kernings[i].key) return 0;
+    }
+  }
+
 #define GL3D_DATA_EXTRACT(_Type) \
   (*reinterpret_cast<const _Type *>(data)); data = reinterpret_cast<const uint8_t *>(data) + sizeof(_Type)
 
@@ -173,15 +203,42 @@ struct font : public detail::ref_counted
       for (int j = 0; j < 4; ++j)
         chi.uv[j] = vec2(chi.box.corner(j).x / texWidthf, chi.box.corner(j).y / texHeightf);
 
-      char_infos[chi.id] = chi;
+      char_infos.push_back(chi);
     }
 
+    std::stable_sort(char_infos.begin(), char_infos.end(), [](const char_info &a, const char_info &b) { return a.id < b.id; });
+
+    for (auto &&d : _dense) d = -1;
+    for (size_t i = 0; i < char_infos.size(); ++i)
+    {
+      if (char_infos[i].id < 0) continue;
+      if (char_infos[i].id >= dense_range) break;
+      _dense[char_infos[i].id] = static_cast<int>(i);
+      _sparseBegin = i + 1;
+    }
+
+    // kept at most half full, so every probe sequence ends on an empty slot
     int numKernings = GL3D_DATA_EXTRACT(int);
+    if (numKernings > 0)
+    {
+      size_t numSlots = 16;
+      while (numSlots < static_cast<size_t>(numKernings) * 2) numSlots *= 2;
+      _kernings.resize(numSlots);
+    }
+
     for (int i = 0; i < numKernings; ++i)
     {
-      uint64_t first = static_cast<uint64_t> GL3D_DATA_EXTRACT(int);
-      uint64_t second = static_cast<uint64_t> GL3D_DATA_EXTRACT(int);
-      kernings[first | (second << 32ull)] = GL3D_DATA_EXTRACT(int8_t);
+      int first = GL3D_DATA_EXTRACT(int);
+      int second = GL3D_DATA_EXTRACT(int);
+      int amount = GL3D_DATA_EXTRACT(int8_t);
+      if (first <= 0 || second <= 0) continue;
+
+      uint64_t key = kerning_key(first, second);
+      size_t slot = kerning_slot(key);
+      while (_kernings[slot].key && _kernings[slot].key != key) slot = (slot + 1) & (_kernings.size() - 1);
+
+      _kernings[slot].key = key;
+      _kernings[slot].amount = amount;
     }
   }
 
@@ -189,6 +246,27 @@ struct font : public detail::ref_counted
 
   font(const std::vector<uint8_t> &bytes): font(bytes.data(), bytes.size()) { }
   font(const char *base64Data): font(base64_decode(base64Data)) { }
+
+private:
+  struct kerning_entry
+  {
+    uint64_t key = 0; // 0 marks an empty slot, character ids are always positive
+    int amount = 0;
+  };
+
+  static uint64_t kerning_key(int first, int second)
+  {
+    return static_cast<uint64_t>(static_cast<uint32_t>(first)) | (static_cast<uint64_t>(static_cast<uint32_t>(second)) << 32ull);
+  }
+
+  size_t kerning_slot(uint64_t key) const
+  {
+    return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 32ull) & (_kernings.size() - 1);
+  }
+
+  int _dense[dense_range];   // index into char_infos or -1
+  size_t _sparseBegin = 0;   // first char_info with id >= dense_range
+  std::vector<kerning_entry> _kernings;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -204,10 +282,11 @@ struct vertex2d : layout<vec2, vec4, vec2>
 
 struct draw_call
 {
-  bool triangles; // true for triangles, false for lines
+  bool triangles; // true for indexed quads, false for lines
+  size_t start;   // first vertex, always a multiple of 4 for quads
   size_t length;  // number of vertices
 
-  draw_call(bool tris, size_t len): triangles(tris), length(len) { }
+  draw_call(bool tris, size_t first, size_t len): triangles(tris), start(first), length(len) { }
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -217,14 +296,73 @@ struct state
   ibox2 viewport;
   ibox2 scissors;
   vec4 color;
-  texture::ptr texture;
-  font::ptr font;
+  gl3d::texture::ptr texture;
+  detail::font::ptr font;
 };
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Writes 4 vertices per printed character (at most length * 4) and returns the number of vertices written,
+// ^0 - ^f switch the color
+size_t layout_text(const font *f, const vec2 &pos, const vec4 &color, const char *text, size_t length, vertex2d *output);
+size_t layout_substring(const font *f, float &x, float &y, const vec4 &color, const char *text, size_t length, vertex2d *output);
+
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Text laid out once and drawn with a plain copy of its vertices, until the text, font or color changes
+class text_mesh : public detail::compiled_object
+{
+public:
+  typedef detail::ptr<text_mesh> ptr;
+
+  text_mesh() { }
+  text_mesh(const char *text, const vec4 &color = vec4::one()): _text(text ? text : ""), _color(color) { }
+
+  const std::string &text() const { return _text; }
+  void set_text(const char *text)
+  {
+    if (!text) text = "";
+    if (_text != text) { _text = text; set_dirty(); }
+  }
+
+  void set_textf(const char *fmt, ...)
+  {
+    char buff[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int length = vsnprintf(buff, sizeof(buff), fmt, ap);
+    va_end(ap);
+    set_text(length > 0 ? buff : "");
+  }
+
+  // Null uses the current font of the context it gets drawn with
+  detail::font *font() const { return _font; }
+  void set_font(detail::font *f) { if (_font != f) { _font = f; set_dirty(); } }
+
+  const vec4 &color() const { return _color; }
+  void set_color(const vec4 &c)
+  {
+    if (c.x != _color.x || c.y != _color.y || c.z != _color.z || c.w != _color.w) { _color = c; set_dirty(); }
+  }
+
+  // Vertices placed at pos, laid out again only when dirty or drawn with another font, moving it just offsets them
+  const std::vector<detail::vertex2d> &vertices(const detail::font *f, const vec2 &pos);
+
+protected:
+  virtual ~text_mesh() { }
+
+  std::string _text;
+  detail::font::ptr _font;
+  vec4 _color = vec4::one();
+  detail::ptr<const detail::font> _layoutFont; // held, so another font allocated at its address cannot match
+  vec2 _layoutPos;
+  std::vector<detail::vertex2d> _vertices;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 class context2d
 {
 public:
@@ -249,7 +387,7 @@ public:
     _context3d.clear();
     _geometry->clear();
     _drawCalls.clear();
-    _drawCalls.emplace_back(true, 0);
+    _drawCalls.emplace_back(true, 0, 0);
     _state.color = vec4::one();
   }
 
@@ -266,7 +404,7 @@ public:
     if (!_drawCalls.back().triangles)
       _drawCalls.back().length += 2;
     else
-      _drawCalls.emplace_back(false, 2);
+      _drawCalls.emplace_back(false, _geometry->size_vertices(), 2);
     
     auto *v = _geometry->alloc_vertices(2);
     v->pos = a;
@@ -286,12 +424,7 @@ public:
   {
     if (filled)
     {
-      if (_drawCalls.back().triangles)
-        _drawCalls.back().length += 6;
-      else
-        _drawCalls.emplace_back(true, 6);
-      
-      auto *v = _geometry->alloc_vertices(6);
+      auto *v = alloc_quads(1);
       v->pos = a;
       v->color = _state.color;
       v->uv = vec2(1, 1);
@@ -300,15 +433,11 @@ public:
       v->color = _state.color;
       v->uv = vec2(1, 1);
       ++v;
-      v->pos = vec2(a.x, b.y);
+      v->pos = vec2(b.x, b.y);
       v->color = _state.color;
       v->uv = vec2(1, 1);
-      
-      v[1] = *v;
-      v[2] = v[-1];
-      v += 3;
-
-      v->pos = vec2(b.x, b.y);
+      ++v;
+      v->pos = vec2(a.x, b.y);
       v->color = _state.color;
       v->uv = vec2(1, 1);
     }
@@ -331,65 +460,23 @@ public:
     if (!fmt || !(*fmt)) return;
 
     char buff[1024];
-    size_t length = static_cast<size_t>(vsnprintf(buff, 1024, fmt, ap));
-    if (!length) return;
+    int length = vsnprintf(buff, 1024, fmt, ap);
+    if (length <= 0) return;
 
-    float x = pos.x;
-    float y = pos.y;
-    const char *text = buff;
-    const char *end = text + length;
-    vec4 color = _state.color;
-
-    while (text < end)
-    {
-      const char *mark = strchr(text, '^');
-    
-      if (!mark)
-        mark = end;
-
-      int partLen = static_cast<int>(mark - text);
+    size_t numChars = minimum(static_cast<size_t>(length), sizeof(buff) - 1);
+    size_t written = detail::layout_text(_state.font, pos, _state.color, buff, numChars, alloc_quads(numChars));
+    pop_quads(numChars - written / 4);
+  }
 
-      if (partLen)
-        print_substring(x, y, color, text, partLen);
+  // Draws a cached text, costs a copy of its vertices as long as the text does not change
+  void text(const vec2 &pos, text_mesh *mesh)
+  {
+    if (!mesh) return;
 
-      if (mark[0] == '^')
-      {
-        static const char *colorString = "0123456789abcdef";
-        const char *colorChar = strchr(colorString, tolower(mark[1]));
-      
-        if (colorChar)
-        {
-          const float q = 0.25f;
-          const float h = 0.5f;
-
-          switch (*colorChar)
-          {
-            case '0': color = vec4(0xFF000000); break;
-            case '1': color = vec4(0xFF000080); break;
-            case '2': color = vec4(0xFF008000); break;
-            case '3': color = vec4(0xFF008080); break;
-            case '4': color = vec4(0xFF800000); break;
-            case '5': color = vec4(0xFF800080); break;
-            case '6': color = vec4(0xFF808000); break;
-            case '7': color = vec4(0xFF404040); break;
-            case '8': color = vec4(0xFF808080); break;
-            case '9': color = vec4(0xFF4080FF); break;
-            case 'a': color = vec4(0xFF40FF40); break;
-            case 'b': color = vec4(0xFF40FFFF); break;
-            case 'c': color = vec4(0xFFFF8040); break;
-            case 'd': color = vec4(0xFFFF40FF); break;
-            case 'e': color = vec4(0xFFFFFF40); break;
-
-            default:
-            case 'f': color = vec4(0xFFFFFFFF); break;
-          }
-        }
-        else
-          ++partLen;
-      }
+    auto &vertices = mesh->vertices(mesh->font() ? mesh->font() : static_cast<detail::font *>(_state.font), pos);
+    if (vertices.empty()) return;
 
-      text = mark + 2;
-    }
+    memcpy(alloc_quads(vertices.size() / 4), vertices.data(), vertices.size() * sizeof(detail::vertex2d));
   }
 
   void text(float x, float y, const char *fmt, ...)
@@ -414,23 +501,28 @@ public:
 
     _context3d.clear();
 
-    glViewport(x, y, width, height);
-    glDisable(GL_DEPTH_TEST);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    gl_state.set_viewport(x, y, width, height);
+    gl_state.set_enabled(GL_DEPTH_TEST, false);
+    gl_state.set_enabled(GL_BLEND, true);
+    gl_state.set_blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     _context3d.bind(_geometry);
     _context3d.bind(_technique);
     _context3d.set_uniform("u_ScreenSize", vec2(width, height));
     _context3d.set_uniform("u_FontTexture", _state.font->font_texture);
 
-    size_t startVertex = 0;
+    update_quad_indices();
+    _quadIndices->bind(gl.ELEMENT_ARRAY_BUFFER);
+    size_t indexSize = (_quadIndexType == GL_UNSIGNED_SHORT) ? sizeof(uint16_t) : sizeof(uint32_t);
+
     for (auto &&dc : _drawCalls)
     {
       if (!dc.length) continue;
 
-      glDrawArrays(dc.triangles ? GL_TRIANGLES : GL_LINES, static_cast<GLint>(startVertex), static_cast<GLsizei>(dc.length));
-      startVertex += dc.length;
+      if (dc.triangles)
+        glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(dc.length / 4 * 6), _quadIndexType, reinterpret_cast<const GLvoid *>(dc.start / 4 * 6 * indexSize));
+      else
+        glDrawArrays(GL_LINES, static_cast<GLint>(dc.start), static_cast<GLsizei>(dc.length));
     }
 
     clear(); 
@@ -439,13 +531,37 @@ public:
   void render(int width, int height) { render(0, 0, width, height); }
 
 private:
-  void print_substring(float &x, float &y, const vec4 &color, const char *text, size_t length);
+  // Allocates vertices for quads, each quad is 4 vertices drawn with the shared quad index buffer
+  detail::vertex2d *alloc_quads(size_t count)
+  {
+    if (!_drawCalls.back().triangles)
+    {
+      size_t start = _geometry->size_vertices();
+      _geometry->alloc_vertices((4 - start % 4) % 4);
+      _drawCalls.emplace_back(true, _geometry->size_vertices(), 0);
+    }
+
+    _drawCalls.back().length += count * 4;
+    return _geometry->alloc_vertices(count * 4);
+  }
+
+  // Gives back unused quads from the end of the last alloc_quads
+  void pop_quads(size_t count)
+  {
+    _geometry->pop_vertices(count * 4);
+    _drawCalls.back().length -= count * 4;
+  }
+
+  void update_quad_indices();
 
   bool _initialized = false;
   detail::state _state;
   context3d _context3d;
   detail::ptr<technique> _technique = new technique();
-  detail::ptr<custom_geometry<detail::vertex2d>> _geometry = new custom_geometry<detail::vertex2d>();
+  detail::ptr<custom_geometry<detail::vertex2d>> _geometry = new custom_geometry<detail::vertex2d>(true);
+  detail::ptr<detail::buffer> _quadIndices = new detail::buffer();
+  size_t _quadCapacity = 0;
+  GLenum _quadIndexType = GL_UNSIGNED_SHORT;
   std::vector<detail::draw_call> _drawCalls;
 };
 
@@ -463,8 +579,8 @@ extern detail::font *monospace_font;
 #define __GL3D_2D_H_IMPL__
 namespace gl3d {
 
-static detail::font *default_font = nullptr;
-static detail::font *monospace_font = nullptr;
+detail::font *default_font = nullptr;
+detail::font *monospace_font = nullptr;
 
 //---------------------------------------------------------------------------------------------------------------------
 static const char *default_font_base64 =
@@ -541,26 +657,78 @@ void context2d::done()
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-void context2d::print_substring(float &x, float &y, const vec4 &color, const char *text, size_t length)
+size_t detail::layout_text(const font *f, const vec2 &pos, const vec4 &color, const char *text, size_t length, vertex2d *output)
 {
-  auto f = _state.font;
-  if (!f) return;
+  if (!f) return 0;
 
-  if (_drawCalls.back().triangles)
-    _drawCalls.back().length += length * 6;
-  else
-    _drawCalls.emplace_back(true, length * 6);
+  float x = pos.x;
+  float y = pos.y;
+  const char *end = text + length;
+  vec4 currentColor = color;
+  size_t written = 0;
 
-  size_t skippedChars = 0;
-  auto *v = _geometry->alloc_vertices(length * 6);
-  uint64_t prevID = 0;
+  while (text < end)
+  {
+    const char *mark = static_cast<const char *>(memchr(text, '^', end - text));
+    
+    if (!mark)
+      mark = end;
+
+    size_t partLen = static_cast<size_t>(mark - text);
+
+    if (partLen)
+      written += layout_substring(f, x, y, currentColor, text, partLen, output + written);
+
+    if (mark < end && mark + 1 < end)
+    {
+      static const char *colorString = "0123456789abcdef";
+      const char *colorChar = strchr(colorString, tolower(mark[1]));
+      
+      if (colorChar && *colorChar)
+      {
+        switch (*colorChar)
+        {
+          case '0': currentColor = vec4(0xFF000000); break;
+          case '1': currentColor = vec4(0xFF000080); break;
+          case '2': currentColor = vec4(0xFF008000); break;
+          case '3': currentColor = vec4(0xFF008080); break;
+          case '4': currentColor = vec4(0xFF800000); break;
+          case '5': currentColor = vec4(0xFF800080); break;
+          case '6': currentColor = vec4(0xFF808000); break;
+          case '7': currentColor = vec4(0xFF404040); break;
+          case '8': currentColor = vec4(0xFF808080); break;
+          case '9': currentColor = vec4(0xFF4080FF); break;
+          case 'a': currentColor = vec4(0xFF40FF40); break;
+          case 'b': currentColor = vec4(0xFF40FFFF); break;
+          case 'c': currentColor = vec4(0xFFFF8040); break;
+          case 'd': currentColor = vec4(0xFFFF40FF); break;
+          case 'e': currentColor = vec4(0xFFFFFF40); break;
+
+          default:
+          case 'f': currentColor = vec4(0xFFFFFFFF); break;
+        }
+      }
+    }
+
+    text = mark + 2;
+  }
+
+  return written;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t detail::layout_substring(const font *f, float &x, float &y, const vec4 &color, const char *text, size_t length, vertex2d *output)
+{
+  auto *v = output;
+  int prevID = 0;
 
   while (length)
   {
-    auto &chi = f->char_infos[*text];
-    if (chi.id > 0)
+    auto chp = f->find_char(static_cast<uint8_t>(*text));
+    if (chp && chp->id > 0)
     {
-      int ker = f->kernings[prevID | (static_cast<uint64_t>(chi.id) << 32ull)];
+      auto &chi = *chp;
+      int ker = f->kerning(prevID, chi.id);
       float ox = x + static_cast<float>(chi.offset.x + ker);
       float oy = y + static_cast<float>(chi.offset.y);
 
@@ -576,27 +744,75 @@ void context2d::print_substring(float &x, float &y, const vec4 &color, const cha
       v->color = color;
       v->uv = chi.uv[2];
       ++v; // 3
-      v[0] = v[-1];
-      ++v; // 4
       v->pos = vec2(ox, oy + chi.size.y);
       v->color = color;
       v->uv = chi.uv[3];
-      ++v; // 5
-      v[0] = v[-5];
       ++v;
 
       x += static_cast<float>(chi.x_advance + ker);
+      prevID = chi.id;
     }
     else
-      ++skippedChars;
+      prevID = 0;
 
-    prevID = static_cast<uint64_t>(chi.id);
     ++text;
     --length;
   }
 
-  _geometry->pop_vertices(skippedChars * 6);
-  _drawCalls.back().length -= skippedChars * 6;
+  return static_cast<size_t>(v - output);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+const std::vector<detail::vertex2d> &text_mesh::vertices(const detail::font *f, const vec2 &pos)
+{
+  if (dirty() || f != _layoutFont)
+  {
+    _vertices.resize(_text.size() * 4);
+    _vertices.resize(detail::layout_text(f, pos, _color, _text.data(), _text.size(), _vertices.data()));
+    _layoutFont = f;
+    _layoutPos = pos;
+    set_dirty(false);
+  }
+  else if (pos.x != _layoutPos.x || pos.y != _layoutPos.y)
+  {
+    vec2 delta = pos - _layoutPos;
+    for (auto &&v : _vertices) v.pos = v.pos + delta;
+    _layoutPos = pos;
+  }
+
+  return _vertices;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void context2d::update_quad_indices()
+{
+  size_t numQuads = _geometry->size_vertices() / 4;
+  if (numQuads <= _quadCapacity)
+    return;
+
+  _quadCapacity = maximum(numQuads, _quadCapacity * 2, static_cast<size_t>(1024));
+  _quadIndexType = (_quadCapacity * 4 <= 0x10000) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
+  // 0 1 2, 2 3 0 for every quad
+  size_t numIndices = _quadCapacity * 6;
+  if (_quadIndexType == GL_UNSIGNED_SHORT)
+  {
+    auto data = static_cast<uint16_t *>(_quadIndices->alloc_data(nullptr, numIndices * sizeof(uint16_t)));
+    for (size_t i = 0, v = 0; i < numIndices; i += 6, v += 4)
+    {
+      data[i + 0] = static_cast<uint16_t>(v + 0); data[i + 1] = static_cast<uint16_t>(v + 1); data[i + 2] = static_cast<uint16_t>(v + 2);
+      data[i + 3] = static_cast<uint16_t>(v + 2); data[i + 4] = static_cast<uint16_t>(v + 3); data[i + 5] = static_cast<uint16_t>(v + 0);
+    }
+  }
+  else
+  {
+    auto data = static_cast<uint32_t *>(_quadIndices->alloc_data(nullptr, numIndices * sizeof(uint32_t)));
+    for (size_t i = 0, v = 0; i < numIndices; i += 6, v += 4)
+    {
+      data[i + 0] = static_cast<uint32_t>(v + 0); data[i + 1] = static_cast<uint32_t>(v + 1); data[i + 2] = static_cast<uint32_t>(v + 2);
+      data[i + 3] = static_cast<uint32_t>(v + 2); data[i + 4] = static_cast<uint32_t>(v + 3); data[i + 5] = static_cast<uint32_t>(v + 0);
+    }
+  }
 }
 
 
@@ -0,0 +1,423 @@
+#ifndef __GL3D_HEADLESS_H__
+#define __GL3D_HEADLESS_H__
+
+#include <chrono>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#if !defined(GL3D_GET_PROC_ADDRESS)
+#define GL3D_GET_PROC_ADDRESS(name) eglGetProcAddress(name)
+#endif
+
+#include "gl3d_window.h"
+
+// Headless backend, windows are offscreen EGL pbuffers and never shown. Prefers Mesa's surfaceless platform, so it runs
+// on machines without GPU or display (llvmpipe). Link with EGL and GL.
+
+namespace gl3d {
+
+// Reads back the current content of a window as RGBA8, rows from top to bottom
+bool window_read_pixels(std::vector<uint8_t> &rgba, window_id_t id = main_window_id);
+
+// run() returns after this many frames, 0 keeps running until the main window gets closed
+void set_max_frames(size_t count);
+
+size_t frame_count();
+
+}
+
+#endif // __GL3D_HEADLESS_H__
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef GL3D_IMPLEMENTATION
+#ifndef __GL3D_HEADLESS_H_IMPL__
+#define __GL3D_HEADLESS_H_IMPL__
+
+#if !defined(EGL_PLATFORM_SURFACELESS_MESA)
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+namespace gl3d {
+
+context2d *current_context2d = nullptr;
+context3d *current_context3d = nullptr;
+event_handler_t event_handler;
+tick_handler_t tick_handler;
+
+bool g_should_quit = false;
+window_id_t g_next_id = 0;
+
+size_t g_max_frames = 0;
+size_t g_frame_count = 0;
+
+std::chrono::steady_clock::time_point g_timer_start = std::chrono::steady_clock::now();
+double g_time = 0.0;
+double g_delta = 0.0;
+
+//---------------------------------------------------------------------------------------------------------------------
+float time() { return static_cast<float>(g_time); }
+double timed() { return g_time; }
+float delta() { return static_cast<float>(g_delta); }
+double deltad() { return g_delta; }
+
+void set_max_frames(size_t count) { g_max_frames = count; }
+size_t frame_count() { return g_frame_count; }
+
+//---------------------------------------------------------------------------------------------------------------------
+struct egl_display
+{
+  EGLDisplay display = EGL_NO_DISPLAY;
+  EGLConfig config = nullptr;
+
+  bool init()
+  {
+    if (display != EGL_NO_DISPLAY)
+      return config != nullptr;
+
+    auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    if (getPlatformDisplay)
+      display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+
+    if (display == EGL_NO_DISPLAY)
+      display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API))
+      return false;
+
+    const EGLint attribs[] =
+    {
+      EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+      EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+      EGL_DEPTH_SIZE, 24, EGL_STENCIL_SIZE, 8,
+      EGL_NONE
+    };
+
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(display, attribs, &config, 1, &numConfigs) || !numConfigs)
+      config = nullptr;
+
+    return config != nullptr;
+  }
+
+  ~egl_display()
+  {
+    if (display != EGL_NO_DISPLAY)
+      eglTerminate(display);
+  }
+} g_egl;
+
+//---------------------------------------------------------------------------------------------------------------------
+// Declared before the 2D/3D contexts in window, so it outlives their GL objects
+struct egl_target
+{
+  EGLSurface surface = EGL_NO_SURFACE;
+  EGLContext context = EGL_NO_CONTEXT;
+
+  bool create_surface(int width, int height)
+  {
+    const EGLint attribs[] = { EGL_WIDTH, maximum(width, 1), EGL_HEIGHT, maximum(height, 1), EGL_NONE };
+    surface = eglCreatePbufferSurface(g_egl.display, g_egl.config, attribs);
+    return surface != EGL_NO_SURFACE;
+  }
+
+  ~egl_target()
+  {
+    if (eglGetCurrentContext() == context)
+      eglMakeCurrent(g_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+    if (context != EGL_NO_CONTEXT) eglDestroyContext(g_egl.display, context);
+    if (surface != EGL_NO_SURFACE) eglDestroySurface(g_egl.display, surface);
+  }
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+struct window
+{
+  window_id_t id;
+  std::string title;
+  egl_target target;
+  int width, height;
+  context2d ctx2d;
+  context3d ctx3d;
+  int mouse_x = 0, mouse_y = 0;
+  int mouse_dx = 0, mouse_dy = 0;
+
+  window(window_id_t win_id, const std::string &win_title, int win_width, int win_height, unsigned flags = default_window_flags);
+
+  virtual ~window();
+
+  bool valid() const { return target.context != EGL_NO_CONTEXT; }
+
+  void make_current();
+  void flip();
+  void set_title(const std::string &text);
+  void set_size(int w, int h);
+
+  void fill_mouse_event(event &e)
+  {
+    e.mouse.x = mouse_x;
+    e.mouse.y = mouse_y;
+    e.mouse.dx = mouse_dx;
+    e.mouse.dy = mouse_dy;
+  }
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+typedef std::map<window_id_t, std::unique_ptr<window>> windows_t;
+windows_t g_windows;
+
+//---------------------------------------------------------------------------------------------------------------------
+void run()
+{
+  while (!g_should_quit)
+  {
+    tick();
+
+    if (g_max_frames && g_frame_count >= g_max_frames)
+      break;
+  }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+window_id_t window_open(const std::string &title, int width, int height, unsigned flags)
+{
+  auto id = g_next_id++;
+  auto w = std::make_unique<window>(id, title, width, height, flags);
+
+  if (!w->valid() || !w->ctx2d.init())
+    return invalid_window_id;
+
+  g_windows[id] = std::move(w);
+  return id;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool window_close(window_id_t id)
+{
+  auto iter = g_windows.find(id);
+  if (iter != g_windows.end())
+  {
+    send({ event_type::close, iter->second->id });
+    g_windows.erase(iter);
+    g_should_quit |= id == main_window_id || g_windows.empty();
+    return true;
+  }
+  return false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void set_window_title(const std::string &text, window_id_t id)
+{
+  auto iter = g_windows.find(id);
+  if (iter != g_windows.end())
+    iter->second->set_title(text);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+const std::string &window_title(window_id_t id)
+{
+  auto iter = g_windows.find(id);
+  if (iter != g_windows.end())
+    return iter->second->title;
+
+  static const std::string empty_title = "";
+  return empty_title;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void set_window_size(int width, int height, window_id_t id)
+{
+  auto iter = g_windows.find(id);
+  if (iter != g_windows.end())
+    iter->second->set_size(width, height);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+ivec2 get_window_size(window_id_t id)
+{
+  auto iter = g_windows.find(id);
+  if (iter != g_windows.end())
+    return ivec2(iter->second->width, iter->second->height);
+
+  return ivec2();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool window_read_pixels(std::vector<uint8_t> &rgba, window_id_t id)
+{
+  auto iter = g_windows.find(id);
+  if (iter == g_windows.end())
+    return false;
+
+  auto &w = *iter->second;
+  w.make_current();
+
+  size_t rowSize = static_cast<size_t>(w.width) * 4;
+  rgba.resize(rowSize * w.height);
+
+  gl_state.bind_buffer(gl.PIXEL_PACK_BUFFER, 0);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, w.width, w.height, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
+
+  // GL rows go bottom to top
+  std::vector<uint8_t> row(rowSize);
+  for (int y = 0; y < w.height / 2; ++y)
+  {
+    auto top = rgba.data() + y * rowSize;
+    auto bottom = rgba.data() + (w.height - 1 - y) * rowSize;
+    memcpy(row.data(), top, rowSize);
+    memcpy(top, bottom, rowSize);
+    memcpy(bottom, row.data(), rowSize);
+  }
+
+  return glGetError() == GL_NO_ERROR;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+window::window(window_id_t win_id, const std::string &title, int width, int height, unsigned)
+  : id(win_id)
+  , title(title)
+  , width(width)
+  , height(height)
+{
+  if (!g_egl.init() || !target.create_surface(width, height))
+    return;
+
+  const EGLint attribs[] =
+  {
+    EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+    EGL_CONTEXT_MINOR_VERSION_KHR, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+    EGL_NONE
+  };
+
+  target.context = eglCreateContext(g_egl.display, g_egl.config, EGL_NO_CONTEXT, attribs);
+  if (!valid())
+    return;
+
+  make_current();
+  ctx2d.init();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+window::~window()
+{
+  // GL objects of the contexts get released after this, they need the context current
+  if (valid())
+    make_current();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void window::make_current()
+{
+  if (eglGetCurrentContext() != target.context || eglGetCurrentSurface(EGL_DRAW) != target.surface)
+  {
+    eglMakeCurrent(g_egl.display, target.surface, target.surface, target.context);
+    gl_state.invalidate();
+  }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void window::flip()
+{
+  // pbuffers are single buffered, finishing the frame keeps frame times honest for benchmarks
+  glFinish();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void window::set_title(const std::string &text)
+{
+  title = text;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void window::set_size(int w, int h)
+{
+  if ((width == w && height == h) || !valid())
+    return;
+
+  // pbuffers cannot be resized, the new one replaces the old one in make_current
+  EGLSurface oldSurface = target.surface;
+  if (!target.create_surface(w, h))
+  {
+    target.surface = oldSurface;
+    return;
+  }
+
+  width = w;
+  height = h;
+  make_current();
+  eglDestroySurface(g_egl.display, oldSurface);
+
+  event e(event_type::resize, id);
+  e.resize.width = w;
+  e.resize.height = h;
+  send(e);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void update_timer()
+{
+  double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - g_timer_start).count();
+  g_delta = now - g_time;
+  g_time = now;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void send(const event &e)
+{
+  if (event_handler != nullptr)
+    event_handler(e);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void tick()
+{
+  update_timer();
+
+  if (tick_handler != nullptr)
+  {
+    // the 2D context records into buffers of the main window's GL context, which has to be current for that
+    auto iter = g_windows.find(main_window_id);
+    if (iter != g_windows.end())
+    {
+      iter->second->make_current();
+      current_context2d = &(iter->second->ctx2d);
+    }
+    else
+      current_context2d = nullptr;
+
+    current_context3d = nullptr;
+    tick_handler();
+  }
+
+  for (auto &kvp : g_windows)
+  {
+    auto &w = *kvp.second;
+
+    w.make_current();
+    current_context2d = &(w.ctx2d);
+    current_context3d = &(w.ctx3d);
+    current_context3d->set_backbuffer_size(w.width, w.height);
+    current_context3d->clear();
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    send({ event_type::paint, w.id });
+    current_context3d->flush();
+    current_context3d->bind(static_cast<render_target *>(nullptr));
+    w.ctx2d.render(w.width, w.height);
+    w.flip();
+  }
+
+  ++g_frame_count;
+  gl_state.end_frame();
+  current_context2d = nullptr;
+  current_context3d = nullptr;
+}
+
+}
+
+#endif // __GL3D_HEADLESS_H_IMPL__
+#endif // GL3D_IMPLEMENTATION
@@ -1,9 +1,364 @@
 #pragma once
 
+#include <cmath>
+#include <thread>
+#include <vector>
+
+// SIMD backend used by the float matrix kernels, can be forced by defining one of these before including
+#if !defined(GL3D_SIMD_SSE) && !defined(GL3D_SIMD_NEON) && !defined(GL3D_SIMD_NONE)
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GL3D_SIMD_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define GL3D_SIMD_NEON
+#else
+#define GL3D_SIMD_NONE
+#endif
+#endif
+
+#if defined(GL3D_SIMD_SSE)
+#include <emmintrin.h>
+#if defined(__AVX__) && !defined(GL3D_SIMD_AVX)
+#define GL3D_SIMD_AVX
+#endif
+#if defined(GL3D_SIMD_AVX)
+#include <immintrin.h>
+#endif
+#elif defined(GL3D_SIMD_NEON)
+#include <arm_neon.h>
+#endif
+
 namespace gl3d {
 
 namespace detail {
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma region SIMD
+
+//---------------------------------------------------------------------------------------------------------------------
+// Thin 4-float vector abstraction, shuffle<X, Y, Z, W>(a, b) follows _mm_shuffle_ps: { a[X], a[Y], b[Z], b[W] }
+#if defined(GL3D_SIMD_SSE)
+
+typedef __m128 simd4f;
+
+inline simd4f simd_load(const float *p) { return _mm_loadu_ps(p); }
+inline void simd_store(float *p, simd4f v) { _mm_storeu_ps(p, v); }
+inline simd4f simd_set(float x, float y, float z, float w) { return _mm_setr_ps(x, y, z, w); }
+inline simd4f simd_splat(float v) { return _mm_set1_ps(v); }
+inline simd4f simd_add(simd4f a, simd4f b) { return _mm_add_ps(a, b); }
+inline simd4f simd_sub(simd4f a, simd4f b) { return _mm_sub_ps(a, b); }
+inline simd4f simd_mul(simd4f a, simd4f b) { return _mm_mul_ps(a, b); }
+inline simd4f simd_div(simd4f a, simd4f b) { return _mm_div_ps(a, b); }
+inline float simd_x(simd4f v) { return _mm_cvtss_f32(v); }
+
+template <int X, int Y, int Z, int W> inline simd4f simd_shuffle(simd4f a, simd4f b)
+{ return _mm_shuffle_ps(a, b, _MM_SHUFFLE(W, Z, Y, X)); }
+
+#elif defined(GL3D_SIMD_NEON)
+
+typedef float32x4_t simd4f;
+
+inline simd4f simd_load(const float *p) { return vld1q_f32(p); }
+inline void simd_store(float *p, simd4f v) { vst1q_f32(p, v); }
+inline simd4f simd_set(float x, float y, float z, float w) { float v[4] = { x, y, z, w }; return vld1q_f32(v); }
+inline simd4f simd_splat(float v) { return vdupq_n_f32(v); }
+inline simd4f simd_add(simd4f a, simd4f b) { return vaddq_f32(a, b); }
+inline simd4f simd_sub(simd4f a, simd4f b) { return vsubq_f32(a, b); }
+inline simd4f simd_mul(simd4f a, simd4f b) { return vmulq_f32(a, b); }
+#if defined(__aarch64__) || defined(_M_ARM64)
+inline simd4f simd_div(simd4f a, simd4f b) { return vdivq_f32(a, b); }
+#else
+// ARMv7 NEON has no divide, the reciprocal estimate is refined with two Newton-Raphson steps
+inline simd4f simd_div(simd4f a, simd4f b)
+{
+  float32x4_t r = vrecpeq_f32(b);
+  r = vmulq_f32(r, vrecpsq_f32(b, r));
+  r = vmulq_f32(r, vrecpsq_f32(b, r));
+  return vmulq_f32(a, r);
+}
+#endif
+inline float simd_x(simd4f v) { return vgetq_lane_f32(v, 0); }
+
+template <int X, int Y, int Z, int W> inline simd4f simd_shuffle(simd4f a, simd4f b)
+{ return simd_set(vgetq_lane_f32(a, X), vgetq_lane_f32(a, Y), vgetq_lane_f32(b, Z), vgetq_lane_f32(b, W)); }
+
+#else
+
+struct simd4f { float v[4]; };
+
+inline simd4f simd_load(const float *p) { return { { p[0], p[1], p[2], p[3] } }; }
+inline void simd_store(float *p, simd4f v) { p[0] = v.v[0]; p[1] = v.v[1]; p[2] = v.v[2]; p[3] = v.v[3]; }
+inline simd4f simd_set(float x, float y, float z, float w) { return { { x, y, z, w } }; }
+inline simd4f simd_splat(float v) { return { { v, v, v, v } }; }
+inline simd4f simd_add(simd4f a, simd4f b) { return { { a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3] } }; }
+inline simd4f simd_sub(simd4f a, simd4f b) { return { { a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3] } }; }
+inline simd4f simd_mul(simd4f a, simd4f b) { return { { a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3] } }; }
+inline simd4f simd_div(simd4f a, simd4f b) { return { { a.v[0] / b.v[0], a.v[1] / b.v[1], a.v[2] / b.v[2], a.v[3] / b.v[3] } }; }
+inline float simd_x(simd4f v) { return v.v[0]; }
+
+template <int X, int Y, int Z, int W> inline simd4f simd_shuffle(simd4f a, simd4f b)
+{ return { { a.v[X], a.v[Y], b.v[Z], b.v[W] } }; }
+
+#endif
+
+template <int I> inline simd4f simd_lane(simd4f v) { return simd_shuffle<I, I, I, I>(v, v); }
+template <int X, int Y, int Z, int W> inline simd4f simd_swizzle(simd4f v) { return simd_shuffle<X, Y, Z, W>(v, v); }
+
+//---------------------------------------------------------------------------------------------------------------------
+// Column-major 4x4 float kernels, all pointers may alias and need no particular alignment
+inline void simd_mat4_mul(float *r, const float *a, const float *b)
+{
+  simd4f a0 = simd_load(a), a1 = simd_load(a + 4), a2 = simd_load(a + 8), a3 = simd_load(a + 12);
+
+#if defined(GL3D_SIMD_AVX)
+  __m256 a0x2 = _mm256_insertf128_ps(_mm256_castps128_ps256(a0), a0, 1);
+  __m256 a1x2 = _mm256_insertf128_ps(_mm256_castps128_ps256(a1), a1, 1);
+  __m256 a2x2 = _mm256_insertf128_ps(_mm256_castps128_ps256(a2), a2, 1);
+  __m256 a3x2 = _mm256_insertf128_ps(_mm256_castps128_ps256(a3), a3, 1);
+  __m256 b01 = _mm256_loadu_ps(b), b23 = _mm256_loadu_ps(b + 8);
+
+  __m256 r01 = _mm256_mul_ps(a0x2, _mm256_permute_ps(b01, 0x00));
+  r01 = _mm256_add_ps(r01, _mm256_mul_ps(a1x2, _mm256_permute_ps(b01, 0x55)));
+  r01 = _mm256_add_ps(r01, _mm256_mul_ps(a2x2, _mm256_permute_ps(b01, 0xAA)));
+  r01 = _mm256_add_ps(r01, _mm256_mul_ps(a3x2, _mm256_permute_ps(b01, 0xFF)));
+
+  __m256 r23 = _mm256_mul_ps(a0x2, _mm256_permute_ps(b23, 0x00));
+  r23 = _mm256_add_ps(r23, _mm256_mul_ps(a1x2, _mm256_permute_ps(b23, 0x55)));
+  r23 = _mm256_add_ps(r23, _mm256_mul_ps(a2x2, _mm256_permute_ps(b23, 0xAA)));
+  r23 = _mm256_add_ps(r23, _mm256_mul_ps(a3x2, _mm256_permute_ps(b23, 0xFF)));
+
+  _mm256_storeu_ps(r, r01);
+  _mm256_storeu_ps(r + 8, r23);
+#else
+  simd4f c[4];
+  for (int i = 0; i < 4; ++i)
+  {
+    simd4f col = simd_load(b + i * 4);
+    simd4f v = simd_mul(a0, simd_lane<0>(col));
+    v = simd_add(v, simd_mul(a1, simd_lane<1>(col)));
+    v = simd_add(v, simd_mul(a2, simd_lane<2>(col)));
+    c[i] = simd_add(v, simd_mul(a3, simd_lane<3>(col)));
+  }
+
+  simd_store(r, c[0]); simd_store(r + 4, c[1]); simd_store(r + 8, c[2]); simd_store(r + 12, c[3]);
+#endif
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+inline simd4f simd_mat4_transform(const float *m, float x, float y, float z, float w)
+{
+  simd4f v = simd_mul(simd_load(m), simd_splat(x));
+  v = simd_add(v, simd_mul(simd_load(m + 4), simd_splat(y)));
+  v = simd_add(v, simd_mul(simd_load(m + 8), simd_splat(z)));
+  return simd_add(v, simd_mul(simd_load(m + 12), simd_splat(w)));
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Transposes four rows in place
+inline void simd_transpose(simd4f &r0, simd4f &r1, simd4f &r2, simd4f &r3)
+{
+  simd4f t0 = simd_shuffle<0, 1, 0, 1>(r0, r1), t1 = simd_shuffle<2, 3, 2, 3>(r0, r1);
+  simd4f t2 = simd_shuffle<0, 1, 0, 1>(r2, r3), t3 = simd_shuffle<2, 3, 2, 3>(r2, r3);
+  r0 = simd_shuffle<0, 2, 0, 2>(t0, t2);
+  r1 = simd_shuffle<1, 3, 1, 3>(t0, t2);
+  r2 = simd_shuffle<0, 2, 0, 2>(t1, t3);
+  r3 = simd_shuffle<1, 3, 1, 3>(t1, t3);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+inline void simd_mat4_transpose(float *r, const float *m)
+{
+  simd4f c0 = simd_load(m), c1 = simd_load(m + 4), c2 = simd_load(m + 8), c3 = simd_load(m + 12);
+  simd_transpose(c0, c1, c2, c3);
+  simd_store(r, c0); simd_store(r + 4, c1); simd_store(r + 8, c2); simd_store(r + 12, c3);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// 2x2 block helpers for the inverse, each simd4f holds a 2x2 matrix as { m00, m01, m10, m11 }
+inline simd4f simd_mat2_mul(simd4f a, simd4f b)
+{ return simd_add(simd_mul(a, simd_swizzle<0, 3, 0, 3>(b)), simd_mul(simd_swizzle<1, 0, 3, 2>(a), simd_swizzle<2, 1, 2, 1>(b))); }
+
+inline simd4f simd_mat2_adj_mul(simd4f a, simd4f b)
+{ return simd_sub(simd_mul(simd_swizzle<3, 3, 0, 0>(a), b), simd_mul(simd_swizzle<1, 1, 2, 2>(a), simd_swizzle<2, 3, 0, 1>(b))); }
+
+inline simd4f simd_mat2_mul_adj(simd4f a, simd4f b)
+{ return simd_sub(simd_mul(a, simd_swizzle<3, 0, 3, 0>(b)), simd_mul(simd_swizzle<1, 0, 3, 2>(a), simd_swizzle<2, 1, 2, 1>(b))); }
+
+//---------------------------------------------------------------------------------------------------------------------
+// General inverse using the 2x2 block (Schur complement) method, layout agnostic since inv(M^T) = inv(M)^T
+inline void simd_mat4_invert(float *r, const float *m)
+{
+  simd4f c0 = simd_load(m), c1 = simd_load(m + 4), c2 = simd_load(m + 8), c3 = simd_load(m + 12);
+
+  simd4f a = simd_shuffle<0, 1, 0, 1>(c0, c1);
+  simd4f b = simd_shuffle<2, 3, 2, 3>(c0, c1);
+  simd4f c = simd_shuffle<0, 1, 0, 1>(c2, c3);
+  simd4f d = simd_shuffle<2, 3, 2, 3>(c2, c3);
+
+  // determinants of the blocks as { |A|, |B|, |C|, |D| }
+  simd4f detSub = simd_sub(
+    simd_mul(simd_shuffle<0, 2, 0, 2>(c0, c2), simd_shuffle<1, 3, 1, 3>(c1, c3)),
+    simd_mul(simd_shuffle<1, 3, 1, 3>(c0, c2), simd_shuffle<0, 2, 0, 2>(c1, c3)));
+
+  simd4f detA = simd_lane<0>(detSub), detB = simd_lane<1>(detSub);
+  simd4f detC = simd_lane<2>(detSub), detD = simd_lane<3>(detSub);
+
+  simd4f dc = simd_mat2_adj_mul(d, c);
+  simd4f ab = simd_mat2_adj_mul(a, b);
+  simd4f x = simd_sub(simd_mul(detD, a), simd_mat2_mul(b, dc));
+  simd4f w = simd_sub(simd_mul(detA, d), simd_mat2_mul(c, ab));
+  simd4f y = simd_sub(simd_mul(detB, c), simd_mat2_mul_adj(d, ab));
+  simd4f z = simd_sub(simd_mul(detC, b), simd_mat2_mul_adj(a, dc));
+
+  // |M| = |A||D| + |B||C| - tr((A#B)(D#C))
+  simd4f tr = simd_mul(ab, simd_swizzle<0, 2, 1, 3>(dc));
+  tr = simd_add(tr, simd_swizzle<1, 0, 3, 2>(tr));
+  tr = simd_add(tr, simd_swizzle<2, 3, 0, 1>(tr));
+  simd4f det = simd_sub(simd_add(simd_mul(detA, detD), simd_mul(detB, detC)), tr);
+
+  simd4f rcpDet = simd_div(simd_set(1, -1, -1, 1), det);
+  x = simd_mul(x, rcpDet);
+  y = simd_mul(y, rcpDet);
+  z = simd_mul(z, rcpDet);
+  w = simd_mul(w, rcpDet);
+
+  simd_store(r,      simd_shuffle<3, 1, 3, 1>(x, y));
+  simd_store(r + 4,  simd_shuffle<2, 0, 2, 0>(x, y));
+  simd_store(r + 8,  simd_shuffle<3, 1, 3, 1>(z, w));
+  simd_store(r + 12, simd_shuffle<2, 0, 2, 0>(z, w));
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Inverse of a matrix whose last row is (0, 0, 0, 1), i.e. any combination of rotation, scale, shear and translation
+inline void simd_mat4_invert_affine(float *r, const float *m)
+{
+  simd4f c0 = simd_load(m), c1 = simd_load(m + 4), c2 = simd_load(m + 8);
+  simd4f t = simd_load(m + 12);
+
+  // rows of the 3x3 adjugate are the cross products of the columns
+  simd4f r0 = simd_sub(simd_mul(simd_swizzle<1, 2, 0, 3>(c1), simd_swizzle<2, 0, 1, 3>(c2)), simd_mul(simd_swizzle<2, 0, 1, 3>(c1), simd_swizzle<1, 2, 0, 3>(c2)));
+  simd4f r1 = simd_sub(simd_mul(simd_swizzle<1, 2, 0, 3>(c2), simd_swizzle<2, 0, 1, 3>(c0)), simd_mul(simd_swizzle<2, 0, 1, 3>(c2), simd_swizzle<1, 2, 0, 3>(c0)));
+  simd4f r2 = simd_sub(simd_mul(simd_swizzle<1, 2, 0, 3>(c0), simd_swizzle<2, 0, 1, 3>(c1)), simd_mul(simd_swizzle<2, 0, 1, 3>(c0), simd_swizzle<1, 2, 0, 3>(c1)));
+
+  simd4f det = simd_mul(c0, r0);
+  det = simd_add(simd_add(simd_lane<0>(det), simd_lane<1>(det)), simd_lane<2>(det));
+  simd4f rcpDet = simd_div(simd_splat(1), det);
+  r0 = simd_mul(r0, rcpDet);
+  r1 = simd_mul(r1, rcpDet);
+  r2 = simd_mul(r2, rcpDet);
+
+  // transpose rows r0..r2 back to columns, w lanes end up zero
+  simd4f r3 = simd_splat(0);
+  simd_transpose(r0, r1, r2, r3);
+
+  simd4f it = simd_mul(r0, simd_lane<0>(t));
+  it = simd_add(it, simd_mul(r1, simd_lane<1>(t)));
+  it = simd_add(it, simd_mul(r2, simd_lane<2>(t)));
+
+  simd_store(r, r0);
+  simd_store(r + 4, r1);
+  simd_store(r + 8, r2);
+  simd_store(r + 12, simd_sub(simd_set(0, 0, 0, 1), it));
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Transforms packed xyz triplets (w = 1 for points, w = 0 for directions), four at a time in SoA form
+inline void simd_transform_batch3(const float *m, const float *input, float *output, size_t count, float w)
+{
+  simd4f m0 = simd_splat(m[0]), m1 = simd_splat(m[1]), m2 = simd_splat(m[2]);
+  simd4f m4 = simd_splat(m[4]), m5 = simd_splat(m[5]), m6 = simd_splat(m[6]);
+  simd4f m8 = simd_splat(m[8]), m9 = simd_splat(m[9]), m10 = simd_splat(m[10]);
+  simd4f m12 = simd_splat(m[12] * w), m13 = simd_splat(m[13] * w), m14 = simd_splat(m[14] * w);
+
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4, input += 12, output += 12)
+  {
+    // { x0 y0 z0 x1 } { y1 z1 x2 y2 } { z2 x3 y3 z3 } -> { x0..x3 } { y0..y3 } { z0..z3 }
+    simd4f v0 = simd_load(input), v1 = simd_load(input + 4), v2 = simd_load(input + 8);
+    simd4f x = simd_shuffle<0, 3, 0, 2>(v0, simd_shuffle<2, 2, 1, 1>(v1, v2));
+    simd4f y = simd_shuffle<0, 2, 0, 2>(simd_shuffle<1, 1, 0, 0>(v0, v1), simd_shuffle<3, 3, 2, 2>(v1, v2));
+    simd4f z = simd_shuffle<0, 2, 0, 3>(simd_shuffle<2, 2, 1, 1>(v0, v1), v2);
+
+    simd4f rx = simd_add(simd_add(simd_add(simd_mul(m0, x), simd_mul(m4, y)), simd_mul(m8, z)), m12);
+    simd4f ry = simd_add(simd_add(simd_add(simd_mul(m1, x), simd_mul(m5, y)), simd_mul(m9, z)), m13);
+    simd4f rz = simd_add(simd_add(simd_add(simd_mul(m2, x), simd_mul(m6, y)), simd_mul(m10, z)), m14);
+
+    simd_store(output,     simd_shuffle<0, 2, 0, 2>(simd_shuffle<0, 0, 0, 0>(rx, ry), simd_shuffle<0, 0, 1, 1>(rz, rx)));
+    simd_store(output + 4, simd_shuffle<0, 2, 0, 2>(simd_shuffle<1, 1, 1, 1>(ry, rz), simd_shuffle<2, 2, 2, 2>(rx, ry)));
+    simd_store(output + 8, simd_shuffle<0, 2, 0, 2>(simd_shuffle<2, 2, 3, 3>(rz, rx), simd_shuffle<3, 3, 3, 3>(ry, rz)));
+  }
+
+  for (; i < count; ++i, input += 3, output += 3)
+  {
+    float r[4];
+    simd_store(r, simd_mat4_transform(m, input[0], input[1], input[2], w));
+    output[0] = r[0]; output[1] = r[1]; output[2] = r[2];
+  }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+inline void simd_transform_batch4(const float *m, const float *input, float *output, size_t count)
+{
+  simd4f c0 = simd_load(m), c1 = simd_load(m + 4), c2 = simd_load(m + 8), c3 = simd_load(m + 12);
+
+  for (size_t i = 0; i < count; ++i, input += 4, output += 4)
+  {
+    simd4f v = simd_load(input);
+    simd4f r = simd_mul(c0, simd_lane<0>(v));
+    r = simd_add(r, simd_mul(c1, simd_lane<1>(v)));
+    r = simd_add(r, simd_mul(c2, simd_lane<2>(v)));
+    simd_store(output, simd_add(r, simd_mul(c3, simd_lane<3>(v))));
+  }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Builds translation * rotation * scale matrices from xyz positions, xyzw unit quaternions and xyz scales
+inline void simd_compose_trs_batch(const float *positions, const float *rotations, const float *scales, float *output, size_t count)
+{
+  for (size_t i = 0; i < count; i += 4)
+  {
+    // gather up to four instances in SoA form, missing lanes repeat the last instance
+    size_t n = (count - i < 4) ? count - i : 4;
+    const float *p[4], *q[4], *s[4];
+    for (size_t j = 0; j < 4; ++j)
+    {
+      size_t k = i + ((j < n) ? j : n - 1);
+      p[j] = positions + k * 3; q[j] = rotations + k * 4; s[j] = scales + k * 3;
+    }
+
+    simd4f qx = simd_set(q[0][0], q[1][0], q[2][0], q[3][0]);
+    simd4f qy = simd_set(q[0][1], q[1][1], q[2][1], q[3][1]);
+    simd4f qz = simd_set(q[0][2], q[1][2], q[2][2], q[3][2]);
+    simd4f qw = simd_set(q[0][3], q[1][3], q[2][3], q[3][3]);
+    simd4f sx = simd_set(s[0][0], s[1][0], s[2][0], s[3][0]);
+    simd4f sy = simd_set(s[0][1], s[1][1], s[2][1], s[3][1]);
+    simd4f sz = simd_set(s[0][2], s[1][2], s[2][2], s[3][2]);
+
+    simd4f one = simd_splat(1), two = simd_splat(2), zero = simd_splat(0);
+    simd4f x2 = simd_mul(qx, two), y2 = simd_mul(qy, two), z2 = simd_mul(qz, two);
+    simd4f xx = simd_mul(qx, x2), yy = simd_mul(qy, y2), zz = simd_mul(qz, z2);
+    simd4f xy = simd_mul(qx, y2), xz = simd_mul(qx, z2), yz = simd_mul(qy, z2);
+    simd4f wx = simd_mul(qw, x2), wy = simd_mul(qw, y2), wz = simd_mul(qw, z2);
+
+    simd4f col[3][4] = {
+      { simd_mul(simd_sub(one, simd_add(yy, zz)), sx), simd_mul(simd_add(xy, wz), sx), simd_mul(simd_sub(xz, wy), sx), zero },
+      { simd_mul(simd_sub(xy, wz), sy), simd_mul(simd_sub(one, simd_add(xx, zz)), sy), simd_mul(simd_add(yz, wx), sy), zero },
+      { simd_mul(simd_add(xz, wy), sz), simd_mul(simd_sub(yz, wx), sz), simd_mul(simd_sub(one, simd_add(xx, yy)), sz), zero } };
+
+    for (int c = 0; c < 3; ++c)
+      simd_transpose(col[c][0], col[c][1], col[c][2], col[c][3]);
+
+    for (size_t j = 0; j < n; ++j, output += 16)
+    {
+      simd_store(output, col[0][j]);
+      simd_store(output + 4, col[1][j]);
+      simd_store(output + 8, col[2][j]);
+      simd_store(output + 12, simd_set(p[j][0], p[j][1], p[j][2], 1));
+    }
+  }
+}
+
+#pragma endregion
+
 //---------------------------------------------------------------------------------------------------------------------
 template <typename T, size_t Dimensions> struct xvec_traits { typedef T type; static const size_t dimensions = Dimensions; };
 template <typename T, size_t Dimensions> struct xvec_data { };
@@ -14,20 +369,23 @@ template <typename T> struct xvec_data<T, 4> : xvec_traits<T, 4> { union { struc
 //---------------------------------------------------------------------------------------------------------------------
 template <typename T, size_t Dimensions> struct xvec_impl : xvec_data<T, Dimensions>
 {
-  T &operator[](size_t index) { return &x + index; }
-  const T &operator[](size_t index) const { return &x + index; }
+  T &operator[](size_t index) { return this->data[index]; }
+  const T &operator[](size_t index) const { return this->data[index]; }
 
   template <typename... Args> xvec_impl(Args&&... args) { static_assert(sizeof...(Args) == Dimensions, ""); set<0>(args...); }
 
-  template <size_t I, typename T2> void set(T2 &&v) { data[I] = static_cast<T>(v); }
+  template <size_t I, typename T2> void set(T2 &&v) { this->data[I] = static_cast<T>(v); }
   template <size_t I, typename T2, typename... Tail> void set(T2 &&v, Tail&&... t) { set<I>(v); set<I + 1>(t...); }
 };
 
 //---------------------------------------------------------------------------------------------------------------------
 template <typename T> struct xvec2 : xvec_impl<T, 2>
 {
-  xvec2(): xvec_impl(0, 0) { }
-  template <typename T2> xvec2(T2 x, T2 y): xvec_impl(x, y) { }
+  typedef xvec_impl<T, 2> base;
+  using base::x; using base::y; using base::data;
+
+  xvec2(): base(0, 0) { }
+  template <typename T2> xvec2(T2 x, T2 y): base(x, y) { }
 
   xvec2 operator*(T scale) const { return { x * scale, y * scale }; }
   xvec2 operator/(T scale) const { return { x / scale, y / scale }; }
@@ -45,8 +403,11 @@ template <typename T> struct xvec2 : xvec_impl<T, 2>
 //---------------------------------------------------------------------------------------------------------------------
 template <typename T> struct xvec3 : xvec_impl<T, 3>
 {
-  xvec3(): xvec_impl(0, 0, 0) { }
-  template <typename T2> xvec3(T2 x, T2 y, T2 z): xvec_impl(x, y, z) { }
+  typedef xvec_impl<T, 3> base;
+  using base::x; using base::y; using base::z; using base::data;
+
+  xvec3(): base(0, 0, 0) { }
+  template <typename T2> xvec3(T2 x, T2 y, T2 z): base(x, y, z) { }
 
   xvec3 operator*(T scale) const { return { x * scale, y * scale, z * scale }; }
   xvec3 operator/(T scale) const { return { x / scale, y / scale, z / scale }; }
@@ -65,10 +426,13 @@ template <typename T> struct xvec3 : xvec_impl<T, 3>
 //---------------------------------------------------------------------------------------------------------------------
 template <typename T> struct xvec4 : xvec_impl<T, 4>
 {
-  xvec4(): xvec_impl(0, 0, 0, 0) { }
-  template <typename T2> xvec4(T2 x, T2 y, T2 z, T2 w): xvec_impl(x, y, z, w) { }
+  typedef xvec_impl<T, 4> base;
+  using base::x; using base::y; using base::z; using base::w; using base::data;
 
-  explicit xvec4(uint32_t argb): xvec_impl(
+  xvec4(): base(0, 0, 0, 0) { }
+  template <typename T2> xvec4(T2 x, T2 y, T2 z, T2 w): base(x, y, z, w) { }
+
+  explicit xvec4(uint32_t argb): base(
     ((argb >> 16) & 0xFFu) / 255.0f,
     ((argb >> 8) & 0xFFu) / 255.0f,
     (argb & 0xFFu) / 255.0f,
@@ -102,27 +466,114 @@ template <typename T> struct xbox
   T min, max;
 
   T center() const { return (min + max) / 2; }
-  T size() const { max - min; }
+  T size() const { return max - min; }
 
-  template <size_t I> T corner() const { return cross_over<I>(min, max); }
+  // Corners go around the box (gray code), so 0 - 3 of a 2D box are min, (max.x, min.y), max, (min.x, max.y)
+  template <size_t I> T corner() const { return corner(I); }
   T corner(size_t index) const
   {
-    switch (index % (1 << dimensions))
-    {
-      case 0: return cross_over<0>(min, max);
-      case 1: return cross_over<1>(min, max);
-      case 2: return cross_over<2>(min, max);
-      case 3: return cross_over<3>(min, max);
-      case 4: return cross_over<4>(min, max);
-      case 5: return cross_over<5>(min, max);
-      case 6: return cross_over<6>(min, max);
-      case 7: return cross_over<7>(min, max);
-    }
+    size_t mask = index ^ (index >> 1);
+    T result = min;
+
+    for (size_t i = 0; i < dimensions; ++i)
+      if (mask & (static_cast<size_t>(1) << i)) result.data[i] = max.data[i];
+
+    return result;
+  }
+};
+
+//---------------------------------------------------------------------------------------------------------------------
+// Scalar matrix kernels (column-major, output may alias input), also the reference the SIMD kernels are tested against
+template <typename T> struct xmat4_scalar_ops
+{
+  static void mul(T *r, const T *m, const T *n)
+  {
+    T t[16] = {
+      m[0]*n[ 0] + m[4]*n[ 1] + m[8]*n[ 2] + m[12]*n[ 3], m[1]*n[ 0] + m[5]*n[ 1] + m[9]*n[ 2] + m[13]*n[ 3],  m[2]*n[ 0] + m[6]*n[ 1] + m[10]*n[ 2] + m[14]*n[ 3],  m[3]*n[ 0] + m[7]*n[ 1] + m[11]*n[ 2] + m[15]*n[ 3],
+      m[0]*n[ 4] + m[4]*n[ 5] + m[8]*n[ 6] + m[12]*n[ 7], m[1]*n[ 4] + m[5]*n[ 5] + m[9]*n[ 6] + m[13]*n[ 7],  m[2]*n[ 4] + m[6]*n[ 5] + m[10]*n[ 6] + m[14]*n[ 7],  m[3]*n[ 4] + m[7]*n[ 5] + m[11]*n[ 6] + m[15]*n[ 7],
+      m[0]*n[ 8] + m[4]*n[ 9] + m[8]*n[10] + m[12]*n[11], m[1]*n[ 8] + m[5]*n[ 9] + m[9]*n[10] + m[13]*n[11],  m[2]*n[ 8] + m[6]*n[ 9] + m[10]*n[10] + m[14]*n[11],  m[3]*n[ 8] + m[7]*n[ 9] + m[11]*n[10] + m[15]*n[11],
+      m[0]*n[12] + m[4]*n[13] + m[8]*n[14] + m[12]*n[15], m[1]*n[12] + m[5]*n[13] + m[9]*n[14] + m[13]*n[15],  m[2]*n[12] + m[6]*n[13] + m[10]*n[14] + m[14]*n[15],  m[3]*n[12] + m[7]*n[13] + m[11]*n[14] + m[15]*n[15] };
+
+    memcpy(r, t, sizeof(t));
+  }
+
+  static void transform(T *r, const T *m, T x, T y, T z, T w)
+  {
+    T t[4] = {
+      m[0]*x + m[4]*y + m[ 8]*z + m[12]*w,
+      m[1]*x + m[5]*y + m[ 9]*z + m[13]*w,
+      m[2]*x + m[6]*y + m[10]*z + m[14]*w,
+      m[3]*x + m[7]*y + m[11]*z + m[15]*w };
+
+    memcpy(r, t, sizeof(t));
+  }
+
+  static void invert(T *r, const T *m)
+  {
+    T inv[16] = {
+       m[5]*m[10]*m[15] - m[5]*m[11]*m[14] - m[9]*m[6]*m[15] + m[9]*m[7]*m[14] + m[13]*m[6]*m[11] - m[13]*m[7]*m[10],
+      -m[1]*m[10]*m[15] + m[1]*m[11]*m[14] + m[9]*m[2]*m[15] - m[9]*m[3]*m[14] - m[13]*m[2]*m[11] + m[13]*m[3]*m[10],
+       m[1]*m[ 6]*m[15] - m[1]*m[ 7]*m[14] - m[5]*m[2]*m[15] + m[5]*m[3]*m[14] + m[13]*m[2]*m[ 7] - m[13]*m[3]*m[ 6],
+      -m[1]*m[ 6]*m[11] + m[1]*m[ 7]*m[10] + m[5]*m[2]*m[11] - m[5]*m[3]*m[10] - m[ 9]*m[2]*m[ 7] + m[ 9]*m[3]*m[ 6],
+      -m[4]*m[10]*m[15] + m[4]*m[11]*m[14] + m[8]*m[6]*m[15] - m[8]*m[7]*m[14] - m[12]*m[6]*m[11] + m[12]*m[7]*m[10],
+       m[0]*m[10]*m[15] - m[0]*m[11]*m[14] - m[8]*m[2]*m[15] + m[8]*m[3]*m[14] + m[12]*m[2]*m[11] - m[12]*m[3]*m[10],
+      -m[0]*m[ 6]*m[15] + m[0]*m[ 7]*m[14] + m[4]*m[2]*m[15] - m[4]*m[3]*m[14] - m[12]*m[2]*m[ 7] + m[12]*m[3]*m[ 6],
+       m[0]*m[ 6]*m[11] - m[0]*m[ 7]*m[10] - m[4]*m[2]*m[11] + m[4]*m[3]*m[10] + m[ 8]*m[2]*m[ 7] - m[ 8]*m[3]*m[ 6],
+       m[4]*m[ 9]*m[15] - m[4]*m[11]*m[13] - m[8]*m[5]*m[15] + m[8]*m[7]*m[13] + m[12]*m[5]*m[11] - m[12]*m[7]*m[ 9],
+      -m[0]*m[ 9]*m[15] + m[0]*m[11]*m[13] + m[8]*m[1]*m[15] - m[8]*m[3]*m[13] - m[12]*m[1]*m[11] + m[12]*m[3]*m[ 9],
+       m[0]*m[ 5]*m[15] - m[0]*m[ 7]*m[13] - m[4]*m[1]*m[15] + m[4]*m[3]*m[13] + m[12]*m[1]*m[ 7] - m[12]*m[3]*m[ 5],
+      -m[0]*m[ 5]*m[11] + m[0]*m[ 7]*m[ 9] + m[4]*m[1]*m[11] - m[4]*m[3]*m[ 9] - m[ 8]*m[1]*m[ 7] + m[ 8]*m[3]*m[ 5],
+      -m[4]*m[ 9]*m[14] + m[4]*m[10]*m[13] + m[8]*m[5]*m[14] - m[8]*m[6]*m[13] - m[12]*m[5]*m[10] + m[12]*m[6]*m[ 9],
+       m[0]*m[ 9]*m[14] - m[0]*m[10]*m[13] - m[8]*m[1]*m[14] + m[8]*m[2]*m[13] + m[12]*m[1]*m[10] - m[12]*m[2]*m[ 9],
+      -m[0]*m[ 5]*m[14] + m[0]*m[ 6]*m[13] + m[4]*m[1]*m[14] - m[4]*m[2]*m[13] - m[12]*m[1]*m[ 6] + m[12]*m[2]*m[ 5],
+       m[0]*m[ 5]*m[10] - m[0]*m[ 6]*m[ 9] - m[4]*m[1]*m[10] + m[4]*m[2]*m[ 9] + m[ 8]*m[1]*m[ 6] - m[ 8]*m[2]*m[ 5] };
+
+    T det = 1 / (m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12]);
+    for (int i = 0; i < 16; ++i) r[i] = inv[i] * det;
+  }
+
+  static void invert_affine(T *r, const T *m)
+  {
+    T inv[16] = {
+      m[5]*m[10] - m[9]*m[6], m[9]*m[2] - m[1]*m[10], m[1]*m[6] - m[5]*m[2], 0,
+      m[8]*m[6] - m[4]*m[10], m[0]*m[10] - m[8]*m[2], m[4]*m[2] - m[0]*m[6], 0,
+      m[4]*m[9] - m[8]*m[5], m[8]*m[1] - m[0]*m[9], m[0]*m[5] - m[4]*m[1], 0,
+      0, 0, 0, 1 };
+
+    T det = 1 / (m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8]);
+    for (int i = 0; i < 12; ++i) inv[i] *= det;
+
+    inv[12] = -(inv[0]*m[12] + inv[4]*m[13] + inv[ 8]*m[14]);
+    inv[13] = -(inv[1]*m[12] + inv[5]*m[13] + inv[ 9]*m[14]);
+    inv[14] = -(inv[2]*m[12] + inv[6]*m[13] + inv[10]*m[14]);
+    memcpy(r, inv, sizeof(inv));
+  }
 
-    return min;
+  static void transpose(T *r, const T *m)
+  {
+    T t[16] = { m[0], m[4], m[8], m[12], m[1], m[5], m[9], m[13], m[2], m[6], m[10], m[14], m[3], m[7], m[11], m[15] };
+    memcpy(r, t, sizeof(t));
   }
 };
 
+//---------------------------------------------------------------------------------------------------------------------
+// Kernels used by xmat4, the float specialization uses the SIMD kernels
+template <typename T> struct xmat4_ops : xmat4_scalar_ops<T> { };
+
+#if !defined(GL3D_SIMD_NONE)
+template <> struct xmat4_ops<float>
+{
+  static void mul(float *r, const float *m, const float *n) { simd_mat4_mul(r, m, n); }
+  static void transform(float *r, const float *m, float x, float y, float z, float w) { simd_store(r, simd_mat4_transform(m, x, y, z, w)); }
+  static void invert(float *r, const float *m) { simd_mat4_invert(r, m); }
+  static void invert_affine(float *r, const float *m) { simd_mat4_invert_affine(r, m); }
+  static void transpose(float *r, const float *m) { simd_mat4_transpose(r, m); }
+};
+#endif
+
+//---------------------------------------------------------------------------------------------------------------------
+struct uninitialized_tag { };
+
 //---------------------------------------------------------------------------------------------------------------------
 template <typename T> struct xmat4
 {
@@ -145,27 +596,28 @@ template <typename T> struct xmat4
 
   xmat4 &operator=(const xmat4 &rhs) { memcpy(m, rhs.m, sizeof(T) * 16); return *this; }
 
-  xmat4 operator*(const xmat4 &n) const
-  {
-    return xmat4(m[0]*n[ 0] + m[4]*n[ 1] + m[8]*n[ 2] + m[12]*n[ 3], m[1]*n[ 0] + m[5]*n[ 1] + m[9]*n[ 2] + m[13]*n[ 3],  m[2]*n[ 0] + m[6]*n[ 1] + m[10]*n[ 2] + m[14]*n[ 3],  m[3]*n[ 0] + m[7]*n[ 1] + m[11]*n[ 2] + m[15]*n[ 3],
-                 m[0]*n[ 4] + m[4]*n[ 5] + m[8]*n[ 6] + m[12]*n[ 7], m[1]*n[ 4] + m[5]*n[ 5] + m[9]*n[ 6] + m[13]*n[ 7],  m[2]*n[ 4] + m[6]*n[ 5] + m[10]*n[ 6] + m[14]*n[ 7],  m[3]*n[ 4] + m[7]*n[ 5] + m[11]*n[ 6] + m[15]*n[ 7],
-                 m[0]*n[ 8] + m[4]*n[ 9] + m[8]*n[10] + m[12]*n[11], m[1]*n[ 8] + m[5]*n[ 9] + m[9]*n[10] + m[13]*n[11],  m[2]*n[ 8] + m[6]*n[ 9] + m[10]*n[10] + m[14]*n[11],  m[3]*n[ 8] + m[7]*n[ 9] + m[11]*n[10] + m[15]*n[11],
-                 m[0]*n[12] + m[4]*n[13] + m[8]*n[14] + m[12]*n[15], m[1]*n[12] + m[5]*n[13] + m[9]*n[14] + m[13]*n[15],  m[2]*n[12] + m[6]*n[13] + m[10]*n[14] + m[14]*n[15],  m[3]*n[12] + m[7]*n[13] + m[11]*n[14] + m[15]*n[15]);
-  }
+  xmat4 operator*(const xmat4 &n) const { xmat4 r(uninitialized_tag{}); xmat4_ops<T>::mul(r.m, m, n.m); return r; }
 
+  // Transforms a point (w = 1)
   template <typename T2> xvec3<T2> operator*(const xvec3<T2> &rhs) const
   {
-    return xvec3<T2>(m[0]*rhs.x + m[4]*rhs.y + m[ 8]*rhs.z + m[12],
-                 m[1]*rhs.x + m[5]*rhs.y + m[ 9]*rhs.z + m[13],
-                 m[2]*rhs.x + m[6]*rhs.y + m[10]*rhs.z + m[14]);
+    T r[4]; xmat4_ops<T>::transform(r, m, static_cast<T>(rhs.x), static_cast<T>(rhs.y), static_cast<T>(rhs.z), 1);
+    return xvec3<T2>(r[0], r[1], r[2]);
   }
 
   template <typename T2> xvec4<T2> operator*(const xvec4<T2> &rhs) const
   {
-    return xvec3<T2>(m[0]*rhs.x + m[4]*rhs.y + m[ 8]*rhs.z + m[12]*rhs.w,
-                 m[1]*rhs.x + m[5]*rhs.y + m[ 9]*rhs.z + m[13]*rhs.w,
-                 m[2]*rhs.x + m[6]*rhs.y + m[10]*rhs.z + m[14]*rhs.w);
+    T r[4]; xmat4_ops<T>::transform(r, m, static_cast<T>(rhs.x), static_cast<T>(rhs.y), static_cast<T>(rhs.z), static_cast<T>(rhs.w));
+    return xvec4<T2>(r[0], r[1], r[2], r[3]);
+  }
+
+  // Transforms a direction (w = 0), translation is ignored
+  template <typename T2> xvec3<T2> transform_vector(const xvec3<T2> &rhs) const
+  {
+    T r[4]; xmat4_ops<T>::transform(r, m, static_cast<T>(rhs.x), static_cast<T>(rhs.y), static_cast<T>(rhs.z), 0);
+    return xvec3<T2>(r[0], r[1], r[2]);
   }
+
   template <typename T2>
   static xmat4 translation(T2 x, T2 y, T2 z) { return xmat4(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, x, y, z, 1); }
   template <typename T2> static xmat4 translation(const xvec3<T2> &pos) { return translation(pos.x, pos.y, pos.z); }
@@ -224,47 +676,15 @@ template <typename T> struct xmat4
                  -(r + l) / (r - l), -(t + b) / (t - b), -(f + n) / (f - n), 1);
   }
 
-  xmat4 &invert()
-  {
-    T inv[16] = {
-       m[5]*m[10]*m[15] - m[5]*m[11]*m[14] - m[9]*m[6]*m[15] + m[9]*m[7]*m[14] + m[13]*m[6]*m[11] - m[13]*m[7]*m[10],
-      -m[1]*m[10]*m[15] + m[1]*m[11]*m[14] + m[9]*m[2]*m[15] - m[9]*m[3]*m[14] - m[13]*m[2]*m[11] + m[13]*m[3]*m[10],
-       m[1]*m[ 6]*m[15] - m[1]*m[ 7]*m[14] - m[5]*m[2]*m[15] + m[5]*m[3]*m[14] + m[13]*m[2]*m[ 7] - m[13]*m[3]*m[ 6],
-      -m[1]*m[ 6]*m[11] + m[1]*m[ 7]*m[10] + m[5]*m[2]*m[11] - m[5]*m[3]*m[10] - m[ 9]*m[2]*m[ 7] + m[ 9]*m[3]*m[ 6],
-      -m[4]*m[10]*m[15] + m[4]*m[11]*m[14] + m[8]*m[6]*m[15] - m[8]*m[7]*m[14] - m[12]*m[6]*m[11] + m[12]*m[7]*m[10],
-       m[0]*m[10]*m[15] - m[0]*m[11]*m[14] - m[8]*m[2]*m[15] + m[8]*m[3]*m[14] + m[12]*m[2]*m[11] - m[12]*m[3]*m[10],
-      -m[0]*m[ 6]*m[15] + m[0]*m[ 7]*m[14] + m[4]*m[2]*m[15] - m[4]*m[3]*m[14] - m[12]*m[2]*m[ 7] + m[12]*m[3]*m[ 6],
-       m[0]*m[ 6]*m[11] - m[0]*m[ 7]*m[10] - m[4]*m[2]*m[11] + m[4]*m[3]*m[10] + m[ 8]*m[2]*m[ 7] - m[ 8]*m[3]*m[ 6],
-       m[4]*m[ 9]*m[15] - m[4]*m[11]*m[13] - m[8]*m[5]*m[15] + m[8]*m[7]*m[13] + m[12]*m[5]*m[11] - m[12]*m[7]*m[ 9],
-      -m[0]*m[ 9]*m[15] + m[0]*m[11]*m[13] + m[8]*m[1]*m[15] - m[8]*m[3]*m[13] - m[12]*m[1]*m[11] + m[12]*m[3]*m[ 9],
-       m[0]*m[ 5]*m[15] - m[0]*m[ 7]*m[13] - m[4]*m[1]*m[15] + m[4]*m[3]*m[13] + m[12]*m[1]*m[ 7] - m[12]*m[3]*m[ 5],
-      -m[0]*m[ 5]*m[11] + m[0]*m[ 7]*m[ 9] + m[4]*m[1]*m[11] - m[4]*m[3]*m[ 9] - m[ 8]*m[1]*m[ 7] + m[ 8]*m[3]*m[ 5],
-      -m[4]*m[ 9]*m[14] + m[4]*m[10]*m[13] + m[8]*m[5]*m[14] - m[8]*m[6]*m[13] - m[12]*m[5]*m[10] + m[12]*m[6]*m[ 9],
-       m[0]*m[ 9]*m[14] - m[0]*m[10]*m[13] - m[8]*m[1]*m[14] + m[8]*m[2]*m[13] + m[12]*m[1]*m[10] - m[12]*m[2]*m[ 9],
-      -m[0]*m[ 5]*m[14] + m[0]*m[ 6]*m[13] + m[4]*m[1]*m[14] - m[4]*m[2]*m[13] - m[12]*m[1]*m[ 6] + m[12]*m[2]*m[ 5],
-       m[0]*m[ 5]*m[10] - m[0]*m[ 6]*m[ 9] - m[4]*m[1]*m[10] + m[4]*m[2]*m[ 9] + m[ 8]*m[1]*m[ 6] - m[ 8]*m[2]*m[ 5] };
+  xmat4 &invert() { xmat4_ops<T>::invert(m, m); return *this; }
 
-    T det = 1 / (m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12]), *pm = m;
-    
-    *pm++ = inv[ 0]*det; *pm++ = inv[ 1]*det; *pm++ = inv[ 2]*det; *pm++ = inv[ 3]*det;
-    *pm++ = inv[ 4]*det; *pm++ = inv[ 5]*det; *pm++ = inv[ 6]*det; *pm++ = inv[ 7]*det;
-    *pm++ = inv[ 8]*det; *pm++ = inv[ 9]*det; *pm++ = inv[10]*det; *pm++ = inv[11]*det;
-    *pm++ = inv[12]*det; *pm++ = inv[13]*det; *pm++ = inv[14]*det; *pm   = inv[15]*det;
+  // Faster inverse for matrices with (0, 0, 0, 1) as the last row (no projection)
+  xmat4 &invert_affine() { xmat4_ops<T>::invert_affine(m, m); return *this; }
 
-    return *this;
-  }
+  xmat4 &transpose() { xmat4_ops<T>::transpose(m, m); return *this; }
 
-  xmat4 &transpose()
-  {
-    swap(m[1], m[4]);
-    swap(m[2], m[8]);
-    swap(m[3], m[12]);
-    swap(m[6], m[9]);
-    swap(m[7], m[13]);
-    swap(m[11], m[14]);
-
-    return *this;
-  }
+private:
+  explicit xmat4(uninitialized_tag) { }
 };
 
 }
@@ -317,4 +737,71 @@ typedef detail::xbox<vec2> box2;
 typedef detail::xbox<ivec2> ibox2;
 typedef detail::xbox<vec3> box3;
 
+
+//---------------------------------------------------------------------------------------------------------------------
+// Batch transforms over arrays, output may be the same array as input. For normals pass the inverse transpose matrix
+// to transform_vectors().
+inline void transform_points(const mat4 &m, const vec3 *input, vec3 *output, size_t count)
+{
+  static_assert(sizeof(vec3) == 3 * sizeof(float), "vec3 must be tightly packed");
+  detail::simd_transform_batch3(m.data, input->data, output->data, count, 1.0f);
+}
+
+inline void transform_vectors(const mat4 &m, const vec3 *input, vec3 *output, size_t count)
+{
+  static_assert(sizeof(vec3) == 3 * sizeof(float), "vec3 must be tightly packed");
+  detail::simd_transform_batch3(m.data, input->data, output->data, count, 0.0f);
+}
+
+inline void transform_points(const mat4 &m, const vec4 *input, vec4 *output, size_t count)
+{
+  static_assert(sizeof(vec4) == 4 * sizeof(float), "vec4 must be tightly packed");
+  detail::simd_transform_batch4(m.data, input->data, output->data, count);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// output[i] = parent * input[i]
+inline void multiply_matrices(const mat4 &parent, const mat4 *input, mat4 *output, size_t count)
+{
+  for (size_t i = 0; i < count; ++i)
+    detail::xmat4_ops<float>::mul(output[i].m, parent.m, input[i].m);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// output[i] = translation(positions[i]) * rotation(rotations[i]) * scale(scales[i]), rotations are unit quaternions
+inline void compose_trs(const vec3 *positions, const vec4 *rotations, const vec3 *scales, mat4 *output, size_t count)
+{
+  static_assert(sizeof(vec3) == 3 * sizeof(float) && sizeof(vec4) == 4 * sizeof(float), "vectors must be tightly packed");
+  detail::simd_compose_trs_batch(positions->data, rotations->data, scales->data, output->data, count);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+// Splits [0, count) into contiguous ranges of at least minBatchSize and calls fn(begin, end) for each of them on the
+// calling thread and worker threads, e.g.:
+//   parallel_for(n, 4096, [&](size_t b, size_t e) { transform_points(m, in + b, out + b, e - b); });
+template <typename F> void parallel_for(size_t count, size_t minBatchSize, F &&fn)
+{
+  size_t numThreads = maximum(1u, std::thread::hardware_concurrency());
+  size_t numBatches = minimum(numThreads, count / maximum<size_t>(1, minBatchSize));
+  if (numBatches < 2)
+  {
+    if (count) fn(static_cast<size_t>(0), count);
+    return;
+  }
+
+  std::vector<std::thread> workers;
+  workers.reserve(numBatches - 1);
+
+  size_t begin = 0;
+  for (size_t i = 0; i < numBatches - 1; ++i)
+  {
+    size_t end = begin + count / numBatches;
+    workers.emplace_back([&fn, begin, end]() { fn(begin, end); });
+    begin = end;
+  }
+
+  fn(begin, count);
+  for (auto &&w : workers) w.join();
+}
+
 }
@@ -1,164 +1,13 @@
 #ifndef __GLU2D_H__
 #define __GLU2D_H__
 
-#include <functional>
-#include <map>
-#include <memory>
-#include <thread>
-
-#include "gl3d_2d.h"
+#include "gl3d_window.h"
 
 #if defined(WIN32)
 #include <windowsx.h>
 #else
 #endif
 
-namespace gl3d {
-
-typedef int window_id_t;
-const window_id_t invalid_window_id = static_cast<window_id_t>(-1);
-const window_id_t main_window_id = 0;
-
-struct window_flag
-{
-  enum 
-  {
-    none = 0,
-    resizable = 1,
-    fullscreen = 2,
-    title = 4,
-  };
-};
-
-static const unsigned default_window_flags = window_flag::resizable | window_flag::title;
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-enum class key
-{
-  unknown = 0,
-  enter = 13,
-  tab = 8, backspace = 9,
-  escape = 27,
-  space = ' ',
-  a = 'A', b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, q, r, s, t, u, v, w, x, y, z,
-  num_0 = '0', num_1, num_2, num_3, num_4, num_5, num_6, num_7, num_8, num_9,
-  numpad_0, numpad_1, numpad_2, numpad_3, numpad_4, numpad_5, numpad_6, numpad_7, numpad_8, numpad_9,
-  up, right, down, left,
-  insert, del,
-  home, end,
-  page_up, page_down,
-  f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12,
-  ctrl, alt, shift,
-
-  last
-};
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-enum class mouse_button
-{
-  unknown = 0,
-  left, right, middle,
-  special_0, special_1,
-  back, forward,
-
-  last
-};
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-enum class event_type
-{
-  unknown = 0,
-  paint,
-  open, close, resize,
-  key_down, key_up, key_press,
-  mouse_down, mouse_up, mouse_move, mouse_wheel
-};
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-struct mod_flag
-{
-  enum
-  {
-    none = 0,
-    alt = 1,
-    control = 2,
-    shift = 4,
-    mouse_left = 8,
-    mouse_right = 16,
-  };
-};
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-struct event
-{
-  event_type type;
-  window_id_t window_id;
-  unsigned mods = mod_flag::none;
-
-  union
-  {
-    struct { bool down; key key; int key_char; } keyboard;
-    struct { int width, height; } resize;
-    struct { bool down; int x, y, dx, dy; mouse_button button; } mouse;
-    struct { int dx, dy; } wheel;
-  };
-
-  event(event_type et, window_id_t id)
-    : type(et)
-    , window_id(id)
-  {
-    
-  }
-};
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-extern context2d *current_context2d;
-extern context3d *current_context3d;
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-void run();
-
-float time();
-double timed();
-
-float delta();
-double deltad();
-
-window_id_t window_open(const std::string &title, int width, int height, unsigned flags = default_window_flags);
-
-bool window_close(window_id_t id = main_window_id);
-
-void set_window_title(const std::string &text, window_id_t id = main_window_id);
-
-const std::string &window_title(window_id_t id = main_window_id);
-
-void set_window_size(int width, int height, window_id_t = main_window_id);
-
-ivec2 get_window_size(window_id_t id = main_window_id);
-
-typedef std::function<void(const event &)> event_handler_t;
-
-extern event_handler_t event_handler;
-
-typedef std::function<void()> tick_handler_t;
-
-extern tick_handler_t tick_handler;
-  
-void send(const event &e);
-
-void tick();
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-}
-
 #endif // __GLU2D_H__
 
 #ifdef GL3D_IMPLEMENTATION
@@ -169,10 +18,10 @@ void tick();
 
 namespace gl3d {
 
-static context2d *current_context2d = nullptr;
-static context3d *current_context3d = nullptr;
-static event_handler_t event_handler;
-static tick_handler_t tick_handler;
+context2d *current_context2d = nullptr;
+context3d *current_context3d = nullptr;
+event_handler_t event_handler;
+tick_handler_t tick_handler;
 
 bool g_should_quit = false;
 window_id_t g_next_id = 0;
@@ -400,7 +249,10 @@ window::~window()
 void window::make_current()
 {
   if (wglGetCurrentContext() != hglrc)
+  {
     wglMakeCurrent(hdc, hglrc);
+    gl_state.invalidate();
+  }
 }
 
 //---------------------------------------------------------------------------------------------------------------------
@@ -459,9 +311,13 @@ void tick()
 
   if (tick_handler != nullptr)
   {
+    // the 2D context records into buffers of the main window's GL context, which has to be current for that
     auto iter = g_windows.find(main_window_id);
     if (iter != g_windows.end())
+    {
+      iter->second->make_current();
       current_context2d = &(iter->second->ctx2d);
+    }
     else
       current_context2d = nullptr;
 
@@ -476,13 +332,17 @@ void tick()
     w.make_current();
     current_context2d = &(w.ctx2d);
     current_context3d = &(w.ctx3d);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    current_context3d->set_backbuffer_size(w.width, w.height);
     current_context3d->clear();
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     send({ event_type::paint, w.id });
+    current_context3d->flush();
+    current_context3d->bind(static_cast<render_target *>(nullptr));
     w.ctx2d.render(w.width, w.height);
     w.flip();
   }
 
+  gl_state.end_frame();
   current_context2d = nullptr;
   current_context3d = nullptr;
 }
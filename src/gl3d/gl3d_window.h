@@ -0,0 +1,159 @@
+#ifndef __GL3D_WINDOW_H__
+#define __GL3D_WINDOW_H__
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include "gl3d_2d.h"
+
+// Window, event and timing API shared by the platform backends (gl3d_win32.h, gl3d_headless.h)
+
+namespace gl3d {
+
+typedef int window_id_t;
+const window_id_t invalid_window_id = static_cast<window_id_t>(-1);
+const window_id_t main_window_id = 0;
+
+struct window_flag
+{
+  enum 
+  {
+    none = 0,
+    resizable = 1,
+    fullscreen = 2,
+    title = 4,
+  };
+};
+
+static const unsigned default_window_flags = window_flag::resizable | window_flag::title;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+enum class key
+{
+  unknown = 0,
+  enter = 13,
+  tab = 8, backspace = 9,
+  escape = 27,
+  space = ' ',
+  a = 'A', b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, q, r, s, t, u, v, w, x, y, z,
+  num_0 = '0', num_1, num_2, num_3, num_4, num_5, num_6, num_7, num_8, num_9,
+  numpad_0, numpad_1, numpad_2, numpad_3, numpad_4, numpad_5, numpad_6, numpad_7, numpad_8, numpad_9,
+  up, right, down, left,
+  insert, del,
+  home, end,
+  page_up, page_down,
+  f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12,
+  ctrl, alt, shift,
+
+  last
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+enum class mouse_button
+{
+  unknown = 0,
+  left, right, middle,
+  special_0, special_1,
+  back, forward,
+
+  last
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+enum class event_type
+{
+  unknown = 0,
+  paint,
+  open, close, resize,
+  key_down, key_up, key_press,
+  mouse_down, mouse_up, mouse_move, mouse_wheel
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct mod_flag
+{
+  enum
+  {
+    none = 0,
+    alt = 1,
+    control = 2,
+    shift = 4,
+    mouse_left = 8,
+    mouse_right = 16,
+  };
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct event
+{
+  event_type type;
+  window_id_t window_id;
+  unsigned mods = mod_flag::none;
+
+  union
+  {
+    struct { bool down; gl3d::key key; int key_char; } keyboard;
+    struct { int width, height; } resize;
+    struct { bool down; int x, y, dx, dy; mouse_button button; } mouse;
+    struct { int dx, dy; } wheel;
+  };
+
+  event(event_type et, window_id_t id)
+    : type(et)
+    , window_id(id)
+  {
+    
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+extern context2d *current_context2d;
+extern context3d *current_context3d;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void run();
+
+float time();
+double timed();
+
+float delta();
+double deltad();
+
+window_id_t window_open(const std::string &title, int width, int height, unsigned flags = default_window_flags);
+
+bool window_close(window_id_t id = main_window_id);
+
+void set_window_title(const std::string &text, window_id_t id = main_window_id);
+
+const std::string &window_title(window_id_t id = main_window_id);
+
+void set_window_size(int width, int height, window_id_t = main_window_id);
+
+ivec2 get_window_size(window_id_t id = main_window_id);
+
+typedef std::function<void(const event &)> event_handler_t;
+
+extern event_handler_t event_handler;
+
+typedef std::function<void()> tick_handler_t;
+
+extern tick_handler_t tick_handler;
+  
+void send(const event &e);
+
+void tick();
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}
+
+#endif // __GL3D_WINDOW_H__
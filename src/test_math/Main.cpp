@@ -0,0 +1,192 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <gl3d/gl3d_math.h>
+
+// Checks the float matrix kernels of the compiled SIMD backend against the scalar kernels and times both. Build with
+// GL3D_SIMD_NONE, GL3D_SIMD_AVX (or /arch:AVX) or for ARM to cover the other backends.
+
+using namespace gl3d;
+typedef detail::xmat4_scalar_ops<float> scalar;
+typedef detail::xmat4_ops<float> simd;
+
+static uint32_t rng = 12345;
+static float rand_range(float lo, float hi)
+{
+  rng = rng * 1664525u + 1013904223u;
+  return lo + (hi - lo) * (rng >> 8) / 16777216.0f;
+}
+
+// Distance in representable floats, values of opposite sign count through zero
+static uint32_t ulps(float a, float b)
+{
+  int32_t ia, ib;
+  memcpy(&ia, &a, 4); memcpy(&ib, &b, 4);
+  if (ia < 0) ia = INT32_MIN - ia;
+  if (ib < 0) ib = INT32_MIN - ib;
+  uint32_t ua = static_cast<uint32_t>(ia), ub = static_cast<uint32_t>(ib);
+  return (ia > ib) ? ua - ub : ub - ua;
+}
+
+static uint32_t max_ulps(const float *a, const float *b, size_t count)
+{
+  uint32_t result = 0;
+  for (size_t i = 0; i < count; ++i) result = maximum(result, ulps(a[i], b[i]));
+  return result;
+}
+
+// Largest difference in ulps of the largest reference element, elements near zero after cancellation would
+// otherwise dominate the inverse
+static uint32_t max_norm_ulps(const float *a, const float *b, size_t count)
+{
+  float diff = 0, norm = 0;
+  for (size_t i = 0; i < count; ++i) { diff = maximum(diff, fabsf(a[i] - b[i])); norm = maximum(norm, fabsf(b[i])); }
+  return static_cast<uint32_t>(ceil(diff / (norm * 1.1920929e-7f)));
+}
+
+// Rotation, scale and translation, well conditioned for the inverse
+static mat4 random_affine()
+{
+  return mat4::translation(rand_range(-100, 100), rand_range(-100, 100), rand_range(-100, 100))
+    * mat4::rotate(rand_range(-180, 180), normalize(vec3(rand_range(-1, 1), rand_range(-1, 1), rand_range(1, 2))))
+    * mat4::scale(rand_range(0.5f, 2), rand_range(0.5f, 2), rand_range(0.5f, 2));
+}
+
+// Diagonally dominant, so it stays far from singular
+static mat4 random_general()
+{
+  mat4 m;
+  for (int i = 0; i < 16; ++i) m.m[i] = rand_range(-1, 1) + ((i % 5 == 0) ? 4.0f : 0.0f);
+  return m;
+}
+
+static int failures = 0;
+
+static void check(const char *name, uint32_t ulp, uint32_t bound)
+{
+  bool ok = ulp <= bound;
+  printf("%-26s max %6u ulp (bound %u) %s\n", name, ulp, bound, ok ? "ok" : "FAILED");
+  if (!ok) ++failures;
+}
+
+template <typename F> static double time_ns(size_t count, F &&fn)
+{
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+}
+
+int main()
+{
+#if defined(GL3D_SIMD_AVX)
+  printf("backend: SSE + AVX\n");
+#elif defined(GL3D_SIMD_SSE)
+  printf("backend: SSE\n");
+#elif defined(GL3D_SIMD_NEON)
+  printf("backend: NEON\n");
+#else
+  printf("backend: scalar\n");
+#endif
+
+  const size_t count = 10000;
+  std::vector<mat4> a(count), b(count), g(count);
+  std::vector<vec3> points(count);
+  std::vector<vec4> vectors(count);
+  for (size_t i = 0; i < count; ++i)
+  {
+    a[i] = random_affine(); b[i] = random_affine(); g[i] = random_general();
+    points[i] = vec3(rand_range(-10, 10), rand_range(-10, 10), rand_range(-10, 10));
+    vectors[i] = vec4(rand_range(-10, 10), rand_range(-10, 10), rand_range(-10, 10), rand_range(-1, 1));
+  }
+
+  // multiply, transpose and transforms do the same operations in the same order, inverses are computed differently
+  uint32_t mul = 0, transpose = 0, transform = 0, invert = 0, invertAffine = 0, batch3 = 0, batch4 = 0, batchMul = 0;
+  std::vector<vec3> out3(count);
+  std::vector<vec4> out4(count);
+  std::vector<mat4> outM(count);
+  transform_points(a[0], points.data(), out3.data(), count);
+  transform_points(a[0], vectors.data(), out4.data(), count);
+  multiply_matrices(a[0], b.data(), outM.data(), count);
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    float r[16], e[16];
+    simd::mul(r, a[i].m, b[i].m); scalar::mul(e, a[i].m, b[i].m);
+    mul = maximum(mul, max_ulps(r, e, 16));
+
+    simd::transpose(r, g[i].m); scalar::transpose(e, g[i].m);
+    transpose = maximum(transpose, max_ulps(r, e, 16));
+
+    auto &v = vectors[i];
+    simd::transform(r, g[i].m, v.x, v.y, v.z, v.w);
+    scalar::transform(e, g[i].m, v.x, v.y, v.z, v.w);
+    transform = maximum(transform, max_ulps(r, e, 4));
+
+    simd::invert(r, g[i].m); scalar::invert(e, g[i].m);
+    invert = maximum(invert, max_norm_ulps(r, e, 16));
+
+    simd::invert_affine(r, a[i].m); scalar::invert_affine(e, a[i].m);
+    invertAffine = maximum(invertAffine, max_norm_ulps(r, e, 16));
+
+    scalar::transform(e, a[0].m, points[i].x, points[i].y, points[i].z, 1);
+    batch3 = maximum(batch3, max_ulps(out3[i].data, e, 3));
+
+    scalar::transform(e, a[0].m, v.x, v.y, v.z, v.w);
+    batch4 = maximum(batch4, max_ulps(out4[i].data, e, 4));
+
+    scalar::mul(e, a[0].m, b[i].m);
+    batchMul = maximum(batchMul, max_ulps(outM[i].m, e, 16));
+  }
+
+  check("mat4 multiply", mul, 0);
+  check("mat4 transpose", transpose, 0);
+  check("mat4 transform", transform, 0);
+  check("mat4 invert (norm)", invert, 16);
+  check("mat4 invert_affine (norm)", invertAffine, 16);
+  check("transform_points vec3", batch3, 0);
+  check("transform_points vec4", batch4, 0);
+  check("multiply_matrices", batchMul, 0);
+
+  // microbenchmark, the sums keep the results alive
+  float sink = 0;
+  auto bench = [&](const char *name, double scalarNs, double simdNs) {
+    printf("%-26s scalar %7.2f ns  simd %7.2f ns  %.2fx\n", name, scalarNs, simdNs, scalarNs / simdNs);
+  };
+
+  for (int repeat = 0; repeat < 2; ++repeat)
+  {
+    bool report = repeat == 1; // the first round warms up caches and clocks
+    double s, v;
+
+    s = time_ns(count, [&]() { for (size_t i = 0; i < count; ++i) { scalar::mul(outM[i].m, a[i].m, b[i].m); } });
+    v = time_ns(count, [&]() { for (size_t i = 0; i < count; ++i) { simd::mul(outM[i].m, a[i].m, b[i].m); } });
+    sink += outM[count / 2].m[5];
+    if (report) bench("mat4 multiply", s, v);
+
+    s = time_ns(count, [&]() { for (size_t i = 0; i < count; ++i) { scalar::invert(outM[i].m, g[i].m); } });
+    v = time_ns(count, [&]() { for (size_t i = 0; i < count; ++i) { simd::invert(outM[i].m, g[i].m); } });
+    sink += outM[count / 2].m[5];
+    if (report) bench("mat4 invert", s, v);
+
+    s = time_ns(count, [&]() { for (size_t i = 0; i < count; ++i) { scalar::invert_affine(outM[i].m, a[i].m); } });
+    v = time_ns(count, [&]() { for (size_t i = 0; i < count; ++i) { simd::invert_affine(outM[i].m, a[i].m); } });
+    sink += outM[count / 2].m[5];
+    if (report) bench("mat4 invert_affine", s, v);
+
+    s = time_ns(count, [&]() {
+      for (size_t i = 0; i < count; ++i)
+      {
+        float e[4];
+        scalar::transform(e, a[0].m, points[i].x, points[i].y, points[i].z, 1);
+        out3[i] = vec3(e[0], e[1], e[2]);
+      }
+    });
+    v = time_ns(count, [&]() { transform_points(a[0], points.data(), out3.data(), count); });
+    sink += out3[count / 2].x;
+    if (report) bench("transform_points vec3", s, v);
+  }
+
+  printf("%s (%g)\n", failures ? "FAILED" : "passed", sink);
+  return failures ? 1 : 0;
+}